@@ -2,6 +2,11 @@
 // ────────────────────────────────────────────────────────────────
 // • Continuous updates to Arduino IoT Cloud every ~2 s  (temp1‑4, dhtTemp, dhtHumi)
 // • Precise 10‑min sampling for Google‑Sheet hourly average
+// • Threshold / slope alerts checked on every fast read, queued and posted off the sampling path
+// • One acquisition service feeds a timestamped reading cache; 10‑min samples reuse it
+// • DS18B20 at 9‑bit for the fast stream, switched to 12‑bit just ahead of each 10‑min sample
+// • Failing sensors quarantined with backoff; per‑sensor health goes into the hourly report
+// • Non‑blocking boot: first reading ~750 ms after reset while NTP / Cloud connect in the background
 // ────────────────────────────────────────────────────────────────
 
 #include "thingProperties.h"          // defines: temp1‑4, dhtTemp, dhtHumi
@@ -11,6 +16,7 @@
 #include <ESP8266HTTPClient.h>
 #include <WiFiClientSecure.h>
 #include <time.h>
+#include <sys/time.h>
 
 // ───── Google Sheet Webhook ─────
 const char* GOOGLE_SCRIPT_URL = "https://script.google.com/macros/s/AKfycbwgPGSPbvbY2sWSYUBstWece1FNbq5NLLHkBIBBhaRspdGKvDbgaiw0vC6cfDgHKdIMlQ/exec";
@@ -52,23 +58,92 @@ int lastSampleMin = -1, lastReportHr = -1;
 
 // timers for continuous Cloud push
 unsigned long lastFastRead = 0;
-constexpr unsigned long FAST_READ_MS = 5000; // read sensors every 5 s
+constexpr unsigned long FAST_READ_MS = 5000; // start a conversion every 5 s
+
+// ───── Immediate alerts ─────
+// Channels: sensor1‑4 (DS18B20), dhttemp, dhthumidity. NAN disables a check.
+constexpr uint8_t NUM_CH = 6;
+const char* const CH_KEY[NUM_CH] = {"sensor1","sensor2","sensor3","sensor4","dhttemp","dhthumidity"};
+constexpr float ALERT_HIGH[NUM_CH]  = {70, 70, 70, 70, 40, NAN};     // fire above (°C / %)
+constexpr float ALERT_LOW[NUM_CH]   = {NAN, NAN, NAN, NAN, NAN, 40}; // fire below
+constexpr float ALERT_SLOPE[NUM_CH] = {0.5, 0.5, 0.5, 0.5, 0.5, 2};  // |Δ| per minute
+constexpr float ALERT_HYST[NUM_CH]  = {2, 2, 2, 2, 1, 3};            // clear margin (slope: half)
+constexpr unsigned long SLOPE_BASE_MS = 60000;      // slope measured over ≥1 min
+constexpr unsigned long ALERT_GAP_MS  = 15UL*60000; // ≤1 alert per channel per 15 min
+enum : uint8_t { AL_HIGH, AL_LOW, AL_SLOPE, AL_KINDS };
+enum : uint8_t { AL_CLEAR, AL_SENT, AL_MUTED };     // MUTED: firing but rate‑limited → sent after the gap
+const char* const AL_NAME[AL_KINDS] = {"above","below","slope"};
+uint8_t alState[NUM_CH][AL_KINDS];
+unsigned long alLastMs[NUM_CH];
+float slopeRef[NUM_CH]; unsigned long slopeRefMs[NUM_CH];
+// A POST blocks up to 8 s, so alerts are queued and sent from loop() once no 10‑min sample is due
+constexpr uint8_t ALQ_MAX = 4;                   // oldest dropped when full
+constexpr long ALERT_HOLD_MS = 10000;            // no alert POST this close to a 10‑min mark
+char alQ[ALQ_MAX][200]; uint8_t alQHead = 0, alQn = 0;
+char devId[16];                                  // "agro-<chip id>", same in alerts and hourly reports
+unsigned long ttfsMs = 0, ntpMs = 0, ttfuMs = 0; // ms from boot to first reading / valid clock / accepted upload
+
+// ───── TLS buffers ─────
+// BearSSL adds 325 B (in) / 85 B (out) to setBufferSizes(); without it a session takes 16K+325 / 837
+constexpr int TLS_RX_FULL = 16384, TLS_TX = 512, TLS_DEFAULT = 16384+325+837, TLS_OVERHEAD = 325+85;
+int mfln = -1;                                   // fragment length the host accepts; 0 none, -1 not probed yet
+int tlsRx = 0; unsigned long tlsHeap = 0;        // last upload: receive buffer, free heap with the session open
+
+// ───── Acquisition service ─────
+// Sole owner of the 1‑Wire bus and DHT. Conversions run non‑blocking and each result is
+// published to `latest` with its millis() stamp; Cloud, alerts and the 10‑min sampler read it.
+// DS18B20 resolution: 9‑bit (0.5 °C, ~94 ms) for the Cloud/alert stream, 12‑bit (0.0625 °C,
+// ~750 ms) for the 10‑min samples. Conversion time halves per bit dropped.
+constexpr uint8_t BITS_FAST = 9, BITS_ALIGNED = 12;
+constexpr unsigned long CONV_MS_12 = 750;
+constexpr unsigned long FRESH_MS = 2000; // 10‑min sample reuses a 12‑bit reading at most this old
+struct Reading { float v[NUM_CH]; unsigned long ms; uint8_t bits; }; // ms==0 → nothing yet
+Reading latest;
+bool convBusy = false; unsigned long convStartMs = 0, convMs = CONV_MS_12; uint8_t convBits = 0;
+uint8_t dsBits[NUM_DS];                  // resolution last written to each probe; 0 → unknown
+time_t armedMark = 0;                    // 10‑min mark already served (reused or converted)
+
+// ───── Sensor health ─────
+// Per sensor (sensor1‑4, then the DHT). After QUAR_AFTER failures in a row a sensor is
+// quarantined: skipped (NAN, no bus time) and only re‑probed with exponential backoff.
+// fails / crc / sentinel count since the last hourly report, which carries them.
+constexpr uint8_t NUM_SENS = NUM_DS+1, SENS_DHT = NUM_DS;
+constexpr uint8_t QUAR_AFTER = 3;
+constexpr unsigned long QUAR_BASE_MS = 10000, QUAR_MAX_MS = 10UL*60000; // re‑probe backoff
+enum : uint8_t { RD_OK, RD_MISSING, RD_CRC, RD_SENTINEL, RD_SKIPPED }; // read outcome per sensor
+struct Health { uint8_t streak; uint16_t fails, crc, sentinel; unsigned long retryMs; };
+Health health[NUM_SENS];
 
 // ---- prototypes ----
 void clearBuffers();
 float avg(const float*, uint8_t);
 void postSheet();
-void syncNTP();
-void readSensorsFast();
+void pushFast();
+void startConversion(uint8_t);
+void setProbeBits(uint8_t);
+bool serviceAcquisition();
+void readProbes(int16_t*,uint8_t*);
+uint8_t readScratch(uint8_t,int16_t&);
+void benchBus();
+bool sensorDue(uint8_t);
+void sensorResult(uint8_t,uint8_t);
+bool fresh();
+long msToMark(time_t&);
+void checkAlerts(const float*);
+bool postJson(const char*);
+void queueAlert(const char*);
 
 // ───────────── setup ─────────────
 void setup(){
-  Serial.begin(9600); delay(1500);
+  Serial.begin(9600);
+  snprintf(devId,sizeof(devId),"agro-%06x",ESP.getChipId());
+  ds.begin(); ds.setWaitForConversion(false); dht.begin();
+  lastFastRead=millis(); startConversion(BITS_ALIGNED); // read by loop() once done; bus bench follows it
+  configTime(GMT_OFFSET,0,NTP1,NTP2);                  // SNTP runs in the background; loop() waits for it
   initProperties();
   ArduinoCloud.begin(ArduinoIoTPreferredConnection);
-  ds.begin(); dht.begin();
-  configTime(GMT_OFFSET,0,NTP1,NTP2); syncNTP();
   clearBuffers();
+  for(uint8_t c=0;c<NUM_CH;c++){ for(uint8_t k=0;k<AL_KINDS;k++) alState[c][k]=AL_CLEAR; alLastMs[c]=0; slopeRef[c]=NAN; latest.v[c]=NAN; }
   Serial.println(F("Init OK"));
 }
 
@@ -76,51 +151,196 @@ void setup(){
 void loop(){
   ArduinoCloud.update();
 
-  // 1. FAST sensor read for Cloud every 5 s -------------
-  if(millis()-lastFastRead>=FAST_READ_MS){
-    lastFastRead = millis();
-    readSensorsFast();
+  // 1. Acquisition: publish a finished conversion, then start the next one ---
+  if(serviceAcquisition()){
+    if(!ttfsMs){ ttfsMs=millis(); Serial.printf("[BOOT] first reading after %lu ms\n",ttfsMs); benchBus(); }
+    pushFast();
+  }
+  if(!convBusy){
+    time_t mark; long toMark=msToMark(mark);
+    if(toMark>=0 && toMark<=(long)CONV_MS_12 && armedMark!=mark){
+      // Reuse a reading that will still be fresh on the mark, else convert now so it
+      // completes on it; the 5 s cadence re‑phases from here, so no extra bus cycle.
+      armedMark=mark;
+      if(latest.bits!=BITS_ALIGNED || millis()-latest.ms+toMark>FRESH_MS){ lastFastRead=millis(); startConversion(BITS_ALIGNED); }
+    } else if(millis()-lastFastRead>=FAST_READ_MS){
+      lastFastRead=millis(); startConversion(BITS_FAST);
+    }
   }
 
   // 2. Time‑aligned sampling / reporting ---------------
   time_t now=time(nullptr); if(now<MIN_EPOCH) return; tm t; localtime_r(&now,&t);
+  if(!ntpMs){ ntpMs=millis(); Serial.printf("[BOOT] clock valid after %lu ms\n",ntpMs); }
 
-  // 10‑min sample into buffer
-  if(t.tm_min%SAMPLE_STEP==0 && t.tm_sec==0 && lastSampleMin!=t.tm_min){
-    ds.requestTemperatures();
-    for(uint8_t i=0;i<NUM_DS;i++){
-      float tc = ds.getTempC(DS_ADDR[i]);
-      dsBuf[i][bufIdx] = (tc==DEVICE_DISCONNECTED_C||tc==85||tc==-127)?NAN:tc;
-    }
-    float tt=dht.readTemperature(), hh=dht.readHumidity();
-    dhtTBuf[bufIdx]=isnan(tt)?NAN:tt;
-    dhtHBuf[bufIdx]=isnan(hh)?NAN:hh;
-    validSamples = min<uint8_t>(validSamples+1,SAMPLES_HR);
-    bufIdx = (bufIdx+1)%SAMPLES_HR;
-    lastSampleMin = t.tm_min;
+  // 10‑min sample into buffer: the 12‑bit reading taken on the mark (waits for an in‑flight one).
+  // A fast read may have replaced it since; then convert at 12‑bit now, ~750 ms late.
+  bool sampleDue = t.tm_min%SAMPLE_STEP==0 && t.tm_sec<10 && lastSampleMin!=t.tm_min;
+  if(sampleDue && !convBusy){
+    if(fresh() && latest.bits==BITS_ALIGNED){
+      for(uint8_t i=0;i<NUM_DS;i++) dsBuf[i][bufIdx]=latest.v[i];
+      dhtTBuf[bufIdx]=latest.v[4];
+      dhtHBuf[bufIdx]=latest.v[5];
+      validSamples = min<uint8_t>(validSamples+1,SAMPLES_HR);
+      bufIdx = (bufIdx+1)%SAMPLES_HR;
+      lastSampleMin = t.tm_min; sampleDue=false;
+    } else { lastFastRead=millis(); startConversion(BITS_ALIGNED); }
   }
   if(t.tm_min%SAMPLE_STEP!=0) lastSampleMin=-1;
 
-  // hourly post
-  if(t.tm_min==0 && t.tm_sec==REPORT_SEC && lastReportHr!=t.tm_hour && validSamples){
-    postSheet(); clearBuffers(); bufIdx=0; validSamples=0; lastReportHr=t.tm_hour;
+  // hourly post: first pass from hh:00:05 on (a blocking read or POST may step over it),
+  // after the hh:00 sample is in
+  bool reportDue = t.tm_min==0 && lastReportHr!=t.tm_hour && validSamples;
+  if(reportDue && t.tm_sec>=REPORT_SEC && !sampleDue){
+    postSheet(); clearBuffers(); bufIdx=0; validSamples=0; lastReportHr=t.tm_hour; reportDue=false;
+  }
+
+  // 3. Queued alerts, one POST per pass, never while a 10‑min sample or the hourly report
+  // is pending, or a mark is close
+  time_t mark;
+  if(alQn && !convBusy && !sampleDue && !reportDue && msToMark(mark)>ALERT_HOLD_MS){
+    postJson(alQ[alQHead]); alQHead=(alQHead+1)%ALQ_MAX; alQn--;
   }
 }
 
 // ───────────── functions ─────────────
-void readSensorsFast(){
-  // DS18B20 bulk read
-  ds.requestTemperatures();
-  float dsT[4];
+// Start a DS18B20 conversion at `bits`; returns at once (setWaitForConversion(false))
+void startConversion(uint8_t bits){
+  setProbeBits(bits);
+  ds.requestTemperatures(); convStartMs=millis(); convMs=CONV_MS_12>>(BITS_ALIGNED-bits); convBits=bits; convBusy=true;
+}
+
+// Write Scratchpad (TH, TL, config) on probes not already at `bits`. No Copy Scratchpad:
+// DallasTemperature::setResolution() persists to EEPROM, which twice per 10 min would wear it out.
+void setProbeBits(uint8_t bits){
   for(uint8_t i=0;i<NUM_DS;i++){
-    float tc = ds.getTempC(DS_ADDR[i]);
-    dsT[i] = (tc==DEVICE_DISCONNECTED_C||tc==85||tc==-127)?NAN:tc;
+    if(dsBits[i]==bits || !sensorDue(i) || !oneWire.reset()) continue;
+    oneWire.select(DS_ADDR[i]);
+    oneWire.write(0x4E); oneWire.write(0x4B); oneWire.write(0x46); oneWire.write(((bits-9)<<5)|0x1F);
+    dsBits[i]=bits;
   }
-  float dhtT=dht.readTemperature(), dhtH=dht.readHumidity();
-  // push to Cloud (ON_UPDATE 10 s recommended in thingProperties.h)
-  temp1 = dsT[0]; temp2 = dsT[1]; temp3 = dsT[2]; temp4 = dsT[3];
-  dhtTemp = isnan(dhtT)?dhtTemp:dhtT;
-  dhtHumi = isnan(dhtH)?dhtHumi:dhtH;
+}
+
+// Read out a due conversion plus the DHT and publish it; true when `latest` changed
+bool serviceAcquisition(){
+  if(!convBusy || millis()-convStartMs<convMs) return false;
+  int16_t raw[NUM_DS]; uint8_t rd[NUM_DS];
+  readProbes(raw,rd);
+  for(uint8_t i=0;i<NUM_DS;i++){
+    latest.v[i] = rd[i]==RD_OK ? raw[i]/16.0f : NAN;
+    if(rd[i]!=RD_SKIPPED) sensorResult(i,rd[i]);
+  }
+  latest.v[4]=latest.v[5]=NAN;
+  if(sensorDue(SENS_DHT)){
+    latest.v[4]=dht.readTemperature(); latest.v[5]=dht.readHumidity(); // 2nd call hits the DHT cache
+    sensorResult(SENS_DHT,(isnan(latest.v[4])||isnan(latest.v[5]))?RD_MISSING:RD_OK);
+  }
+  latest.ms=millis(); latest.bits=convBits; convBusy=false;
+  return true;
+}
+
+// Read every due probe: raw counts (1/16 °C) in `raw`, an RD_* code per probe in `rd`
+void readProbes(int16_t* raw,uint8_t* rd){
+  for(uint8_t i=0;i<NUM_DS;i++) rd[i] = sensorDue(i) ? readScratch(i,raw[i]) : RD_SKIPPED;
+}
+
+// Reset + Match ROM + Read Scratchpad, once, CRC8‑checked. getTempC() instead re‑validates the
+// address, resets again after the read and goes through float compares against 85 / -127.
+uint8_t readScratch(uint8_t i,int16_t& raw){
+  uint8_t sp[9];
+  if(!oneWire.reset()) return RD_MISSING;  // no presence pulse at all
+  oneWire.select(DS_ADDR[i]); oneWire.write(0xBE);
+  oneWire.read_bytes(sp,9);
+  if(OneWire::crc8(sp,8)!=sp[8] || (sp[4]&0x1F)!=0x1F){ // all‑zero (shorted bus) passes the CRC
+    bool blank=true; for(uint8_t b=0;b<9;b++) blank&=sp[b]==0xFF; // this probe did not answer
+    return blank?RD_MISSING:RD_CRC;
+  }
+  raw=(sp[1]<<8)|sp[0];
+  if(raw==0x0550) return RD_SENTINEL;      // 85 °C power‑on value: conversion never ran
+  uint8_t r=(sp[4]>>5)&3;                  // 0..3 → 9..12 bit
+  dsBits[i]=9+r;                           // resync after a probe power‑cycles to its EEPROM setting
+  raw&=~((1<<(3-r))-1);                    // low bits are undefined below 12‑bit
+  return RD_OK;
+}
+
+// Bus time per probe, getTempC() vs readScratch(); printed once, re‑reading the boot conversion
+void benchBus(){
+  int16_t raw; unsigned long t0=micros();
+  for(uint8_t i=0;i<NUM_DS;i++) ds.getTempC(DS_ADDR[i]);
+  unsigned long t1=micros();
+  for(uint8_t i=0;i<NUM_DS;i++) readScratch(i,raw);
+  unsigned long t2=micros();
+  Serial.printf("[BUS] per probe: getTempC %lu us, direct %lu us\n",(t1-t0)/NUM_DS,(t2-t1)/NUM_DS);
+}
+
+// false → quarantined and not yet due for a re‑probe
+bool sensorDue(uint8_t s){ const Health& h=health[s]; return h.streak<QUAR_AFTER || (long)(millis()-h.retryMs)>=0; }
+
+void sensorResult(uint8_t s,uint8_t rd){
+  Health& h=health[s];
+  if(rd==RD_OK){ if(h.streak>=QUAR_AFTER) Serial.printf("[HEALTH] sensor %u back\n",s+1); h.streak=0; return; }
+  h.fails++; if(rd==RD_CRC) h.crc++; if(rd==RD_SENTINEL) h.sentinel++;
+  if(h.streak<255) h.streak++;
+  if(h.streak<QUAR_AFTER) return;
+  if(h.streak==QUAR_AFTER) Serial.printf("[HEALTH] sensor %u quarantined\n",s+1);
+  h.retryMs=millis()+min(QUAR_BASE_MS<<min<uint8_t>(h.streak-QUAR_AFTER,6),QUAR_MAX_MS);
+}
+
+bool fresh(){ return latest.ms && millis()-latest.ms<=FRESH_MS; }
+
+// ms until the next local 10‑min mark (epoch returned in `mark`); -1 before NTP
+long msToMark(time_t& mark){
+  timeval tv; gettimeofday(&tv,nullptr); if(tv.tv_sec<MIN_EPOCH) return -1;
+  long step=SAMPLE_STEP*60L, left=step-(tv.tv_sec+GMT_OFFSET)%step;
+  mark=tv.tv_sec+left;
+  return left*1000-tv.tv_usec/1000;
+}
+
+// Cloud push (ON_UPDATE 10 s recommended in thingProperties.h) + alerts for each new reading
+void pushFast(){
+  const float* v=latest.v;
+  temp1 = v[0]; temp2 = v[1]; temp3 = v[2]; temp4 = v[3];
+  dhtTemp = isnan(v[4])?dhtTemp:v[4];
+  dhtHumi = isnan(v[5])?dhtHumi:v[5];
+  checkAlerts(v);
+}
+
+// Threshold + slope checks on one fast read; posts on a state change, or a muted alert once the gap allows
+void checkAlerts(const float* v){
+  unsigned long ms=millis();
+  for(uint8_t c=0;c<NUM_CH;c++){
+    if(isnan(v[c])) continue;
+    float slope=NAN;
+    if(isnan(slopeRef[c])){ slopeRef[c]=v[c]; slopeRefMs[c]=ms; }
+    else if(ms-slopeRefMs[c]>=SLOPE_BASE_MS){
+      slope=(v[c]-slopeRef[c])*60000.0f/(ms-slopeRefMs[c]);
+      slopeRef[c]=v[c]; slopeRefMs[c]=ms;
+    }
+    for(uint8_t k=0;k<AL_KINDS;k++){
+      bool on=alState[c][k]!=AL_CLEAR, trig;
+      if(k==AL_HIGH){ if(isnan(ALERT_HIGH[c])) continue; trig = v[c] > (on? ALERT_HIGH[c]-ALERT_HYST[c] : ALERT_HIGH[c]); }
+      else if(k==AL_LOW){ if(isnan(ALERT_LOW[c])) continue; trig = v[c] < (on? ALERT_LOW[c]+ALERT_HYST[c] : ALERT_LOW[c]); }
+      else { if(isnan(ALERT_SLOPE[c])||isnan(slope)) continue; trig = fabsf(slope) > (on? ALERT_SLOPE[c]/2 : ALERT_SLOPE[c]); }
+      bool gap = alLastMs[c]==0 || ms-alLastMs[c]>=ALERT_GAP_MS;
+      if(trig==on && !(trig && alState[c][k]==AL_MUTED && gap)) continue; // muted: sent once the gap has passed
+      bool send = trig ? gap : alState[c][k]==AL_SENT;
+      alState[c][k] = trig ? (send?AL_SENT:AL_MUTED) : AL_CLEAR;
+      if(!send) continue;
+      float lim = k==AL_HIGH?ALERT_HIGH[c] : k==AL_LOW?ALERT_LOW[c] : ALERT_SLOPE[c];
+      // Same shape as the sink's own alerts: {"device","rule","channel","state","value","epoch"}
+      char js[200]; snprintf(js,sizeof(js),
+        "{\"device\":\"%s\",\"rule\":\"%s %s %g\",\"channel\":\"%s\",\"state\":\"%s\",\"value\":%.2f,\"epoch\":%ld}",
+        devId,CH_KEY[c],AL_NAME[k],lim,CH_KEY[c],trig?"firing":"resolved",k==AL_SLOPE?slope:v[c],(long)time(nullptr));
+      Serial.printf("[ALERT] %s\n",js);
+      if(trig) alLastMs[c]=ms;
+      queueAlert(js);
+    }
+  }
+}
+
+// Epoch is stamped when the alert is raised, not when the queue gets to it
+void queueAlert(const char* js){
+  if(alQn==ALQ_MAX){ Serial.println(F("[ALERT] queue full, oldest dropped")); alQHead=(alQHead+1)%ALQ_MAX; alQn--; }
+  strlcpy(alQ[(alQHead+alQn)%ALQ_MAX],js,sizeof(alQ[0])); alQn++;
 }
 
 void postSheet(){
@@ -129,15 +349,55 @@ void postSheet(){
   float a3=avg(dsBuf[2],validSamples), a4=avg(dsBuf[3],validSamples);
   float at=avg(dhtTBuf,validSamples), ah=avg(dhtHBuf,validSamples);
 
-  static WiFiClientSecure cli; cli.setBufferSizes(1024,512); cli.setInsecure();
+  char js[640]; int n=snprintf(js,sizeof(js),
+    "{\"device\":\"%s\",\"sensor1\":%.2f,\"sensor2\":%.2f,\"sensor3\":%.2f,\"sensor4\":%.2f,\"dhttemp\":%.2f,\"dhthumidity\":%.2f",
+    devId,a1,a2,a3,a4,at,ah);
+  // "health":{"fails":[s1,s2,s3,s4,dht],"crc":[..],"sentinel":[..],"quarantined":[0|1..]}
+  static const char* const HK[4]={"fails","crc","sentinel","quarantined"};
+  n+=snprintf(js+n,sizeof(js)-n,",\"health\":{");
+  for(uint8_t k=0;k<4;k++){
+    n+=snprintf(js+n,sizeof(js)-n,"%s\"%s\":[",k?",":"",HK[k]);
+    for(uint8_t i=0;i<NUM_SENS;i++){
+      const Health& h=health[i];
+      unsigned v = k==0?h.fails : k==1?h.crc : k==2?h.sentinel : h.streak>=QUAR_AFTER;
+      n+=snprintf(js+n,sizeof(js)-n,"%s%u",i?",":"",v);
+    }
+    n+=snprintf(js+n,sizeof(js)-n,"]");
+  }
+  // "telemetry":{"ttfs_ms","ntp_ms","ttfu_ms"}: boot → first reading / valid clock / accepted upload (null: none yet)
+  n+=snprintf(js+n,sizeof(js)-n,"},\"telemetry\":{\"ttfs_ms\":%lu,\"ntp_ms\":%lu,\"ttfu_ms\":",ttfsMs,ntpMs);
+  n+=ttfuMs ? snprintf(js+n,sizeof(js)-n,"%lu",ttfuMs) : snprintf(js+n,sizeof(js)-n,"null");
+  // "tls" as in AgroPRO.cpp: "saved" is what the sized buffers free against BearSSL's defaults
+  n+=snprintf(js+n,sizeof(js)-n,",\"tls\":{\"mfln\":%d,\"rx\":%d,\"tx\":%d,\"saved\":%d,\"heap_connected\":%lu}"
+    ",\"heap_free\":%lu,\"heap_max_block\":%lu",max(mfln,0),tlsRx,tlsRx?TLS_TX:0,tlsRx?TLS_DEFAULT-(tlsRx+TLS_TX+TLS_OVERHEAD):0,
+    tlsHeap,(unsigned long)ESP.getFreeHeap(),(unsigned long)ESP.getMaxFreeBlockSize());
+  snprintf(js+n,sizeof(js)-n,"}}");
+  for(uint8_t i=0;i<NUM_SENS;i++) health[i].fails=health[i].crc=health[i].sentinel=0;
+  postJson(js);
+}
+
+// Shared upload path: hourly report and immediate alerts
+// RX buffer = smallest fragment length the host accepts (probed until the host answers); 16K if it
+// ignores MFLN. http:// URL = local sink / gateway on the LAN: plain TCP, no TLS
+bool postJson(const char* js){
+  static WiFiClientSecure cli; static WiFiClient plain;
+  bool tls=!strncmp(GOOGLE_SCRIPT_URL,"https:",6);
+  if(tls&&mfln<0&&WiFi.status()==WL_CONNECTED){
+    const char* h=GOOGLE_SCRIPT_URL+8; size_t hn=strcspn(h,":/"); // host[:port] after "https://"
+    char host[64]; snprintf(host,sizeof(host),"%.*s",(int)hn,h); uint16_t port=h[hn]==':'?atoi(h+hn+1):443;
+    mfln=0; for(uint16_t f=512;f<=4096&&!mfln;f<<=1) if(WiFiClientSecure::probeMaxFragmentLength(host,port,f)) mfln=f;
+    if(!mfln){ WiFiClient t; if(!t.connect(host,port)) mfln=-1; t.stop(); } // unreachable ≠ no MFLN: probe again
+    Serial.printf("MFLN %s:%u %d\n",host,port,mfln);
+  }
+  if(tls){ tlsRx=mfln>0?mfln:TLS_RX_FULL; cli.setBufferSizes(tlsRx,TLS_TX); cli.setInsecure(); }
   HTTPClient http; http.setTimeout(8000);
-  char js[256]; snprintf(js,sizeof(js),
-    "{\"sensor1\":%.2f,\"sensor2\":%.2f,\"sensor3\":%.2f,\"sensor4\":%.2f,\"dhttemp\":%.2f,\"dhthumidity\":%.2f}",
-    a1,a2,a3,a4,at,ah);
-  http.begin(cli,GOOGLE_SCRIPT_URL); http.addHeader("Content-Type","application/json");
-  int code=http.POST(String(js)); Serial.printf("HTTP %d\n",code); http.end();
+  http.begin(tls?(WiFiClient&)cli:plain,GOOGLE_SCRIPT_URL); http.addHeader("Content-Type","application/json");
+  int code=http.POST(String(js)); if(tls&&code>0) tlsHeap=ESP.getFreeHeap(); // session still open
+  Serial.printf("HTTP %d\n",code); http.end();
+  if(tls&&code<0&&mfln>0) mfln=-1; // server may have stopped honouring MFLN: re-probe next time
+  if(code>0&&!ttfuMs){ ttfuMs=millis(); Serial.printf("[BOOT] first upload after %lu ms\n",ttfuMs); }
+  return code>0;
 }
 
 void clearBuffers(){ for(uint8_t i=0;i<SAMPLES_HR;i++){ for(uint8_t j=0;j<4;j++) dsBuf[j][i]=NAN; dhtTBuf[i]=dhtHBuf[i]=NAN;} }
 float avg(const float* a,uint8_t n){ float s=0;uint8_t c=0; for(uint8_t i=0;i<n;i++) if(!isnan(a[i])){s+=a[i];c++;} return c? s/c : NAN; }
-void syncNTP(){ Serial.print(F("NTP sync")); int t=20; time_t n=time(nullptr); while(n<MIN_EPOCH && t--){Serial.print('.'); delay(500); n=time(nullptr);} Serial.println(); }
@@ -1,14 +1,42 @@
 // Aman & Anna – NTP-Aligned 10-min Datalogging & Hourly Reporting for ESP8266
 // Data is sampled at NTP-aligned 10-minute marks (hh:00, hh:10, ...),
 // and an hourly report of averages is sent at hh:00 (approximately).
+// While readings move fast (pile turning, ventilation), extra samples are taken
+// between the marks. Hourly means are time-weighted (trapezoidal) over all samples.
+// Every sample also feeds a cascade of rings (10 s, 1 min, 10 min, 1 h) kept in
+// static memory; send "r0".."r3" over Serial to dump a level as CSV.
+// Boot does not wait for anything: the first DS18B20 conversion starts at once while
+// WiFi, Arduino Cloud and NTP come up in the background; boot metrics go into telemetry.
+// The clock is kept in RTC memory, so after a soft/watchdog reset sampling resumes on a
+// provisional time straight away and NTP corrects it when it arrives.
+// The WiFi BSSID, channel and IP lease are cached there as well, so a reset rejoins the
+// access point without a scan or DHCP.
+// Plain-http uploads (a sink on the LAN) resolve the endpoint through a small TTL-respecting
+// DNS cache with failover across all returned addresses, and keep going on cached addresses
+// while DNS is down; TLS connects by host name so the handshake carries SNI.
+// Apps Script's 302 is followed as a GET (the POST already ran the script): over the same
+// connection only for the same host and port, otherwise over a new one opened by name.
+// Only the status and the first bytes of the final body are read.
+// TLS buffers are sized from a one-time Max Fragment Length probe instead of BearSSL's
+// default 16 KB + 837 B; the heap this frees is reported in telemetry.
+// Reports that can't be delivered are queued and sent later as one JSON array, optionally
+// deflated (for the local sink, which inflates it; Apps Script can't).
+// Optionally, samples and reports go instead as compact binary CoAP messages over UDP to
+// a gateway on the farm LAN (the sink's --coap-port), confirmed and retransmitted per
+// RFC 7252, so a node no longer opens a TLS session per report.
 
 #include "thingProperties.h"      // For Arduino Cloud variables and connection
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include <DHT.h>
-#include <ESP8266HTTPClient.h>    // For making HTTP/HTTPS requests
 #include <WiFiClientSecure.h>     // For HTTPS
+#include <WiFiUdp.h>              // DNS queries for the upload cache
 #include <time.h>                 // For time functions
+#include <sys/time.h>             // gettimeofday / settimeofday
+#include <coredecls.h>            // settimeofday_cb
+extern "C" {
+#include <user_interface.h>       // RTC timer (keeps counting through a soft reset)
+}
 
 // --- Configuration Constants ---
 // Network & Web Service
@@ -26,14 +54,113 @@ const char* NTP_SERVER_PRIMARY      = "pool.ntp.org";
 const char* NTP_SERVER_SECONDARY    = "time.nist.gov"; // Fallback NTP
 unsigned long     lastNtpSyncMillis       = 0;
 const unsigned long NTP_RESYNC_INTERVAL_MS  = 12UL * 3600UL * 1000UL; // Resync every 12 hours
-const int         NTP_SYNC_MAX_TRIES      = 20;
-const int         NTP_SYNC_RETRY_DELAY_MS = 500;
 const long        MIN_EPOCH_TIME_SEC      = 946684800L; // Min valid time (Jan 1, 2000, 00:00:00 UTC)
 
+// Clock persistence. RTC user memory survives soft, watchdog and exception resets but not
+// a power loss; a cold boot still waits for NTP since the time spent off is unknown.
+const uint32_t      RTC_CLOCK_MAGIC          = 0xA6C10C01;
+const uint32_t      RTC_CLOCK_BLOCK          = 0;    // RTC user memory offset, in 4-byte blocks
+const uint64_t      RTC_CLOCK_MAX_GAP_US     = 600ULL * 1000000ULL; // Longer "resets" are not trusted
+const unsigned long DRIFT_MIN_INTERVAL_MS    = 30UL * 60UL * 1000UL; // NTP updates closer than this don't update the drift
+const long          DRIFT_MAX_PPM            = 500;
+const float         DRIFT_EWMA_ALPHA         = 0.3f;
+
+// Fast WiFi reconnect from the BSSID / channel / lease cached in RTC memory
+const bool          WIFI_FAST_RECONNECT_ENABLED = true;
+const bool          WIFI_FAST_STATIC_IP      = true;  // Reuse the last DHCP lease; reserve it on the router
+const uint32_t      RTC_WIFI_MAGIC           = 0xA6C1F1F1;
+const uint32_t      RTC_WIFI_BLOCK           = 8;     // After RtcClockState
+const unsigned long WIFI_FAST_TIMEOUT_MS     = 2000;  // Then fall back to the connection handler's scan
+
+// Upload transport
+const int           DNS_CACHE_ENTRIES        = 2;     // Upload host + its redirect target
+const int           DNS_MAX_ADDRS            = 4;
+const unsigned long DNS_TIMEOUT_MS           = 1500;
+const uint32_t      DNS_MIN_TTL_SEC          = 30;
+const uint32_t      DNS_MAX_TTL_SEC          = 3600;
+const uint32_t      DNS_STALE_MAX_SEC        = 24UL * 3600UL; // Serve expired addresses this long while DNS fails
+const uint16_t      HTTPS_PORT               = 443;
+const uint16_t      HTTP_PORT                = 80;
+const unsigned long HTTP_TIMEOUT_MS          = 10000; // Apps Script can be slow to answer
+const int           HTTP_BODY_PREVIEW        = 128;   // Response bytes kept for the log
+const int           HTTP_MAX_REDIRECTS       = 3;
+const int           HTTP_LINE_MAX            = 512;   // Longer header lines are truncated (Location fits)
+
+// TLS buffer sizing (MFLN = Max Fragment Length Negotiation, RFC 6066)
+const int           TLS_MFLN_COUNT           = 4;
+const uint16_t      TLS_MFLN_SIZES[TLS_MFLN_COUNT] = {512, 1024, 2048, 4096}; // Probed smallest first
+const int           TLS_RX_FULL              = 16384; // Without MFLN the server may send full-size records
+const int           TLS_TX_BUFFER            = 512;   // Our own records; small either way
+const int           TLS_IN_OVERHEAD          = 325;   // BearSSL adds these to setBufferSizes()
+const int           TLS_OUT_OVERHEAD         = 85;
+const int           TLS_DEFAULT_BUFFERS      = 16384 + 325 + 837; // WiFiClientSecure without setBufferSizes()
+const uint32_t      RTC_TLS_MAGIC            = 0xA6C17150;
+const uint32_t      RTC_TLS_BLOCK            = 16;    // After RtcWifiCache
+const int           HTTP_ERR_URL             = -1;
+const int           HTTP_ERR_CONNECT         = -2;
+const int           HTTP_ERR_TIMEOUT         = -3;
+const int           HTTP_ERR_PROTOCOL        = -4;
+
+// Upload queue & compression. Undelivered hourly reports (without telemetry, ~330 bytes
+// each) wait in a static queue and go out together as a JSON array with the next upload.
+const int           REPORT_MAX_BYTES         = 1280;  // One report with telemetry
+const int           REPORT_QUEUE_BYTES       = 3072;  // ~9 hours of reports; the oldest is dropped first
+const int           REPORT_QUEUE_MAX         = 16;
+const unsigned long REPORT_RETRY_MS          = 5UL * 60UL * 1000UL; // First retry after a failed upload; doubles per failure
+const unsigned long UPLOAD_RETRY_MAX_MS      = 60UL * 60UL * 1000UL; // Backoff cap
+const unsigned long UPLOAD_PACE_MS           = 15000; // Between batches while the server limits their size
+const unsigned long UPLOAD_RETRY_AFTER_MAX_S = 6UL * 3600UL; // Longer Retry-After values are clamped
+const bool          UPLOAD_DEFLATE_ENABLED   = false; // Only for the local sink: Apps Script doesn't inflate request bodies
+const int           DEFLATE_MIN_BYTES        = 512;   // Smaller bodies go out as they are
+const int           DEFLATE_OUT_BYTES        = 2048;  // Batches that don't compress into this go out as they are
+const int           DEFLATE_WINDOW           = 512;   // LZ77 window (power of 2); JSON repeats within a record or two
+const int           DEFLATE_HASH_BITS        = 8;
+const int           DEFLATE_MAX_CHAIN        = 8;     // Candidates tried per position
+const int           DEFLATE_MIN_MATCH        = 3;
+const int           DEFLATE_MAX_MATCH        = 258;
+const uint16_t      DEFLATE_NONE             = 0xFFFF;
+// Fixed-Huffman length / distance codes (RFC 1951, 3.2.5)
+const uint16_t DEFLATE_LEN_BASE[29]   = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t  DEFLATE_LEN_EXTRA[29]  = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DEFLATE_DIST_BASE[30]  = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                         257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                         8193, 12289, 16385, 24577};
+const uint8_t  DEFLATE_DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                         7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Local CoAP uplink. Each message is a confirmable POST to coap://gateway/a carrying one
+// binary record (big-endian):
+//   kind (1 = sample, 2 = hourly report), chip id (4), epoch (4), 6 x int16 hundredths
+//   (INT16_MIN = missing; sensor1..4, dhttemp, dhthumidity)                -> 21 bytes
+//   report only: 6 x coverage (0..200 = 0.5 % steps), 3 x 6 x int16 p5/p50/p95 -> 63 bytes
+const bool          COAP_UPLINK_ENABLED      = false; // Replaces the HTTPS report; needs the gateway
+const char*         COAP_GATEWAY_HOST        = "192.168.1.10";
+const uint16_t      COAP_PORT                = 5683;
+const unsigned long COAP_ACK_TIMEOUT_MS      = 2000;  // RFC 7252 ACK_TIMEOUT; x1..1.5 random, doubling per retry
+const int           COAP_MAX_RETRANSMIT      = 4;
+const unsigned long COAP_OUTAGE_RETRY_MS     = 60000; // After a message ran out of retransmits
+const int           COAP_OUTBOX_SLOTS        = 16;    // Unconfirmed messages kept; the oldest is dropped first
+const int           COAP_MAX_MESSAGE         = 80;
+const uint8_t       UPLINK_SAMPLE            = 1;
+const uint8_t       UPLINK_REPORT            = 2;
+
 // Data Sampling & Reporting
 const int SAMPLES_PER_HOUR         = 6;    // e.g., one sample every 10 minutes
 const int SAMPLING_INTERVAL_MIN    = 10;   // Sample every 10 minutes
 const int REPORTING_TRIGGER_SECOND = 5;    // Second of minute 00 to trigger report (e.g., hh:00:05)
+const long REPORT_WINDOW_SECONDS   = SAMPLES_PER_HOUR * SAMPLING_INTERVAL_MIN * 60L; // One report covers one hour
+const long TW_NOMINAL_GAP_SEC      = SAMPLING_INTERVAL_MIN * 60L + 5; // Samples this close count as coverage
+const long TW_MAX_GAP_SEC          = 3 * SAMPLING_INTERVAL_MIN * 60L; // Wider gaps are not interpolated
+
+// Hourly Percentiles (extended P² sketch: 2 x 3 + 3 = 9 markers per channel, ~56 bytes)
+const int   NUM_QUANTILES = 3;
+const float QUANTILES[NUM_QUANTILES] = {0.05f, 0.50f, 0.95f};
+const char* const QUANTILE_KEYS[NUM_QUANTILES] = {"p5", "p50", "p95"};
+const int   P2_MARKERS = 2 * NUM_QUANTILES + 3;
+// Marker probabilities: min, then each quantile with midpoints between them, then max
+const float P2_MARKER_PROBS[P2_MARKERS] = {0.0f, 0.025f, 0.05f, 0.275f, 0.50f, 0.725f, 0.95f, 0.975f, 1.0f};
 
 // DS18B20 Sensor Addresses (ensure these are correct for your sensors)
 const int NUM_DS18B20_SENSORS = 4;
@@ -43,54 +170,271 @@ DeviceAddress ds18b20_addresses[NUM_DS18B20_SENSORS] = {
   {0x28,0xD5,0xDA,0x57,0x04,0xE1,0x3D,0xE0}, // Sensor 3
   {0x28,0x8D,0x17,0x57,0x04,0xE1,0x3D,0xA1}  // Sensor 4
 };
+const int NUM_CHANNELS = NUM_DS18B20_SENSORS + 2; // DS18B20 probes, then DHT temperature, DHT humidity
+
+// Adaptive Sampling
+const bool  ADAPTIVE_SAMPLING_ENABLED = true;
+const int   ADAPTIVE_MIN_INTERVAL_SEC = 10;  // Fastest rate (DS18B20 12-bit conversion + DHT read take ~1 s)
+const int   ADAPTIVE_MAX_INTERVAL_SEC = SAMPLING_INTERVAL_MIN * 60; // Stable: only the 10-minute marks
+const int   ADAPTIVE_CALM_SAMPLES     = 3;   // Calm samples in a row before the interval doubles
+const float ADAPTIVE_EWMA_ALPHA       = 0.3f;
+// Per channel (DS18B20 x4, DHT temp, DHT humidity): a channel is "moving" when its rate of
+// change (units per minute) or its EWMA standard deviation exceeds these limits.
+const float ADAPTIVE_RATE_LIMIT[NUM_CHANNELS]   = {0.2f, 0.2f, 0.2f, 0.2f, 0.2f, 1.0f};
+const float ADAPTIVE_STDDEV_LIMIT[NUM_CHANNELS] = {0.5f, 0.5f, 0.5f, 0.5f, 0.5f, 2.0f};
+
+// Multi-resolution history: each level holds bucket means and feeds the next level
+// as its buckets close. Values are stored as int16 hundredths (RING_EMPTY = no data).
+const int     NUM_RING_LEVELS = 4;
+const int16_t RING_EMPTY      = INT16_MIN;
 
 // --- Global Objects ---
 OneWire oneWire(ONE_WIRE_BUS_PIN);
 DallasTemperature ds18b20_sensors(&oneWire);
 DHT dht(DHT_SENSOR_PIN, DHT_SENSOR_TYPE);
 
-// --- Data Storage for Averaging ---
-float ds18b20_temp_samples[NUM_DS18B20_SENSORS][SAMPLES_PER_HOUR];
-float dht_humidity_samples[SAMPLES_PER_HOUR];
-float dht_temp_samples[SAMPLES_PER_HOUR];
-int   current_sample_index = 0; // Index for the circular buffer of samples
-int   samples_taken_this_hour = 0; // Count of valid samples in the current hour
+// --- Hourly Aggregation ---
+// Time-weighted mean per channel, updated in O(1) per sample: trapezoids between
+// consecutive valid samples, clipped to the hour. Lost samples no longer skew the
+// mean, and the coverage fraction tells how much of the hour was actually observed.
+struct TimeWeightedMean {
+  double area;        // Integral of value over time (value x seconds)
+  long   span_sec;    // Seconds integrated, including interpolated gaps up to TW_MAX_GAP_SEC
+  long   covered_sec; // Seconds between samples no more than TW_NOMINAL_GAP_SEC apart
+  double point_sum;   // Plain sum/count, used when the hour holds a single valid sample
+  int    point_count;
+  time_t last_epoch;  // Last valid sample; may lie in the previous hour
+  float  last_value;
+};
+// Streaming quantile sketch (P², Jain & Chlamtac, extended to several quantiles).
+// Fixed memory and O(markers) per sample. Until more than P2_MARKERS samples have
+// arrived, the heights hold the raw samples and quantiles are exact.
+struct QuantileSketch {
+  float    heights[P2_MARKERS];
+  uint16_t positions[P2_MARKERS]; // 1-based marker positions
+  uint16_t count;
+};
+QuantileSketch hourly_sketches[NUM_CHANNELS];
+
+const char* const PAYLOAD_KEYS[6] = {"sensor1", "sensor2", "sensor3", "sensor4", "dhttemp", "dhthumidity"};
+TimeWeightedMean hourly_means[NUM_CHANNELS];
+time_t hour_window_start       = 0; // Start of the hour being aggregated (UTC epoch)
+int    samples_taken_this_hour = 0; // Count of 10-minute samples in the current hour
+
+// --- Adaptive Sampling State ---
+int    adaptive_interval_sec = ADAPTIVE_MAX_INTERVAL_SEC;
+int    adaptive_calm_count   = 0;
+time_t last_sample_epoch     = 0;
+float  last_sample_values[NUM_CHANNELS];
+float  ewma_mean[NUM_CHANNELS];
+float  ewma_var[NUM_CHANNELS];
+
+// --- Multi-resolution Rings (static: (60 + 60 + 144 + 168) x 6 x 2 bytes = ~5 KB) ---
+struct RingLevel {
+  uint16_t period_sec;   // Bucket width
+  uint16_t capacity;     // Buckets kept
+  int16_t (*entries)[NUM_CHANNELS];
+  uint16_t head;         // Next slot to write
+  uint16_t size;
+  uint32_t open_bucket;  // epoch / period_sec of the bucket being filled (0: none yet)
+  float    open_sum[NUM_CHANNELS];
+  uint16_t open_count[NUM_CHANNELS];
+};
+int16_t ring_10s[60][NUM_CHANNELS];  // 10 min at the adaptive sampling floor
+int16_t ring_1m[60][NUM_CHANNELS];   // 1 hour
+int16_t ring_10m[144][NUM_CHANNELS]; // 1 day
+int16_t ring_1h[168][NUM_CHANNELS];  // 1 week
+RingLevel rings[NUM_RING_LEVELS] = {
+  {10,   60,  ring_10s, 0, 0, 0, {0}, {0}},
+  {60,   60,  ring_1m,  0, 0, 0, {0}, {0}},
+  {600,  144, ring_10m, 0, 0, 0, {0}, {0}},
+  {3600, 168, ring_1h,  0, 0, 0, {0}, {0}},
+};
 
 // --- State Variables for Timing ---
 int last_sample_minute_taken = -1; // To prevent double sampling in the same minute
 int last_report_hour_sent  = -1; // To prevent double reporting in the same hour
 
+// --- DNS Cache (addresses in network byte order, as IPAddress stores them) ---
+struct DnsCacheEntry {
+  char          host[48];
+  uint32_t      addrs[DNS_MAX_ADDRS];
+  uint8_t       count;
+  uint8_t       next;       // Address tried first; advanced when a connect fails
+  unsigned long fetched_ms;
+  uint32_t      ttl_sec;
+};
+DnsCacheEntry dns_cache[DNS_CACHE_ENTRIES];
+uint16_t      dns_query_id  = 0;
+unsigned long dns_hits      = 0;
+unsigned long dns_lookups   = 0;
+unsigned long dns_stale     = 0; // Expired entries served because the lookup failed
+unsigned long dns_failovers = 0;
+
+// --- HTTP Response Head (static: the Location line alone is a few hundred bytes) ---
+struct HttpResponseHead {
+  int  status;
+  long content_length; // -1 if not sent
+  bool chunked;
+  bool close;          // Server will close: the connection can't be reused
+  long retry_after;    // Retry-After in seconds; -1 if not sent (or sent as a date)
+  int  batch_max;      // X-Agro-Batch-Max: reports per POST the server asks for; 0 if not sent
+  char location[HTTP_LINE_MAX];
+};
+HttpResponseHead http_head;
+unsigned long http_redirects        = 0;
+unsigned long http_redirects_reused = 0; // Followed over the same connection (same host and port)
+
+// --- TLS Buffers (probe result also kept in RTC memory) ---
+struct RtcTlsCache {
+  uint32_t magic;
+  uint32_t mfln;     // Smallest accepted fragment length; 0 = MFLN not supported
+  uint32_t checksum;
+};
+int           tls_mfln           = -1; // -1 = not probed yet
+int           tls_rx_size        = 0;  // Buffer sizes of the last upload
+int           tls_tx_size        = 0;
+unsigned long tls_heap_connected = 0;  // Free heap with the last upload's TLS session open
+
+// --- Upload Queue (static: queued reports sit between '[' and the current report) ---
+// report_batch = '[' + "r1,r2,…," (the queue) + room for the current report and ']'.
+char          report_batch[1 + REPORT_QUEUE_BYTES + REPORT_MAX_BYTES + 1];
+uint16_t      report_queue_lens[REPORT_QUEUE_MAX]; // Bytes per queued report, including its ','
+int           report_queue_count  = 0;
+int           report_queue_bytes  = 0;
+unsigned long report_queue_dropped = 0;
+unsigned long last_upload_attempt_ms = 0;
+// Upload pacing: after a failure, or when the sink asks for it (503 / 429 + Retry-After),
+// nothing is posted for upload_wait_ms, hourly reports included; jittered so nodes that
+// failed together don't retry together.
+unsigned long upload_wait_ms     = 0;                    // 0: upload at will
+int           upload_batch_max   = REPORT_QUEUE_MAX + 1; // Reports per POST, from the sink's hint
+int           upload_failures    = 0;                    // Consecutive failed uploads
+unsigned long upload_throttled   = 0;                    // Responses that carried Retry-After
+
+// --- Deflate (static: hash heads + window chain ~1.5 KB, output 2 KB) ---
+struct DeflateOut {
+  uint8_t* buf;
+  size_t   size;
+  size_t   len;
+  uint32_t bits;     // Pending bits, LSB first
+  int      count;
+  bool     overflow;
+};
+uint16_t      deflate_head[1 << DEFLATE_HASH_BITS];
+uint16_t      deflate_prev[DEFLATE_WINDOW];
+uint8_t       deflate_out[DEFLATE_OUT_BYTES];
+unsigned long upload_bytes_raw   = 0; // Body bytes before / after compression, since boot
+unsigned long upload_bytes_sent  = 0;
+unsigned long last_deflate_us    = 0; // CPU time of the last compression
+unsigned long last_upload_ms     = 0; // Connect-to-response time of the last upload
+
+// --- CoAP Uplink (static outbox; one message in flight, as RFC 7252's NSTART = 1) ---
+struct CoapSlot {
+  uint8_t len;
+  uint8_t data[COAP_MAX_MESSAGE];
+};
+CoapSlot      coap_outbox[COAP_OUTBOX_SLOTS];
+int           coap_head          = 0;     // Oldest message; the one in flight
+int           coap_count         = 0;
+uint16_t      coap_message_id    = 0;
+WiFiUDP       coap_udp;
+bool          coap_udp_open      = false;
+bool          coap_in_flight     = false;
+int           coap_attempts      = 0;
+unsigned long coap_sent_ms       = 0;     // Last (re)transmission
+unsigned long coap_first_sent_ms = 0;
+unsigned long coap_timeout_ms    = 0;
+unsigned long coap_paused_ms     = 0;     // When a message ran out of retransmits (0: not paused)
+unsigned long coap_confirmed     = 0;
+unsigned long coap_retransmits   = 0;
+unsigned long coap_dropped       = 0;     // Outbox overflow or rejected by the gateway
+unsigned long coap_bytes_sent    = 0;     // UDP payload bytes, retransmissions included
+unsigned long coap_last_rtt_ms   = 0;
+
+// --- Boot Telemetry (ms since boot; 0 = not reached yet) ---
+const unsigned long BOOT_CONVERSION_MS = 750; // DS18B20 12-bit conversion started in setup()
+unsigned long boot_conversion_millis   = 0;
+unsigned long time_to_first_sample_ms  = 0;  // First sensor reading available
+unsigned long time_to_ntp_ms           = 0;  // Clock first valid
+unsigned long time_to_first_upload_ms  = 0;  // First report accepted by the server
+unsigned long last_time_wait_log_ms    = 0;
+
+// --- Clock Persistence (anchor rewritten to RTC memory once per second) ---
+struct RtcClockState {
+  uint32_t magic;
+  uint32_t epoch_sec;   // Wall clock at the anchor (UTC)
+  uint32_t epoch_usec;
+  uint32_t rtc_cycles;  // system_get_rtc_time() at the anchor
+  uint32_t rtc_cal;     // system_rtc_clock_cali_proc(): µs per RTC cycle, Q12
+  int32_t  drift_ppm;   // Correction added to the local clock, measured against NTP
+  uint32_t checksum;
+};
+RtcClockState rtc_clock            = {RTC_CLOCK_MAGIC, 0, 0, 0, 0, 0, 0};
+unsigned long persisted_millis     = 0;   // millis() at the anchor
+bool          anchor_valid         = false;
+int64_t       drift_acc_us         = 0;   // Drift correction not yet applied (< 1 ms)
+bool          clock_from_ntp       = false; // NTP has set the clock since boot
+bool          ntp_set_pending      = false; // For logging outside the SNTP callback
+unsigned long ntp_anchor_millis    = 0;
+long          last_ntp_fix_ms      = 0;   // How far off the clock was when NTP last set it
+
+// --- WiFi Reconnect Tracking ---
+struct RtcWifiCache {
+  uint32_t magic;
+  uint8_t  bssid[6];
+  uint16_t channel;
+  uint32_t ip, gateway, mask, dns;
+  uint32_t checksum;
+};
+RtcWifiCache  wifi_cache;
+bool          wifi_was_connected    = false;
+bool          wifi_fast_attempted   = false; // The current connection came from fastWifiConnect()
+unsigned long wifi_connect_start_ms = 0;     // Start of the current attempt or outage
+unsigned long last_wifi_connect_ms  = 0;     // How long the last (re)connect took
+bool          last_wifi_connect_fast = false;
+unsigned long wifi_connects         = 0;
+
 // =======================================================================================
 //                                   SETUP FUNCTION
 // =======================================================================================
 void setup() {
   Serial.begin(9600); // Or 115200 for faster serial
-  delay(1500); // Wait for serial monitor to connect
   Serial.println("\nESP8266 Datalogger Initializing...");
 
-  // Initialize Arduino Cloud (this also handles WiFi connection)
+  // Sensors first: the first conversion runs while the network comes up
+  ds18b20_sensors.begin();
+  dht.begin();
+  ds18b20_sensors.setWaitForConversion(false);
+  ds18b20_sensors.requestTemperatures();
+  ds18b20_sensors.setWaitForConversion(true);
+  boot_conversion_millis = millis();
+  Serial.println("Sensors initialized, first conversion started.");
+
+  // Provisional time from RTC memory, if this was a reset rather than a power-up
+  restoreClock();
+  settimeofday_cb([](bool from_sntp) { if (from_sntp) onNtpTimeSet(); });
+
+  // WiFi, Arduino Cloud and NTP all connect from their own state machines; none of
+  // these calls blocks. SNTP starts polling as soon as WiFi is up.
+  synchronizeNtpTime();
+  lastNtpSyncMillis = millis();
+  wifi_fast_attempted = fastWifiConnect(); // Bounded; the handler below does the full scan otherwise
   initProperties(); // Links variables to Arduino Cloud
   ArduinoCloud.begin(ArduinoIoTPreferredConnection);
   setDebugMessageLevel(2); // 0 (errors), 1 (info), 2 (debug)
   ArduinoCloud.printDebugInfo();
-  Serial.println("Waiting for Arduino Cloud connection...");
-
-  // Initialize Sensors
-  ds18b20_sensors.begin();
-  dht.begin();
-  Serial.println("Sensors initialized.");
 
-  // Configure and Synchronize NTP Time
-  // Ensure WiFi is connected before configuring time (ArduinoCloud handles this)
-  if (WiFi.status() == WL_CONNECTED) {
-    configTime(GMT_OFFSET_SECONDS, DAYLIGHT_OFFSET_SECONDS, NTP_SERVER_PRIMARY, NTP_SERVER_SECONDARY);
-    synchronizeNtpTime();
-  } else {
-    Serial.println("Error: WiFi not connected, cannot synchronize NTP time at setup.");
-    // Potentially loop here or set a flag to retry NTP sync later
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    hourly_means[ch].last_epoch = 0;
+    hourly_means[ch].last_value = NAN;
+    last_sample_values[ch] = NAN;
+    ewma_mean[ch] = NAN;
+    ewma_var[ch]  = 0.0f;
   }
-  
-  clearSampleArrays(); // Prepare arrays for first hour of sampling
+  resetHourlyAggregates(0); // Window start is set by the first sample once NTP time is valid
+  // Random first message ID, so messages after a reset aren't taken for retransmissions
+  coap_message_id = (uint16_t)random(0x10000);
   Serial.println("Setup complete. Starting main loop.");
 }
 
@@ -101,35 +445,52 @@ void loop() {
   ArduinoCloud.update(); // Essential for Arduino Cloud functionality
 
   unsigned long current_millis = millis();
+  trackWifi();
 
   // --- Periodic NTP Time Re-synchronization ---
-  if (current_millis - lastNtpSyncMillis > NTP_RESYNC_INTERVAL_MS || lastNtpSyncMillis == 0) {
-    if (WiFi.status() == WL_CONNECTED) {
-      synchronizeNtpTime();
-    }
-    lastNtpSyncMillis = current_millis; // Update even if sync failed to avoid rapid retries
+  if (current_millis - lastNtpSyncMillis > NTP_RESYNC_INTERVAL_MS) {
+    synchronizeNtpTime();
+    lastNtpSyncMillis = current_millis;
+  }
+
+  // --- First reading after boot, as soon as the conversion from setup() is done ---
+  if (time_to_first_sample_ms == 0 && current_millis - boot_conversion_millis >= BOOT_CONVERSION_MS) {
+    takeBootSample();
   }
 
   time_t now_epoch = time(nullptr);
   if (now_epoch < MIN_EPOCH_TIME_SEC) { // Check if time is valid before proceeding
-    Serial.println("Time not yet synchronized or invalid. Skipping sampling/reporting cycle.");
-    delay(1000); // Wait a bit before retrying
+    if (current_millis - last_time_wait_log_ms >= 5000) {
+      Serial.println("Time not yet synchronized or invalid. Skipping sampling/reporting cycle.");
+      last_time_wait_log_ms = current_millis;
+    }
+    delay(200);
     return;
   }
+  if (time_to_ntp_ms == 0) {
+    time_to_ntp_ms = millis();
+    struct tm timeinfo;
+    localtime_r(&now_epoch, &timeinfo);
+    Serial.printf("Clock valid after %lu ms (%s): %s", time_to_ntp_ms, clock_from_ntp ? "NTP" : "RTC memory", asctime(&timeinfo));
+  }
+  if (ntp_set_pending) {
+    ntp_set_pending = false;
+    Serial.printf("NTP set the clock (off by %ld ms, drift %ld ppm).\n", last_ntp_fix_ms, (long)rtc_clock.drift_ppm);
+  }
+  persistClock();
 
   struct tm time_info;
   localtime_r(&now_epoch, &time_info);
 
   // --- NTP-aligned Datalogging (e.g., every 10 minutes at hh:00:00, hh:10:00, ...) ---
+  // First pass at or after the mark: a blocking read, DNS lookup or upload can step
+  // over the exact second, so only the guard below stops a second sample.
   if (time_info.tm_min % SAMPLING_INTERVAL_MIN == 0 &&
-      time_info.tm_sec == 0 && // Sample exactly at the start of the second
       last_sample_minute_taken != time_info.tm_min) {
     
     Serial.printf("Taking sample at %02d:%02d:%02d\n", time_info.tm_hour, time_info.tm_min, time_info.tm_sec);
-    takeSample(current_sample_index);
-    
-    current_sample_index = (current_sample_index + 1) % SAMPLES_PER_HOUR; // Advance circular buffer index
-    samples_taken_this_hour = min(samples_taken_this_hour + 1, SAMPLES_PER_HOUR); // Increment sample count for the hour
+    takeSample(now_epoch);
+    samples_taken_this_hour++;
     last_sample_minute_taken = time_info.tm_min; // Mark this minute as sampled
   }
 
@@ -139,21 +500,41 @@ void loop() {
     last_sample_minute_taken = -1;
   }
 
+  // --- Adaptive extra samples between the 10-minute marks ---
+  if (ADAPTIVE_SAMPLING_ENABLED &&
+      adaptive_interval_sec < ADAPTIVE_MAX_INTERVAL_SEC &&
+      last_sample_epoch > 0 &&
+      now_epoch - last_sample_epoch >= adaptive_interval_sec) {
+    takeIntermediateSample(now_epoch);
+  }
+
   // --- NTP-aligned Hourly Reporting (e.g., at hh:00:05) ---
   if (time_info.tm_min == 0 &&                         // Top of the hour
-      time_info.tm_sec == REPORTING_TRIGGER_SECOND && // Specific second to trigger report
+      time_info.tm_sec >= REPORTING_TRIGGER_SECOND && // Trigger second reached (may have been stepped over)
       last_report_hour_sent != time_info.tm_hour &&   // Ensure only one report per hour
       samples_taken_this_hour > 0) {                  // Only report if samples were taken
         
     Serial.printf("Initiating hourly report for hour: %d\n", time_info.tm_hour);
-    reportDataToGoogleSheet();
+    // The report sent at hh:00:05 covers the hour that just ended; send that hour's
+    // start (UTC epoch) so late or replayed reports are filed under the right hour.
+    reportDataToGoogleSheet(now_epoch - (now_epoch % REPORT_WINDOW_SECONDS) - REPORT_WINDOW_SECONDS);
     
-    // Reset for the next hour
-    clearSampleArrays();
-    current_sample_index = 0;
+    // Reset for the next hour; the hh:00 sample stays as the starting point of its first trapezoid
+    resetHourlyAggregates(now_epoch - (now_epoch % REPORT_WINDOW_SECONDS));
     samples_taken_this_hour = 0;
     last_report_hour_sent = time_info.tm_hour;
   }
+  serviceCoapUplink();
+
+  // --- Drain queued reports between the hourly reports ---
+  if (report_queue_count > 0 && WiFi.status() == WL_CONNECTED &&
+      current_millis - last_upload_attempt_ms >= (upload_wait_ms ? upload_wait_ms : REPORT_RETRY_MS)) {
+    uploadReports(nullptr, 0);
+  }
+  // Close ring buckets on time even while no samples arrive (10-minute cadence)
+  ringAdvance(0, (uint32_t)(now_epoch / rings[0].period_sec));
+  handleSerialCommands();
+
   delay(200); // Small delay to yield to other processes, adjust as needed
 }
 
@@ -162,104 +543,657 @@ void loop() {
 // =======================================================================================
 
 /**
- * @brief Synchronizes the ESP8266's internal clock with an NTP server.
+ * @brief (Re)starts SNTP. Does not block: the SDK polls in the background and loop()
+ * notices when the clock becomes valid.
  */
 void synchronizeNtpTime() {
-  Serial.print("Synchronizing time with NTP server... ");
-  time_t now = time(nullptr);
-  int retries = NTP_SYNC_MAX_TRIES;
-  
-  // Wait until time is valid (e.g., after year 2000)
-  while (now < MIN_EPOCH_TIME_SEC && retries-- > 0) {
-    delay(NTP_SYNC_RETRY_DELAY_MS);
-    now = time(nullptr);
-    Serial.print(".");
+  Serial.println("Starting NTP time synchronization.");
+  configTime(GMT_OFFSET_SECONDS, DAYLIGHT_OFFSET_SECONDS, NTP_SERVER_PRIMARY, NTP_SERVER_SECONDARY);
+}
+
+/**
+ * @return Checksum over an RTC memory record, excluding its last (checksum) word.
+ */
+uint32_t rtcChecksum(const void* record, size_t size) {
+  const uint32_t* words = (const uint32_t*)record;
+  uint32_t h = 2166136261u; // FNV-1a over the words
+  for (size_t i = 0; i < size / 4 - 1; i++) h = (h ^ words[i]) * 16777619u;
+  return h;
+}
+
+/**
+ * @brief Sets a provisional clock from the anchor in RTC memory plus the RTC timer
+ * cycles elapsed since, which keep counting through soft and watchdog resets.
+ * @return true if the clock was restored.
+ */
+bool restoreClock() {
+  RtcClockState saved;
+  if (!ESP.rtcUserMemoryRead(RTC_CLOCK_BLOCK, (uint32_t*)&saved, sizeof(saved)) ||
+      saved.magic != RTC_CLOCK_MAGIC || saved.checksum != rtcChecksum(&saved, sizeof(saved))) {
+    return false;
   }
-  Serial.println();
+  rtc_clock.drift_ppm = saved.drift_ppm; // Still valid even if the time below is not
 
-  if (now < MIN_EPOCH_TIME_SEC) {
-    Serial.println("NTP Time synchronization failed!");
-  } else {
-    struct tm timeinfo;
-    localtime_r(&now, &timeinfo); // Use localtime_r for thread safety
-    Serial.print("NTP Time synchronized: ");
-    Serial.print(asctime(&timeinfo)); // asctime() adds a newline
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  if (reason == REASON_DEFAULT_RST || reason == REASON_EXT_SYS_RST) return false; // RTC timer restarted too
+  uint64_t gap_us = ((uint64_t)(system_get_rtc_time() - saved.rtc_cycles) * saved.rtc_cal) >> 12;
+  if (gap_us > RTC_CLOCK_MAX_GAP_US) return false;
+
+  uint64_t usec = saved.epoch_usec + gap_us;
+  timeval tv;
+  tv.tv_sec  = saved.epoch_sec + (time_t)(usec / 1000000ULL);
+  tv.tv_usec = (suseconds_t)(usec % 1000000ULL);
+  settimeofday(&tv, nullptr);
+  Serial.printf("Clock restored from RTC memory (%lu ms since the last anchor).\n", (unsigned long)(gap_us / 1000));
+  return true;
+}
+
+/**
+ * @brief Applies the measured drift and rewrites the RTC-memory anchor, once per second.
+ */
+void persistClock() {
+  timeval tv;
+  gettimeofday(&tv, nullptr);
+  if (tv.tv_sec < MIN_EPOCH_TIME_SEC || (anchor_valid && (uint32_t)tv.tv_sec == rtc_clock.epoch_sec)) return;
+  unsigned long now_ms = millis();
+
+  if (anchor_valid) {
+    drift_acc_us += (int64_t)rtc_clock.drift_ppm * (long)(now_ms - persisted_millis) / 1000;
+    if (drift_acc_us >= 1000 || drift_acc_us <= -1000) { // Step the clock in whole milliseconds
+      int64_t usec = (int64_t)tv.tv_usec + drift_acc_us;
+      tv.tv_sec += (time_t)(usec / 1000000);
+      usec %= 1000000;
+      if (usec < 0) { usec += 1000000; tv.tv_sec--; }
+      tv.tv_usec = (suseconds_t)usec;
+      settimeofday(&tv, nullptr);
+      drift_acc_us = 0;
+    }
+  }
+
+  rtc_clock.epoch_sec  = (uint32_t)tv.tv_sec;
+  rtc_clock.epoch_usec = (uint32_t)tv.tv_usec;
+  rtc_clock.rtc_cycles = system_get_rtc_time();
+  rtc_clock.rtc_cal    = system_rtc_clock_cali_proc();
+  rtc_clock.checksum   = rtcChecksum(&rtc_clock, sizeof(rtc_clock));
+  ESP.rtcUserMemoryWrite(RTC_CLOCK_BLOCK, (uint32_t*)&rtc_clock, sizeof(rtc_clock));
+  persisted_millis = now_ms;
+  anchor_valid = true;
+}
+
+/**
+ * @brief SNTP callback: measures how far the local clock was off and folds the error
+ * over the interval since the previous NTP update into the drift estimate.
+ */
+void onNtpTimeSet() {
+  timeval tv;
+  gettimeofday(&tv, nullptr);
+  unsigned long now_ms = millis();
+  if (anchor_valid) {
+    int64_t expected_us = (int64_t)rtc_clock.epoch_sec * 1000000 + rtc_clock.epoch_usec +
+                          (int64_t)(now_ms - persisted_millis) * 1000 + drift_acc_us;
+    int64_t error_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - expected_us;
+    last_ntp_fix_ms = (long)(error_us / 1000);
+    if (clock_from_ntp && now_ms - ntp_anchor_millis >= DRIFT_MIN_INTERVAL_MS) {
+      float residual_ppm = (float)error_us * 1000.0f / (float)(now_ms - ntp_anchor_millis);
+      long drift = rtc_clock.drift_ppm + lroundf(DRIFT_EWMA_ALPHA * residual_ppm);
+      rtc_clock.drift_ppm = (int32_t)constrain(drift, -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+    }
+  }
+  drift_acc_us = 0;
+  anchor_valid = false; // Re-anchor on the new time in the next loop()
+  clock_from_ntp = true;
+  ntp_anchor_millis = now_ms;
+  ntp_set_pending = true;
+}
+
+/**
+ * @brief Joins the cached access point directly: known channel and BSSID (no scan) and,
+ * with WIFI_FAST_STATIC_IP, the previous lease (no DHCP). Waits at most WIFI_FAST_TIMEOUT_MS.
+ * @return true if connected; otherwise DHCP is restored and the cache dropped.
+ */
+bool fastWifiConnect() {
+  wifi_connect_start_ms = millis();
+  if (!WIFI_FAST_RECONNECT_ENABLED ||
+      !ESP.rtcUserMemoryRead(RTC_WIFI_BLOCK, (uint32_t*)&wifi_cache, sizeof(wifi_cache)) ||
+      wifi_cache.magic != RTC_WIFI_MAGIC || wifi_cache.checksum != rtcChecksum(&wifi_cache, sizeof(wifi_cache))) {
+    return false;
+  }
+
+  WiFi.persistent(false); // Don't rewrite the SDK's flash config on every boot
+  WiFi.mode(WIFI_STA);
+  if (WIFI_FAST_STATIC_IP) {
+    WiFi.config(IPAddress(wifi_cache.ip), IPAddress(wifi_cache.gateway), IPAddress(wifi_cache.mask), IPAddress(wifi_cache.dns));
+  }
+  WiFi.begin(SSID, PASS, wifi_cache.channel, wifi_cache.bssid);
+  while (WiFi.status() != WL_CONNECTED && millis() - wifi_connect_start_ms < WIFI_FAST_TIMEOUT_MS) delay(10);
+  if (WiFi.status() == WL_CONNECTED) return true;
+
+  Serial.println("Fast WiFi reconnect failed, falling back to a full scan.");
+  wifi_cache.magic = 0; // The AP moved or the lease is gone: don't try it again
+  ESP.rtcUserMemoryWrite(RTC_WIFI_BLOCK, (uint32_t*)&wifi_cache, sizeof(wifi_cache));
+  WiFi.disconnect();
+  WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u)); // Back to DHCP
+  return false;
+}
+
+/**
+ * @brief Times every (re)connect and refreshes the RTC-memory cache on each new connection.
+ */
+void trackWifi() {
+  bool connected = (WiFi.status() == WL_CONNECTED);
+  if (connected == wifi_was_connected) return;
+  wifi_was_connected = connected;
+  if (!connected) {
+    wifi_connect_start_ms = millis();
+    wifi_fast_attempted = false;
+    Serial.println("WiFi connection lost.");
+    return;
   }
+
+  last_wifi_connect_ms = millis() - wifi_connect_start_ms;
+  last_wifi_connect_fast = wifi_fast_attempted;
+  wifi_connects++;
+  Serial.printf("WiFi connected in %lu ms (%s).\n", last_wifi_connect_ms, last_wifi_connect_fast ? "cached BSSID/IP" : "scan + DHCP");
+
+  memcpy(wifi_cache.bssid, WiFi.BSSID(), sizeof(wifi_cache.bssid));
+  wifi_cache.magic    = RTC_WIFI_MAGIC;
+  wifi_cache.channel  = (uint16_t)WiFi.channel();
+  wifi_cache.ip       = (uint32_t)WiFi.localIP();
+  wifi_cache.gateway  = (uint32_t)WiFi.gatewayIP();
+  wifi_cache.mask     = (uint32_t)WiFi.subnetMask();
+  wifi_cache.dns      = (uint32_t)WiFi.dnsIP();
+  wifi_cache.checksum = rtcChecksum(&wifi_cache, sizeof(wifi_cache));
+  ESP.rtcUserMemoryWrite(RTC_WIFI_BLOCK, (uint32_t*)&wifi_cache, sizeof(wifi_cache));
 }
 
 /**
- * @brief Takes sensor readings and stores them in the sample arrays at the given index.
- * @param sample_idx The index in the sample arrays to store the new readings.
+ * @brief Reads every channel once; invalid readings come back as NAN.
+ * @param values Output, NUM_CHANNELS entries (DS18B20 probes, DHT temp, DHT humidity).
  */
-void takeSample(int sample_idx) {
+void readChannels(float values[]) {
   ds18b20_sensors.requestTemperatures(); // Request all DS18B20 sensors to convert temperature
+  readConvertedChannels(values);
+}
 
+/**
+ * @brief Reads the result of a conversion that has already finished, plus the DHT.
+ */
+void readConvertedChannels(float values[]) {
   // Read DS18B20 sensors
   for (int i = 0; i < NUM_DS18B20_SENSORS; i++) {
     float temp_c = ds18b20_sensors.getTempC(ds18b20_addresses[i]);
     if (temp_c == DEVICE_DISCONNECTED_C || temp_c == 85.0 || temp_c == (-127.0) ) { // 85C can be a power-on reset value, -127 is error
-      ds18b20_temp_samples[i][sample_idx] = NAN; // Store NAN for invalid readings
+      values[i] = NAN; // Store NAN for invalid readings
       Serial.printf("Error reading DS18B20 Sensor %d.\n", i + 1);
     } else {
-      ds18b20_temp_samples[i][sample_idx] = temp_c;
+      values[i] = temp_c;
     }
   }
 
-  // Read DHT sensor
-  float dht_temp = dht.readTemperature(); // Celsius
-  float dht_hum  = dht.readHumidity();    // Percent
+  // Read DHT sensor (DHT library returns NAN on failure)
+  values[NUM_DS18B20_SENSORS]     = dht.readTemperature(); // Celsius
+  values[NUM_DS18B20_SENSORS + 1] = dht.readHumidity();    // Percent
+}
 
-  // Validate DHT readings (DHT library often returns NAN on failure)
-  dht_temp_samples[sample_idx]   = (!isnan(dht_temp)) ? dht_temp : NAN;
-  dht_humidity_samples[sample_idx] = (!isnan(dht_hum))  ? dht_hum  : NAN;
+/**
+ * @brief Folds one reading into the hourly time-weighted means and updates the
+ * adaptive sampling interval.
+ */
+void accumulateSample(time_t sample_epoch, const float values[]) {
+  if (hour_window_start == 0) hour_window_start = sample_epoch - (sample_epoch % REPORT_WINDOW_SECONDS);
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    addTimeWeighted(hourly_means[ch], sample_epoch, values[ch]);
+    if (!isnan(values[ch])) addToSketch(hourly_sketches[ch], values[ch]);
+  }
+  ringAdvance(0, (uint32_t)(sample_epoch / rings[0].period_sec));
+  ringAccumulate(0, values);
 
-  Serial.printf("Sample [%d]:", sample_idx);
-  for (int i = 0; i < NUM_DS18B20_SENSORS; i++) {
-    Serial.printf(" DS%d:%.2fC", i + 1, ds18b20_temp_samples[i][sample_idx]);
+  long elapsed_sec = (last_sample_epoch > 0) ? (long)(sample_epoch - last_sample_epoch) : 1;
+  updateSamplingInterval(constrain(elapsed_sec, 1L, (long)ADAPTIVE_MAX_INTERVAL_SEC), values);
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) last_sample_values[ch] = values[ch];
+  last_sample_epoch = sample_epoch;
+
+  updateCloudVariables(values);
+}
+
+/**
+ * @brief Reads the conversion started in setup(). Goes into the hour like any other
+ * sample when the clock is already valid; otherwise only the live Cloud values get it.
+ */
+void takeBootSample() {
+  float values[NUM_CHANNELS];
+  readConvertedChannels(values);
+  time_to_first_sample_ms = millis();
+  Serial.printf("First sample after %lu ms.\n", time_to_first_sample_ms);
+
+  time_t now_epoch = time(nullptr);
+  if (now_epoch >= MIN_EPOCH_TIME_SEC) {
+    accumulateSample(now_epoch, values);
+  } else {
+    updateCloudVariables(values);
   }
-  Serial.printf(" DHT-T:%.2fC DHT-H:%.1f%%\n", dht_temp_samples[sample_idx], dht_humidity_samples[sample_idx]);
+}
 
-  // Update Arduino Cloud "live" variables with the latest sample
+/**
+ * @brief Pushes a reading to the Arduino Cloud "live" variables.
+ */
+void updateCloudVariables(const float values[]) {
   // Ensure these variable names (sensor1, dhtTemp etc.) match those in your thingProperties.h
-  if (NUM_DS18B20_SENSORS > 0) sensor1 = ds18b20_temp_samples[0][sample_idx];
-  if (NUM_DS18B20_SENSORS > 1) sensor2 = ds18b20_temp_samples[1][sample_idx];
-  if (NUM_DS18B20_SENSORS > 2) sensor3 = ds18b20_temp_samples[2][sample_idx];
-  if (NUM_DS18B20_SENSORS > 3) sensor4 = ds18b20_temp_samples[3][sample_idx];
-  dhtTemp = dht_temp_samples[sample_idx];
-  dhtHumi = dht_humidity_samples[sample_idx];
+  if (NUM_DS18B20_SENSORS > 0) sensor1 = values[0];
+  if (NUM_DS18B20_SENSORS > 1) sensor2 = values[1];
+  if (NUM_DS18B20_SENSORS > 2) sensor3 = values[2];
+  if (NUM_DS18B20_SENSORS > 3) sensor4 = values[3];
+  dhtTemp = values[NUM_DS18B20_SENSORS];
+  dhtHumi = values[NUM_DS18B20_SENSORS + 1];
 }
 
 /**
- * @brief Calculates averages and sends the hourly report to Google Sheets.
+ * @brief Drops to the fastest interval as soon as any channel moves, and doubles it
+ * back towards the 10-minute grid after ADAPTIVE_CALM_SAMPLES calm samples.
  */
-void reportDataToGoogleSheet() {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("WiFi not connected. Cannot send report to Google Sheet.");
+void updateSamplingInterval(long elapsed_sec, const float values[]) {
+  bool moving = false;
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    float v = values[ch];
+    if (isnan(v)) continue;
+    if (!isnan(last_sample_values[ch])) {
+      float rate_per_min = fabsf(v - last_sample_values[ch]) * 60.0f / elapsed_sec;
+      if (rate_per_min > ADAPTIVE_RATE_LIMIT[ch]) moving = true;
+    }
+    if (isnan(ewma_mean[ch])) {
+      ewma_mean[ch] = v;
+    } else {
+      float diff = v - ewma_mean[ch];
+      ewma_mean[ch] += ADAPTIVE_EWMA_ALPHA * diff;
+      ewma_var[ch] = (1.0f - ADAPTIVE_EWMA_ALPHA) * (ewma_var[ch] + ADAPTIVE_EWMA_ALPHA * diff * diff);
+      if (sqrtf(ewma_var[ch]) > ADAPTIVE_STDDEV_LIMIT[ch]) moving = true;
+    }
+  }
+
+  int previous = adaptive_interval_sec;
+  if (moving) {
+    adaptive_interval_sec = ADAPTIVE_MIN_INTERVAL_SEC;
+    adaptive_calm_count = 0;
+  } else if (++adaptive_calm_count >= ADAPTIVE_CALM_SAMPLES) {
+    adaptive_interval_sec = min(adaptive_interval_sec * 2, ADAPTIVE_MAX_INTERVAL_SEC);
+    adaptive_calm_count = 0;
+  }
+  if (adaptive_interval_sec != previous) {
+    Serial.printf("Adaptive sampling interval: %d s -> %d s\n", previous, adaptive_interval_sec);
+  }
+}
+
+/**
+ * @brief Adds one sample to a channel's time-weighted mean. O(1).
+ */
+void addTimeWeighted(TimeWeightedMean& m, time_t epoch, float value) {
+  if (isnan(value)) {
+    m.last_value = NAN; // A failed read breaks the trapezoid chain
     return;
   }
+  if (!isnan(m.last_value) && epoch > m.last_epoch && epoch - m.last_epoch <= TW_MAX_GAP_SEC) {
+    // Clip the segment to the current hour, interpolating its start if needed
+    time_t from = max(m.last_epoch, hour_window_start);
+    if (epoch > from) {
+      float from_value = m.last_value + (value - m.last_value) *
+                         (float)(from - m.last_epoch) / (float)(epoch - m.last_epoch);
+      long dt = (long)(epoch - from);
+      m.area += 0.5 * ((double)from_value + value) * dt;
+      m.span_sec += dt;
+      if (epoch - m.last_epoch <= TW_NOMINAL_GAP_SEC) m.covered_sec += dt;
+    }
+  }
+  m.point_sum += value;
+  m.point_count++;
+  m.last_epoch = epoch;
+  m.last_value = value;
+}
 
-  Serial.println("[Reporting hourly averages to Google Sheets]");
-  
-  // Calculate averages
-  float avg_ds18b20_temps[NUM_DS18B20_SENSORS];
+/**
+ * @return The time-weighted mean for the hour, the plain mean when no two samples
+ * could be joined, or NAN if the hour has no valid sample.
+ */
+float timeWeightedAverage(const TimeWeightedMean& m) {
+  if (m.span_sec > 0) return (float)(m.area / m.span_sec);
+  return (m.point_count > 0) ? (float)(m.point_sum / m.point_count) : NAN;
+}
+
+/**
+ * @return Fraction of the hour (0..1) backed by samples at most one sampling interval apart.
+ */
+float coverageFraction(const TimeWeightedMean& m) {
+  return min(1.0f, (float)m.covered_sec / (float)REPORT_WINDOW_SECONDS);
+}
+
+/**
+ * @brief Adds one sample to a quantile sketch (P² marker adjustment).
+ */
+void addToSketch(QuantileSketch& q, float x) {
+  if (q.count < P2_MARKERS) {
+    // Fill phase: keep the raw samples sorted
+    int i = q.count++;
+    while (i > 0 && q.heights[i - 1] > x) {
+      q.heights[i] = q.heights[i - 1];
+      i--;
+    }
+    q.heights[i] = x;
+    for (int m = 0; m < P2_MARKERS; m++) q.positions[m] = m + 1;
+    return;
+  }
+  if (q.count == UINT16_MAX) return; // Hours never get near this; stop rather than overflow
+
+  // Find the cell containing x, extending the extremes if needed
+  int k;
+  if (x < q.heights[0]) {
+    q.heights[0] = x;
+    k = 0;
+  } else if (x >= q.heights[P2_MARKERS - 1]) {
+    q.heights[P2_MARKERS - 1] = x;
+    k = P2_MARKERS - 2;
+  } else {
+    k = 0;
+    while (x >= q.heights[k + 1]) k++;
+  }
+  for (int m = k + 1; m < P2_MARKERS; m++) q.positions[m]++;
+  q.count++;
+
+  // Nudge the inner markers towards their desired positions
+  for (int m = 1; m < P2_MARKERS - 1; m++) {
+    float desired = 1.0f + (q.count - 1) * P2_MARKER_PROBS[m];
+    float d = desired - q.positions[m];
+    int   gap_up   = q.positions[m + 1] - q.positions[m];
+    int   gap_down = q.positions[m - 1] - q.positions[m];
+    if ((d >= 1.0f && gap_up > 1) || (d <= -1.0f && gap_down < -1)) {
+      int s = (d > 0) ? 1 : -1;
+      float n0 = q.positions[m - 1], n1 = q.positions[m], n2 = q.positions[m + 1];
+      float h0 = q.heights[m - 1],   h1 = q.heights[m],   h2 = q.heights[m + 1];
+      // Piecewise-parabolic prediction, falling back to linear if it breaks monotonicity
+      float h = h1 + s / (n2 - n0) * ((n1 - n0 + s) * (h2 - h1) / (n2 - n1) + (n2 - n1 - s) * (h1 - h0) / (n1 - n0));
+      if (!(h0 < h && h < h2)) {
+        h = (s > 0) ? h1 + (h2 - h1) / (n2 - n1) : h1 - (h0 - h1) / (n0 - n1);
+      }
+      q.heights[m] = h;
+      q.positions[m] += s;
+    }
+  }
+}
+
+/**
+ * @return Estimate of quantile QUANTILES[qi], or NAN for an empty sketch.
+ */
+float sketchQuantile(const QuantileSketch& q, int qi) {
+  if (q.count == 0) return NAN;
+  if (q.count <= P2_MARKERS) {
+    // Exact (heights are still the sorted raw samples), with linear interpolation between the sorted samples
+    float rank = QUANTILES[qi] * (q.count - 1);
+    int lo = (int)rank;
+    int hi = min(lo + 1, (int)q.count - 1);
+    return q.heights[lo] + (q.heights[hi] - q.heights[lo]) * (rank - lo);
+  }
+  return q.heights[2 * qi + 2]; // Quantile markers sit at 2, 4, 6
+}
+
+/**
+ * @brief Adds one set of channel values to a level's open bucket (NAN channels skipped).
+ */
+void ringAccumulate(int level, const float values[]) {
+  RingLevel& r = rings[level];
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    if (isnan(values[ch])) continue;
+    r.open_sum[ch] += values[ch];
+    r.open_count[ch]++;
+  }
+}
+
+/**
+ * @brief Closes a level's buckets up to (not including) `bucket`, storing each mean
+ * and feeding it into the next level. Long gaps push at most `capacity` empty buckets.
+ */
+void ringAdvance(int level, uint32_t bucket) {
+  RingLevel& r = rings[level];
+  if (r.open_bucket == 0) {
+    r.open_bucket = bucket;
+    return;
+  }
+  while (r.open_bucket < bucket) {
+    float mean[NUM_CHANNELS];
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      mean[ch] = r.open_count[ch] ? r.open_sum[ch] / r.open_count[ch] : NAN;
+      r.entries[r.head][ch] = isnan(mean[ch]) ? RING_EMPTY
+                                              : (int16_t)constrain(lroundf(mean[ch] * 100.0f), -32767L, 32767L);
+      r.open_sum[ch] = 0.0f;
+      r.open_count[ch] = 0;
+    }
+    r.head = (r.head + 1) % r.capacity;
+    r.size = min((int)r.size + 1, (int)r.capacity);
+
+    if (level + 1 < NUM_RING_LEVELS) {
+      time_t closed_epoch = (time_t)r.open_bucket * r.period_sec;
+      ringAdvance(level + 1, (uint32_t)(closed_epoch / rings[level + 1].period_sec));
+      ringAccumulate(level + 1, mean);
+    }
+    r.open_bucket++;
+    if (bucket - r.open_bucket > r.capacity) r.open_bucket = bucket - r.capacity; // Older empties would be overwritten anyway
+  }
+}
+
+/**
+ * @brief Reads one stored bucket of a level; i = 0 is the oldest. Costs one slot
+ * lookup, so dashboards and uploads can page through any resolution cheaply.
+ * @param values Receives NUM_CHANNELS bucket means (NAN where the bucket had no data).
+ * @param bucket_epoch Receives the bucket's start time.
+ * @return false if `i` is out of range.
+ */
+bool ringRead(int level, int i, float values[], time_t& bucket_epoch) {
+  const RingLevel& r = rings[level];
+  if (i < 0 || i >= r.size) return false;
+  int slot = (r.head - r.size + i + r.capacity) % r.capacity;
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    int16_t v = r.entries[slot][ch];
+    values[ch] = (v == RING_EMPTY) ? NAN : v / 100.0f;
+  }
+  bucket_epoch = (time_t)(r.open_bucket - r.size + i) * r.period_sec;
+  return true;
+}
+
+/**
+ * @brief Serial commands: "r<level>" prints that ring level as CSV (epoch, then channels).
+ */
+void handleSerialCommands() {
+  if (Serial.available() < 2) return;
+  if (Serial.read() != 'r') return;
+  int level = Serial.read() - '0';
+  if (level < 0 || level >= NUM_RING_LEVELS) return;
+
+  Serial.printf("# ring level %d: %u x %u s\n", level, rings[level].size, rings[level].period_sec);
+  Serial.print("epoch");
+  for (int k = 0; k < 6; k++) Serial.printf(",%s", PAYLOAD_KEYS[k]);
+  Serial.println();
+  float values[NUM_CHANNELS];
+  time_t bucket_epoch;
+  for (int i = 0; ringRead(level, i, values, bucket_epoch); i++) {
+    Serial.printf("%lld", (long long)bucket_epoch);
+    for (int k = 0; k < 6; k++) Serial.printf(",%.2f", payloadValue(values, k));
+    Serial.println();
+  }
+}
+
+/**
+ * @brief Starts a new hour for every channel, keeping each channel's last sample.
+ * @param window_start UTC epoch of the hour's start (0: set from the first sample).
+ */
+void resetHourlyAggregates(time_t window_start) {
+  hour_window_start = window_start;
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    TimeWeightedMean& m = hourly_means[ch];
+    m.area        = 0.0;
+    m.span_sec    = 0;
+    m.covered_sec = 0;
+    m.point_sum   = 0.0;
+    m.point_count = 0;
+    hourly_sketches[ch].count = 0;
+  }
+}
+
+/**
+ * @brief Takes the NTP-aligned reading at a 10-minute mark.
+ * @param sample_epoch Time of the reading.
+ */
+void takeSample(time_t sample_epoch) {
+  float values[NUM_CHANNELS];
+  readChannels(values);
+  accumulateSample(sample_epoch, values);
+  if (COAP_UPLINK_ENABLED) coapEnqueue(UPLINK_SAMPLE, sample_epoch, values, nullptr, nullptr);
+
+  Serial.print("Sample:");
   for (int i = 0; i < NUM_DS18B20_SENSORS; i++) {
-    avg_ds18b20_temps[i] = calculateAverage(ds18b20_temp_samples[i], samples_taken_this_hour);
+    Serial.printf(" DS%d:%.2fC", i + 1, values[i]);
+  }
+  Serial.printf(" DHT-T:%.2fC DHT-H:%.1f%%\n", values[NUM_DS18B20_SENSORS], values[NUM_DS18B20_SENSORS + 1]);
+}
+
+/**
+ * @brief Takes an extra reading between the 10-minute marks (adaptive mode).
+ */
+void takeIntermediateSample(time_t sample_epoch) {
+  float values[NUM_CHANNELS];
+  readChannels(values);
+  accumulateSample(sample_epoch, values);
+  if (COAP_UPLINK_ENABLED) coapEnqueue(UPLINK_SAMPLE, sample_epoch, values, nullptr, nullptr);
+  Serial.printf("Adaptive sample (every %d s): DS1:%.2fC DHT-H:%.1f%%\n",
+                adaptive_interval_sec, values[0], values[NUM_DS18B20_SENSORS + 1]);
+}
+
+/**
+ * @brief Maps a payload key index (sensor1..4, dhttemp, dhthumidity) to its channel value.
+ */
+float payloadValue(const float channel_values[], int key_idx) {
+  if (key_idx < 4) return (key_idx < NUM_DS18B20_SENSORS) ? channel_values[key_idx] : NAN;
+  return channel_values[NUM_DS18B20_SENSORS + (key_idx - 4)];
+}
+
+/**
+ * @brief Appends `,"key":[v1,…,v6]` in payload key order to `out`, with null for NAN.
+ * @return The new length, or -1 if the buffer is too small.
+ */
+int appendJsonArray(char* out, size_t size, int len, const char* key, const float channel_values[]) {
+  if (len < 0) return -1;
+  int n = snprintf(out + len, size - len, ",\"%s\":[", key);
+  for (int k = 0; k < 6; k++) {
+    if (n < 0 || len + n >= (int)size) return -1;
+    len += n;
+    float v = payloadValue(channel_values, k);
+    n = isnan(v) ? snprintf(out + len, size - len, "%snull", k ? "," : "")
+                 : snprintf(out + len, size - len, "%s%.2f", k ? "," : "", v);
   }
-  float avg_dht_temp = calculateAverage(dht_temp_samples, samples_taken_this_hour);
-  float avg_dht_hum  = calculateAverage(dht_humidity_samples, samples_taken_this_hour);
+  if (n < 0 || len + n >= (int)size) return -1;
+  len += n;
+  n = snprintf(out + len, size - len, "]");
+  return (n < 0 || len + n >= (int)size) ? -1 : len + n;
+}
 
-  // Prepare JSON payload
+/**
+ * @brief Appends `,"key":value`, or `,"key":null` for 0 (metric not known yet).
+ * @return The new length, or -1 if the buffer is too small.
+ */
+int appendJsonMetric(char* out, size_t size, int len, const char* key, unsigned long value) {
+  if (len < 0) return -1;
+  int n = value ? snprintf(out + len, size - len, ",\"%s\":%lu", key, value)
+                : snprintf(out + len, size - len, ",\"%s\":null", key);
+  return (n < 0 || len + n >= (int)size) ? -1 : len + n;
+}
+
+/**
+ * @brief Appends `,"telemetry":{…}` with the reset reason, uptime and boot metrics.
+ * @return The new length, or -1 if the buffer is too small.
+ */
+int appendTelemetry(char* out, size_t size, int len) {
+  if (len < 0) return -1;
+  int n = snprintf(out + len, size - len, ",\"telemetry\":{\"reset\":\"%s\",\"clock\":\"%s\",\"drift_ppm\":%ld,\"ntp_fix_ms\":%ld",
+                   ESP.getResetReason().c_str(), clock_from_ntp ? "ntp" : "rtc", (long)rtc_clock.drift_ppm, last_ntp_fix_ms);
+  if (n < 0 || len + n >= (int)size) return -1;
+  len += n;
+  len = appendJsonMetric(out, size, len, "uptime_s", millis() / 1000);
+  len = appendJsonMetric(out, size, len, "ttfs_ms", time_to_first_sample_ms);
+  len = appendJsonMetric(out, size, len, "ntp_ms", time_to_ntp_ms);
+  len = appendJsonMetric(out, size, len, "ttfu_ms", time_to_first_upload_ms);
+  len = appendJsonMetric(out, size, len, "wifi_ms", last_wifi_connect_ms);
+  len = appendJsonMetric(out, size, len, "wifi_connects", wifi_connects);
+  if (len < 0) return -1;
+  n = snprintf(out + len, size - len, ",\"wifi_fast\":%s,\"dns\":{\"hits\":%lu,\"lookups\":%lu,\"stale\":%lu,\"failovers\":%lu}"
+               ",\"redirects\":{\"followed\":%lu,\"reused\":%lu}",
+               last_wifi_connect_fast ? "true" : "false", dns_hits, dns_lookups, dns_stale, dns_failovers,
+               http_redirects, http_redirects_reused);
+  if (n < 0 || len + n >= (int)size) return -1;
+  len += n;
+  // TLS buffers and heap: "saved" is what the sized buffers free against BearSSL's defaults
+  int tls_saved = tls_rx_size ? TLS_DEFAULT_BUFFERS - (tls_rx_size + TLS_IN_OVERHEAD + tls_tx_size + TLS_OUT_OVERHEAD) : 0;
+  n = snprintf(out + len, size - len, ",\"tls\":{\"mfln\":%d,\"rx\":%d,\"tx\":%d,\"saved\":%d,\"heap_connected\":%lu}"
+               ",\"heap_free\":%lu,\"heap_max_block\":%lu",
+               max(tls_mfln, 0), tls_rx_size, tls_tx_size, tls_saved, tls_heap_connected,
+               (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMaxFreeBlockSize());
+  if (n < 0 || len + n >= (int)size) return -1;
+  len += n;
+  n = snprintf(out + len, size - len, ",\"upload\":{\"queued\":%d,\"dropped\":%lu,\"raw\":%lu,\"sent\":%lu,\"deflate_us\":%lu,\"post_ms\":%lu"
+               ",\"throttled\":%lu,\"wait_s\":%lu,\"batch_max\":%d}",
+               report_queue_count, report_queue_dropped, upload_bytes_raw, upload_bytes_sent, last_deflate_us, last_upload_ms,
+               upload_throttled, upload_wait_ms / 1000, upload_batch_max);
+  if (n < 0 || len + n >= (int)size) return -1;
+  len += n;
+  if (len < 0 || len + 1 >= (int)size) return -1;
+  out[len++] = '}';
+  out[len] = '\0';
+  return len;
+}
+
+/**
+ * @brief Calculates averages and sends the hourly report to Google Sheets.
+ * @param window_start_epoch UTC epoch of the start of the hour being reported.
+ */
+void reportDataToGoogleSheet(time_t window_start_epoch) {
+  // Time-weighted averages, coverage and percentiles per channel
+  float averages[NUM_CHANNELS], coverage[NUM_CHANNELS], percentiles[NUM_QUANTILES][NUM_CHANNELS];
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    averages[ch] = timeWeightedAverage(hourly_means[ch]);
+    coverage[ch] = coverageFraction(hourly_means[ch]);
+    for (int qi = 0; qi < NUM_QUANTILES; qi++) percentiles[qi][ch] = sketchQuantile(hourly_sketches[ch], qi);
+  }
+
+  if (COAP_UPLINK_ENABLED) {
+    coapEnqueue(UPLINK_REPORT, window_start_epoch, averages, coverage, percentiles);
+    Serial.printf("[Hourly report queued for the CoAP gateway] confirmed %lu, retransmits %lu, dropped %lu, "
+                  "%lu bytes sent, last RTT %lu ms\n",
+                  coap_confirmed, coap_retransmits, coap_dropped, coap_bytes_sent, coap_last_rtt_ms);
+    return;
+  }
+  Serial.println("[Reporting hourly averages to Google Sheets]");
+
+  // Prepare JSON payload:
+  // {"device":…,"epoch":…,"sensor1":…,…,"dhthumidity":…,
+  //  "coverage":[c1,…,c6],"p5":[…],"p50":[…],"p95":[…],"telemetry":{…}}
+  // Arrays follow the sensor1..dhthumidity key order.
   // Adjust buffer size if more data fields are added.
   // Using snprintf for safer string formatting.
-  char json_payload[256]; 
-  int written_chars = snprintf(json_payload, sizeof(json_payload),
-             "{\"sensor1\":%.2f,\"sensor2\":%.2f,\"sensor3\":%.2f,\"sensor4\":%.2f,\"dhttemp\":%.2f,\"dhthumidity\":%.2f}",
-             (NUM_DS18B20_SENSORS > 0) ? avg_ds18b20_temps[0] : NAN,
-             (NUM_DS18B20_SENSORS > 1) ? avg_ds18b20_temps[1] : NAN,
-             (NUM_DS18B20_SENSORS > 2) ? avg_ds18b20_temps[2] : NAN,
-             (NUM_DS18B20_SENSORS > 3) ? avg_ds18b20_temps[3] : NAN,
-             avg_dht_temp,
-             avg_dht_hum);
+  static char json_payload[REPORT_MAX_BYTES]; // Static: keeps it off the 4 KB stack during the TLS handshake
+  int written_chars = snprintf(json_payload, sizeof(json_payload), "{\"device\":\"agro-%06x\",\"epoch\":%lld",
+                               ESP.getChipId(), (long long)window_start_epoch);
+  for (int k = 0; k < 6 && written_chars > 0 && written_chars < (int)sizeof(json_payload); k++) {
+    written_chars += snprintf(json_payload + written_chars, sizeof(json_payload) - written_chars, ",\"%s\":%.2f",
+                              PAYLOAD_KEYS[k], payloadValue(averages, k));
+  }
+  if (written_chars >= (int)sizeof(json_payload)) written_chars = -1;
+  written_chars = appendJsonArray(json_payload, sizeof(json_payload), written_chars, "coverage", coverage);
+  for (int qi = 0; qi < NUM_QUANTILES; qi++) {
+    written_chars = appendJsonArray(json_payload, sizeof(json_payload), written_chars, QUANTILE_KEYS[qi], percentiles[qi]);
+  }
+  int record_chars = written_chars; // The report without telemetry, as queued if it can't be sent
+  written_chars = appendTelemetry(json_payload, sizeof(json_payload), written_chars);
+  if (written_chars > 0 && written_chars < (int)sizeof(json_payload) - 1) {
+    json_payload[written_chars++] = '}';
+    json_payload[written_chars] = '\0';
+  } else {
+    written_chars = -1;
+  }
 
   if (written_chars < 0 || written_chars >= sizeof(json_payload)) {
     Serial.println("Error: JSON payload encoding failed or buffer too small.");
@@ -268,66 +1202,831 @@ void reportDataToGoogleSheet() {
 
   Serial.print("Sending JSON: "); Serial.println(json_payload);
 
-  WiFiClientSecure https_client;
-  // For ESP8266, `setFingerprint()` or `setTrustAnchors()` is more secure if you have the server's fingerprint/CA.
-  // `setInsecure()` skips server certificate validation (less secure, MITM risk).
-  https_client.setInsecure(); 
-  // https_client.setBufferSizes(1024, 512); // Optional: if needed for larger responses
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("WiFi not connected. Report queued.");
+    enqueueReport(json_payload, record_chars);
+    return;
+  }
+  if (upload_wait_ms && millis() - last_upload_attempt_ms < upload_wait_ms) {
+    Serial.printf("Upload deferred for another %lu s. Report queued.\n",
+                  (upload_wait_ms - (millis() - last_upload_attempt_ms)) / 1000);
+    enqueueReport(json_payload, record_chars);
+    return;
+  }
+  if (report_queue_count + 1 > upload_batch_max) {
+    // The server wants smaller batches: queue behind the backlog and send its oldest part
+    enqueueReport(json_payload, record_chars);
+    uploadReports(nullptr, 0);
+    return;
+  }
+  if (!uploadReports(json_payload, written_chars)) enqueueReport(json_payload, record_chars);
+}
 
-  HTTPClient http_client;
-  http_client.setTimeout(10000); // Increased timeout for potentially slow Google Scripts
+/**
+ * @return `ms` ± 25 %, so nodes sharing a schedule spread out.
+ */
+unsigned long jittered(unsigned long ms) {
+  return ms - ms / 4 + (unsigned long)random((long)(ms / 2) + 1);
+}
 
-  if (http_client.begin(https_client, GOOGLE_SCRIPT_URL)) {
-    http_client.addHeader("Content-Type", "application/json; charset=utf-8");
-    
-    int http_response_code = http_client.POST(json_payload); // Send the payload as String or uint8_t*
-    
-    if (http_response_code > 0) {
-      Serial.printf("HTTP POST successful, Response Code: %d\n", http_response_code);
-      String response_body = http_client.getString();
-      Serial.println("Response body: " + response_body);
+/**
+ * @brief Removes the `n` oldest reports from the queue.
+ */
+void dropQueuedReports(int n) {
+  int bytes = 0;
+  for (int i = 0; i < n; i++) bytes += report_queue_lens[i];
+  memmove(report_batch + 1, report_batch + 1 + bytes, report_queue_bytes - bytes);
+  memmove(report_queue_lens, report_queue_lens + n, (report_queue_count - n) * sizeof(report_queue_lens[0]));
+  report_queue_bytes -= bytes;
+  report_queue_count -= n;
+}
+
+/**
+ * @brief Sets the wait before the next upload from the response (or its absence).
+ * Retry-After wins; other failures double the wait from REPORT_RETRY_MS up to
+ * UPLOAD_RETRY_MAX_MS. A batch-size hint applies from the next POST on. Called after
+ * delivered reports have left the queue.
+ */
+void scheduleNextUpload(int status, bool delivered) {
+  if (status > 0 && http_head.batch_max > 0) {
+    upload_batch_max = constrain(http_head.batch_max, 1, REPORT_QUEUE_MAX + 1);
+  } else if (delivered) {
+    upload_batch_max = REPORT_QUEUE_MAX + 1; // No hint: the server takes any batch again
+  }
+  upload_failures = delivered ? 0 : upload_failures + 1;
+  if (status > 0 && http_head.retry_after >= 0 && !delivered) {
+    unsigned long retry_s = min((unsigned long)http_head.retry_after, UPLOAD_RETRY_AFTER_MAX_S);
+    upload_throttled++;
+    // Never earlier than asked: jitter only adds up to 25 %
+    upload_wait_ms = max(retry_s * 1000UL, 1000UL);
+    upload_wait_ms += (unsigned long)random((long)(upload_wait_ms / 4) + 1);
+    Serial.printf("Server busy: next upload in %lu s, at most %d report(s) per batch.\n", upload_wait_ms / 1000,
+                  upload_batch_max);
+  } else if (!delivered) {
+    upload_wait_ms = jittered(min(REPORT_RETRY_MS << min(upload_failures - 1, 8), UPLOAD_RETRY_MAX_MS));
+    Serial.printf("Upload failed: next attempt in %lu s.\n", upload_wait_ms / 1000);
+  } else if (report_queue_count > 0) {
+    upload_wait_ms = jittered(UPLOAD_PACE_MS); // Rest of the backlog, one hinted batch at a time
+  } else {
+    upload_wait_ms = 0;
+  }
+}
+
+/**
+ * @brief Queues a report (its first `len` chars, closed with '}') for a later batch,
+ * dropping the oldest queued reports when it doesn't fit.
+ */
+void enqueueReport(const char* report, int len) {
+  int entry = len + 2; // '}' + ','
+  if (entry > REPORT_QUEUE_BYTES) return;
+  while (report_queue_count > 0 &&
+         (report_queue_count == REPORT_QUEUE_MAX || report_queue_bytes + entry > REPORT_QUEUE_BYTES)) {
+    dropQueuedReports(1);
+    report_queue_dropped++;
+  }
+  char* dst = report_batch + 1 + report_queue_bytes;
+  memcpy(dst, report, len);
+  dst[len] = '}';
+  dst[len + 1] = ',';
+  report_queue_lens[report_queue_count++] = entry;
+  report_queue_bytes += entry;
+  Serial.printf("Upload queue: %d report(s), %d bytes.\n", report_queue_count, report_queue_bytes);
+}
+
+/**
+ * @brief Sends the oldest queued reports (up to upload_batch_max) plus `report` (may be
+ * null; the caller keeps it within the limit) in one POST: the report on its own when
+ * nothing is queued, otherwise a JSON array. Large bodies are deflated when
+ * UPLOAD_DEFLATE_ENABLED. Sent reports leave the queue once the server accepts them.
+ * @return true if the server accepted the upload.
+ */
+bool uploadReports(const char* report, int report_len) {
+  last_upload_attempt_ms = millis();
+  const char* body = report;
+  int body_len = report_len;
+  int send_count = min(report_queue_count, upload_batch_max);
+  int send_bytes = 0;
+  for (int i = 0; i < send_count; i++) send_bytes += report_queue_lens[i];
+  if (send_count > 0) {
+    report_batch[0] = '[';
+    body_len = 1 + send_bytes;
+    if (report) {
+      memcpy(report_batch + body_len, report, report_len);
+      body_len += report_len;
+      report_batch[body_len++] = ']';
     } else {
-      Serial.printf("HTTP POST failed, Error: %s (Code: %d)\n", http_client.errorToString(http_response_code).c_str(), http_response_code);
+      report_batch[body_len - 1] = ']'; // Over the last sent report's ','; put back below
     }
-    http_client.end();
+    body = report_batch;
+  }
+  if (!body || body_len <= 0) return true;
+
+  // Compression costs CPU time; the radio time it saves shows in last_upload_ms / bytes sent
+  const char* encoding = nullptr;
+  const uint8_t* wire = (const uint8_t*)body;
+  size_t wire_len = body_len;
+  if (UPLOAD_DEFLATE_ENABLED && body_len >= DEFLATE_MIN_BYTES) {
+    unsigned long start_us = micros();
+    size_t deflated = deflateCompress((const uint8_t*)body, body_len, deflate_out, sizeof(deflate_out));
+    last_deflate_us = micros() - start_us;
+    if (deflated > 0 && deflated < (size_t)body_len) {
+      wire = deflate_out;
+      wire_len = deflated;
+      encoding = "deflate";
+    }
+  }
+  upload_bytes_raw += body_len;
+  upload_bytes_sent += wire_len;
+  int reports = send_count + (report ? 1 : 0);
+  Serial.printf("Upload: %d report(s), %d -> %u bytes (%s, %lu us).\n", reports, body_len, (unsigned)wire_len,
+                encoding ? encoding : "identity", encoding ? last_deflate_us : 0UL);
+
+  char response_preview[HTTP_BODY_PREVIEW + 1];
+  unsigned long post_start_ms = millis();
+  int http_response_code = httpPost(GOOGLE_SCRIPT_URL, wire, wire_len, encoding,
+                                    response_preview, sizeof(response_preview));
+  last_upload_ms = millis() - post_start_ms;
+  if (send_count > 0 && !report) report_batch[send_bytes] = ',';
+  bool delivered = http_response_code > 0 && http_response_code < 400;
+  if (delivered) dropQueuedReports(send_count);
+  scheduleNextUpload(http_response_code, delivered);
+  if (http_response_code <= 0) {
+    Serial.printf("HTTP POST failed, Error: %s (Code: %d)\n", httpErrorName(http_response_code), http_response_code);
+    return false;
+  }
+  Serial.printf("HTTP POST done in %lu ms, Response Code: %d\n", last_upload_ms, http_response_code);
+  Serial.print("Response body: "); Serial.println(response_preview);
+  if (!delivered) return false;
+  if (time_to_first_upload_ms == 0) time_to_first_upload_ms = millis();
+  return true;
+}
+
+// =======================================================================================
+//                                 DEFLATE (RFC 1950/1951)
+// =======================================================================================
+// One fixed-Huffman block with greedy LZ77 over a small window, in a zlib wrapper. No
+// dynamic trees: the JSON's redundancy is in repeated keys and arrays, which LZ77 alone
+// removes, and fixed codes need no tables in RAM.
+
+/**
+ * @brief Appends `n` bits of `value`, LSB first.
+ */
+void deflatePutBits(DeflateOut& out, uint32_t value, int n) {
+  out.bits |= value << out.count;
+  out.count += n;
+  while (out.count >= 8) {
+    if (out.len < out.size) out.buf[out.len++] = (uint8_t)out.bits;
+    else out.overflow = true;
+    out.bits >>= 8;
+    out.count -= 8;
+  }
+}
+
+/**
+ * @brief Appends an `n`-bit Huffman code; these are defined MSB first.
+ */
+void deflatePutCode(DeflateOut& out, uint32_t code, int n) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < n; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  deflatePutBits(out, reversed, n);
+}
+
+/**
+ * @brief Appends a literal/length symbol (0..287) with its fixed code.
+ */
+void deflatePutSymbol(DeflateOut& out, int symbol) {
+  if (symbol < 144)      deflatePutCode(out, 0x30 + symbol, 8);
+  else if (symbol < 256) deflatePutCode(out, 0x190 + symbol - 144, 9);
+  else if (symbol < 280) deflatePutCode(out, symbol - 256, 7);
+  else                   deflatePutCode(out, 0xC0 + symbol - 280, 8);
+}
+
+/**
+ * @brief Appends a back-reference: length code + extra bits, distance code + extra bits.
+ */
+void deflatePutMatch(DeflateOut& out, int len, int dist) {
+  int lc = 0;
+  while (lc < 28 && DEFLATE_LEN_BASE[lc + 1] <= len) lc++;
+  deflatePutSymbol(out, 257 + lc);
+  deflatePutBits(out, len - DEFLATE_LEN_BASE[lc], DEFLATE_LEN_EXTRA[lc]);
+  int dc = 0;
+  while (dc < 29 && DEFLATE_DIST_BASE[dc + 1] <= dist) dc++;
+  deflatePutCode(out, dc, 5);
+  deflatePutBits(out, dist - DEFLATE_DIST_BASE[dc], DEFLATE_DIST_EXTRA[dc]);
+}
+
+/**
+ * @brief Hash of the 3 bytes at `p`, DEFLATE_HASH_BITS wide.
+ */
+uint16_t deflateHash(const uint8_t* p) {
+  uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (uint16_t)((uint32_t)(v * 2654435761u) >> (32 - DEFLATE_HASH_BITS));
+}
+
+/**
+ * @brief Compresses `in` into a zlib stream in `out`.
+ * @return The compressed length, or 0 if it doesn't fit into `out_size` bytes.
+ */
+size_t deflateCompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_size) {
+  if (in_len >= DEFLATE_NONE) return 0; // Positions are kept as uint16
+  DeflateOut o = {out, out_size, 0, 0, 0, false};
+  deflatePutBits(o, 0x78, 8); // zlib header: deflate, 32 KB max window, no dictionary
+  deflatePutBits(o, 0x01, 8);
+  deflatePutBits(o, 1, 1);    // Final block
+  deflatePutBits(o, 1, 2);    // Fixed Huffman codes
+  for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) deflate_head[i] = DEFLATE_NONE;
+
+  size_t pos = 0;
+  while (pos < in_len && !o.overflow) {
+    int best_len = 0, best_dist = 0;
+    if (pos + DEFLATE_MIN_MATCH <= in_len) {
+      int max_len = (int)min((size_t)DEFLATE_MAX_MATCH, in_len - pos);
+      uint16_t hash = deflateHash(in + pos);
+      uint16_t cand = deflate_head[hash];
+      for (int chain = 0; chain < DEFLATE_MAX_CHAIN && cand != DEFLATE_NONE && pos - cand <= (size_t)DEFLATE_WINDOW; chain++) {
+        int len = 0;
+        while (len < max_len && in[cand + len] == in[pos + len]) len++;
+        if (len > best_len) {
+          best_len = len;
+          best_dist = pos - cand;
+          if (len == max_len) break;
+        }
+        uint16_t next = deflate_prev[cand & (DEFLATE_WINDOW - 1)];
+        if (next != DEFLATE_NONE && next >= cand) break;
+        cand = next;
+      }
+      deflate_prev[pos & (DEFLATE_WINDOW - 1)] = deflate_head[hash];
+      deflate_head[hash] = pos;
+    }
+    if (best_len >= DEFLATE_MIN_MATCH) {
+      deflatePutMatch(o, best_len, best_dist);
+      for (size_t p = pos + 1; p < pos + best_len && p + DEFLATE_MIN_MATCH <= in_len; p++) {
+        uint16_t hash = deflateHash(in + p);
+        deflate_prev[p & (DEFLATE_WINDOW - 1)] = deflate_head[hash];
+        deflate_head[hash] = p;
+      }
+      pos += best_len;
+    } else {
+      deflatePutSymbol(o, in[pos]);
+      pos++;
+    }
+  }
+  deflatePutSymbol(o, 256); // End of block
+  if (o.count > 0) deflatePutBits(o, 0, 8 - o.count);
+
+  uint32_t a = 1, b = 0; // Adler-32 of the uncompressed data, big-endian
+  for (size_t i = 0; i < in_len; i++) {
+    a = (a + in[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  uint32_t adler = (b << 16) | a;
+  for (int shift = 24; shift >= 0; shift -= 8) deflatePutBits(o, (adler >> shift) & 0xFF, 8);
+  return o.overflow ? 0 : o.len;
+}
+
+// =======================================================================================
+//                                  LOCAL COAP UPLINK
+// =======================================================================================
+
+/**
+ * @brief Appends `v` as a big-endian int16 in hundredths (INT16_MIN for NAN/out of range).
+ */
+uint8_t* putHundredths(uint8_t* p, float v) {
+  int16_t h = (isnan(v) || fabsf(v) > 327.0f) ? INT16_MIN : (int16_t)lroundf(v * 100.0f);
+  *p++ = (uint8_t)((uint16_t)h >> 8);
+  *p++ = (uint8_t)h;
+  return p;
+}
+
+/**
+ * @brief Builds a confirmable CoAP POST for one sample or report and appends it to the
+ * outbox (dropping the oldest unconfirmed message when full). `coverage` and
+ * `percentiles` are only used for UPLINK_REPORT.
+ */
+void coapEnqueue(uint8_t kind, time_t epoch, const float values[], const float coverage[],
+                 const float percentiles[][NUM_CHANNELS]) {
+  if (coap_count == COAP_OUTBOX_SLOTS) {
+    if (coap_in_flight) { coap_in_flight = false; } // Its slot is reused below
+    coap_head = (coap_head + 1) % COAP_OUTBOX_SLOTS;
+    coap_count--;
+    coap_dropped++;
+  }
+  CoapSlot& slot = coap_outbox[(coap_head + coap_count) % COAP_OUTBOX_SLOTS];
+  uint8_t* p = slot.data;
+  uint16_t mid = ++coap_message_id;
+  *p++ = 0x40;                // Version 1, confirmable, no token
+  *p++ = 0x02;                // POST
+  *p++ = (uint8_t)(mid >> 8);
+  *p++ = (uint8_t)mid;
+  *p++ = 0xB1; *p++ = 'a';    // Uri-Path "a"
+  *p++ = 0x11; *p++ = 42;     // Content-Format: application/octet-stream
+  *p++ = 0xFF;                // Payload marker
+  uint32_t chip = ESP.getChipId();
+  uint32_t t = (uint32_t)epoch;
+  *p++ = kind;
+  for (int shift = 24; shift >= 0; shift -= 8) *p++ = (uint8_t)(chip >> shift);
+  for (int shift = 24; shift >= 0; shift -= 8) *p++ = (uint8_t)(t >> shift);
+  for (int k = 0; k < 6; k++) p = putHundredths(p, payloadValue(values, k));
+  if (kind == UPLINK_REPORT) {
+    for (int k = 0; k < 6; k++) {
+      float c = payloadValue(coverage, k);
+      *p++ = isnan(c) ? 0 : (uint8_t)constrain(lroundf(c * 200.0f), 0L, 200L);
+    }
+    for (int qi = 0; qi < NUM_QUANTILES; qi++) {
+      for (int k = 0; k < 6; k++) p = putHundredths(p, payloadValue(percentiles[qi], k));
+    }
+  }
+  slot.len = p - slot.data;
+  coap_count++;
+}
+
+/**
+ * @brief (Re)transmits the oldest outbox message.
+ */
+void coapTransmit() {
+  CoapSlot& slot = coap_outbox[coap_head];
+  IPAddress gateway;
+  if (!gateway.fromString(COAP_GATEWAY_HOST)) return;
+  coap_udp.beginPacket(gateway, COAP_PORT);
+  coap_udp.write(slot.data, slot.len);
+  coap_udp.endPacket();
+  coap_sent_ms = millis();
+  coap_bytes_sent += slot.len;
+}
+
+/**
+ * @brief Runs the confirmable-message exchange from loop(): matches ACKs, retransmits
+ * with exponential backoff and, after COAP_MAX_RETRANSMIT, pauses (keeping the message)
+ * for COAP_OUTAGE_RETRY_MS. Never blocks.
+ */
+void serviceCoapUplink() {
+  if (!COAP_UPLINK_ENABLED || WiFi.status() != WL_CONNECTED) return;
+  if (!coap_udp_open) coap_udp_open = coap_udp.begin(COAP_PORT);
+
+  // Replies: only the 4-byte header matters (piggybacked ACK, no token)
+  while (coap_udp.parsePacket() > 0) {
+    uint8_t head[4];
+    int n = coap_udp.read(head, sizeof(head));
+    coap_udp.flush();
+    if (n < 4 || !coap_in_flight) continue;
+    uint8_t type = (head[0] >> 4) & 0x03;
+    uint16_t mid = ((uint16_t)head[2] << 8) | head[3];
+    const uint8_t* sent = coap_outbox[coap_head].data;
+    if ((type != 2 && type != 3) || mid != (((uint16_t)sent[2] << 8) | sent[3])) continue; // Not ACK/RST for ours
+    if (type == 2 && (head[1] >> 5) == 2) {
+      coap_confirmed++;
+      coap_last_rtt_ms = millis() - coap_first_sent_ms;
+    } else {
+      coap_dropped++; // Reset or error response: resending the same bytes won't help
+      Serial.printf("CoAP: gateway rejected message %u (code %d.%02d).\n", mid, head[1] >> 5, head[1] & 0x1F);
+    }
+    coap_in_flight = false;
+    coap_head = (coap_head + 1) % COAP_OUTBOX_SLOTS;
+    coap_count--;
+  }
+
+  unsigned long now = millis();
+  if (!coap_in_flight) {
+    if (coap_count == 0 || (coap_paused_ms && now - coap_paused_ms < COAP_OUTAGE_RETRY_MS)) return;
+    coap_paused_ms = 0;
+    coap_in_flight = true;
+    coap_attempts = 0;
+    coap_timeout_ms = COAP_ACK_TIMEOUT_MS + random(COAP_ACK_TIMEOUT_MS / 2);
+    coapTransmit();
+    coap_first_sent_ms = coap_sent_ms;
+  } else if (now - coap_sent_ms >= coap_timeout_ms) {
+    if (coap_attempts >= COAP_MAX_RETRANSMIT) {
+      Serial.printf("CoAP: no ACK from %s; %d message(s) kept, retrying in %lu s.\n",
+                    COAP_GATEWAY_HOST, coap_count, COAP_OUTAGE_RETRY_MS / 1000);
+      coap_in_flight = false;
+      coap_paused_ms = now ? now : 1;
+      return;
+    }
+    coap_attempts++;
+    coap_retransmits++;
+    coap_timeout_ms *= 2;
+    coapTransmit();
+  }
+}
+
+// =======================================================================================
+//                                  UPLOAD TRANSPORT
+// =======================================================================================
+
+/**
+ * @brief Splits "http[s]://host[:port]/path" into `host`, `port`, `tls` and a pointer
+ * to the path in `url`. Plain http is for the local sink / gateway on the LAN.
+ * @return false for another scheme, a bad port, or a host that does not fit.
+ */
+bool splitUrl(const char* url, char* host, size_t host_size, uint16_t& port, bool& tls, const char*& path) {
+  const char* start;
+  if (strncmp(url, "https://", 8) == 0) {
+    tls = true;
+    port = HTTPS_PORT;
+    start = url + 8;
+  } else if (strncmp(url, "http://", 7) == 0) {
+    tls = false;
+    port = HTTP_PORT;
+    start = url + 7;
+  } else {
+    return false;
+  }
+  path = strchr(start, '/');
+  if (!path) path = start + strlen(start);
+  const char* colon = (const char*)memchr(start, ':', path - start);
+  const char* host_end = colon ? colon : path;
+  size_t len = host_end - start;
+  if (len == 0 || len >= host_size) return false;
+  if (colon) {
+    long value = strtol(colon + 1, nullptr, 10);
+    if (value <= 0 || value > 65535) return false;
+    port = (uint16_t)value;
+  }
+  memcpy(host, start, len);
+  host[len] = '\0';
+  if (*path == '\0') path = "/";
+  return true;
+}
+
+/**
+ * @brief Sends one A query for `host` to the network's DNS server and stores every
+ * returned address and the smallest TTL in `entry`.
+ */
+bool dnsQuery(const char* host, DnsCacheEntry& entry) {
+  uint8_t packet[300];
+  size_t len = 12;
+  uint16_t id = ++dns_query_id;
+  memset(packet, 0, len);
+  packet[0] = id >> 8; packet[1] = id & 0xFF;
+  packet[2] = 0x01;                        // Recursion desired
+  packet[5] = 1;                           // One question
+  for (const char* label = host; *label;) { // QNAME as length-prefixed labels
+    const char* dot = strchr(label, '.');
+    size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+    if (label_len == 0 || label_len > 63 || len + label_len + 6 > sizeof(packet)) return false;
+    packet[len++] = (uint8_t)label_len;
+    memcpy(packet + len, label, label_len);
+    len += label_len;
+    label += label_len + (dot ? 1 : 0);
+  }
+  packet[len++] = 0;
+  packet[len++] = 0; packet[len++] = 1;    // QTYPE A
+  packet[len++] = 0; packet[len++] = 1;    // QCLASS IN
+
+  WiFiUDP udp;
+  if (!udp.begin(0)) return false;
+  dns_lookups++;
+  udp.beginPacket(WiFi.dnsIP(), 53);
+  udp.write(packet, len);
+  udp.endPacket();
+  unsigned long start_ms = millis();
+  int reply_len = 0;
+  while ((reply_len = udp.parsePacket()) == 0 && millis() - start_ms < DNS_TIMEOUT_MS) delay(5);
+  if (reply_len < 12) { udp.stop(); return false; }
+  reply_len = udp.read(packet, sizeof(packet));
+  udp.stop();
+
+  // Header: same id, a response, RCODE 0
+  if (reply_len < 12 || packet[0] != (id >> 8) || packet[1] != (id & 0xFF) || !(packet[2] & 0x80) || (packet[3] & 0x0F)) return false;
+  int answers = (packet[6] << 8) | packet[7];
+  size_t pos = 12;
+  auto skipName = [&](size_t p) -> size_t { // Labels, possibly ending in a compression pointer
+    while (p < (size_t)reply_len) {
+      if (packet[p] == 0) return p + 1;
+      if ((packet[p] & 0xC0) == 0xC0) return p + 2;
+      p += packet[p] + 1;
+    }
+    return (size_t)reply_len + 1;
+  };
+  pos = skipName(pos) + 4;                 // The echoed question
+  uint8_t count = 0;
+  uint32_t ttl = DNS_MAX_TTL_SEC;
+  for (int a = 0; a < answers && pos < (size_t)reply_len; a++) {
+    pos = skipName(pos);
+    if (pos + 10 > (size_t)reply_len) break;
+    uint16_t type  = (packet[pos] << 8) | packet[pos + 1];
+    uint32_t rr_ttl = ((uint32_t)packet[pos + 4] << 24) | ((uint32_t)packet[pos + 5] << 16) | (packet[pos + 6] << 8) | packet[pos + 7];
+    uint16_t rdlen = (packet[pos + 8] << 8) | packet[pos + 9];
+    pos += 10;
+    if (pos + rdlen > (size_t)reply_len) break;
+    if (type == 1 && rdlen == 4 && count < DNS_MAX_ADDRS) { // CNAMEs in the chain are skipped
+      entry.addrs[count++] = (uint32_t)IPAddress(packet[pos], packet[pos + 1], packet[pos + 2], packet[pos + 3]);
+      ttl = min(ttl, rr_ttl);
+    }
+    pos += rdlen;
+  }
+  if (count == 0) return false;
+  entry.count = count;
+  entry.next = 0;
+  entry.ttl_sec = max(ttl, DNS_MIN_TTL_SEC);
+  entry.fetched_ms = millis();
+  return true;
+}
+
+/**
+ * @return The cache entry for `host` with at least one address: fresh, refreshed, or
+ * expired but within DNS_STALE_MAX_SEC when the lookup fails. nullptr if none.
+ */
+DnsCacheEntry* dnsResolve(const char* host) {
+  DnsCacheEntry* entry = nullptr;
+  for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+    if (strcmp(dns_cache[i].host, host) == 0) { entry = &dns_cache[i]; break; }
+  }
+  if (!entry) { // Reuse the oldest slot
+    entry = &dns_cache[0];
+    for (int i = 1; i < DNS_CACHE_ENTRIES; i++) {
+      if (dns_cache[i].fetched_ms < entry->fetched_ms) entry = &dns_cache[i];
+    }
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->host, host, sizeof(entry->host) - 1);
+  }
+
+  unsigned long age_sec = (millis() - entry->fetched_ms) / 1000;
+  if (entry->count > 0 && age_sec < entry->ttl_sec) {
+    dns_hits++;
+    return entry;
+  }
+  if (dnsQuery(host, *entry)) return entry;
+  if (entry->count > 0 && age_sec < DNS_STALE_MAX_SEC) {
+    dns_stale++;
+    Serial.printf("DNS lookup for %s failed, using an address cached %lu s ago.\n", host, age_sec);
+    return entry;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Connects to `host`. TLS always connects by name, so the handshake carries
+ * SNI (a connect by address sends none); that lookup goes through the system
+ * resolver. Plain http (a sink on the LAN) goes through the DNS cache instead,
+ * trying each cached address once (rotating past ones that fail), then the system
+ * resolver as a last resort. An IP literal is connected to directly.
+ */
+bool connectCached(WiFiClient& client, const char* host, uint16_t port, bool tls) {
+  if (tls) return client.connect(host, port);
+  IPAddress literal;
+  if (literal.fromString(host)) return client.connect(literal, port);
+  DnsCacheEntry* entry = dnsResolve(host);
+  for (int tries = 0; entry && tries < entry->count; tries++) {
+    if (client.connect(IPAddress(entry->addrs[entry->next]), port)) return true;
+    entry->next = (entry->next + 1) % entry->count;
+    dns_failovers++;
+  }
+  return client.connect(host, port);
+}
+
+/**
+ * @brief Reads one line into `buf`, CR/LF stripped; an overlong line is truncated and
+ * the rest of it discarded.
+ * @return Its length, or -1 on timeout.
+ */
+int readHttpLine(WiFiClient& client, char* buf, size_t size) {
+  size_t len = 0;
+  char c;
+  for (;;) {
+    if (client.readBytes(&c, 1) != 1) return -1;
+    if (c == '\n') break;
+    if (c != '\r' && len < size - 1) buf[len++] = c;
+  }
+  buf[len] = '\0';
+  return (int)len;
+}
+
+/**
+ * @brief Reads the status line and headers into `head`, keeping only what the
+ * transport needs (length / chunking, Connection: close, Location).
+ * @return The status code, or an HTTP_ERR_* value.
+ */
+int readResponseHead(WiFiClient& client, HttpResponseHead& head) {
+  char line[HTTP_LINE_MAX];
+  head.status = 0;
+  head.content_length = -1;
+  head.chunked = false;
+  head.close = false;
+  head.retry_after = -1;
+  head.batch_max = 0;
+  head.location[0] = '\0';
+
+  if (readHttpLine(client, line, sizeof(line)) < 0) return HTTP_ERR_TIMEOUT;
+  if (sscanf(line, "HTTP/1.%*d %d", &head.status) != 1 || head.status < 100) return HTTP_ERR_PROTOCOL;
+  for (;;) {
+    int len = readHttpLine(client, line, sizeof(line));
+    if (len < 0) return HTTP_ERR_TIMEOUT;
+    if (len == 0) break; // End of headers
+    const char* value = strchr(line, ':');
+    if (!value) continue;
+    value++;
+    while (*value == ' ') value++;
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      head.content_length = atol(value);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      head.chunked = (strstr(value, "chunked") != nullptr);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      head.close = (strncasecmp(value, "close", 5) == 0);
+    } else if (strncasecmp(line, "Retry-After:", 12) == 0) {
+      if (isdigit((unsigned char)*value)) head.retry_after = atol(value); // An HTTP-date is ignored
+    } else if (strncasecmp(line, "X-Agro-Batch-Max:", 17) == 0) {
+      head.batch_max = atoi(value);
+    } else if (strncasecmp(line, "Location:", 9) == 0) {
+      strncpy(head.location, value, sizeof(head.location) - 1);
+      head.location[sizeof(head.location) - 1] = '\0';
+    }
+  }
+  return head.status;
+}
+
+/**
+ * @brief Reads past a response body so the next response can be read on the same
+ * connection.
+ * @return false if the body has no known end (then the connection can't be reused).
+ */
+bool skipBody(WiFiClient& client, const HttpResponseHead& head) {
+  uint8_t scratch[64];
+  char line[16];
+  long remaining = head.content_length;
+  if (head.chunked) {
+    for (;;) {
+      if (readHttpLine(client, line, sizeof(line)) < 0) return false;
+      long chunk = strtol(line, nullptr, 16);
+      if (chunk == 0) break;
+      while (chunk > 0) {
+        size_t n = client.readBytes(scratch, (size_t)min(chunk, (long)sizeof(scratch)));
+        if (n == 0) return false;
+        chunk -= n;
+      }
+      if (readHttpLine(client, line, sizeof(line)) < 0) return false; // CRLF after the chunk
+    }
+    while (readHttpLine(client, line, sizeof(line)) > 0) {} // Trailers
+    return true;
+  }
+  if (remaining < 0) return false;
+  while (remaining > 0) {
+    size_t n = client.readBytes(scratch, (size_t)min(remaining, (long)sizeof(scratch)));
+    if (n == 0) return false;
+    remaining -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Reads up to preview_size - 1 bytes of the body (of the first chunk if chunked).
+ */
+void readBodyPreview(WiFiClient& client, const HttpResponseHead& head, char* preview, size_t preview_size) {
+  size_t want = preview_size - 1;
+  if (head.chunked) {
+    char line[16];
+    if (readHttpLine(client, line, sizeof(line)) < 0) want = 0;
+    else want = min(want, (size_t)strtol(line, nullptr, 16));
+  } else if (head.content_length >= 0) {
+    want = min(want, (size_t)head.content_length);
+  }
+  size_t n = want ? client.readBytes(preview, want) : 0;
+  preview[n] = '\0';
+}
+
+/**
+ * @brief Writes one request (with `body` only when non-null; `encoding` may be null).
+ */
+void sendRequest(WiFiClient& client, const char* method, const char* host, const char* path,
+                 const uint8_t* body, size_t body_len, const char* encoding) {
+  client.printf("%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: AgroPRO\r\nConnection: keep-alive\r\n", method, path, host);
+  if (body) {
+    if (encoding) client.printf("Content-Encoding: %s\r\n", encoding);
+    client.printf("Content-Type: application/json; charset=utf-8\r\nContent-Length: %u\r\n\r\n", (unsigned)body_len);
+    client.write(body, body_len);
   } else {
-    Serial.println("Error: Unable to connect to Google Script URL.");
+    client.print("\r\n");
   }
 }
 
 /**
- * @brief Clears all sample arrays by filling them with NAN.
+ * @brief HTTP/1.1 POST to `url`, over TLS for https (buffers sized by
+ * configureTlsBuffers()) or plain TCP for http, following redirects.
+ *
+ * 301/302/303 are followed as a GET: for Apps Script the POST has already run doPost()
+ * and the redirect only fetches its output. 307/308 re-send the body, as they require.
+ * The redirect goes over the same connection when it stays on the same host and port,
+ * the server keeps it open and the redirect body has a known length; otherwise over a
+ * new one (Apps Script's redirect to script.googleusercontent.com always is). Only the
+ * head and the first bytes of the final body are read. A redirect to another scheme is
+ * not followed.
+ *
+ * @param encoding Content-Encoding of `body` ("deflate"), or null.
+ * @param preview Receives the start of the final response body (NUL-terminated).
+ * @return The final HTTP status code, the redirect's own status if following it fails
+ * (the upload itself went through), or an HTTP_ERR_* value (< 0).
  */
-void clearSampleArrays() {
-  for (int i = 0; i < SAMPLES_PER_HOUR; i++) {
-    for (int j = 0; j < NUM_DS18B20_SENSORS; j++) {
-      ds18b20_temp_samples[j][i] = NAN;
+int httpPost(const char* url, const uint8_t* body, size_t body_len, const char* encoding,
+             char* preview, size_t preview_size) {
+  preview[0] = '\0';
+  char host[48];
+  uint16_t port;
+  bool tls;
+  const char* path;
+  if (!splitUrl(url, host, sizeof(host), port, tls, path)) return HTTP_ERR_URL;
+
+  WiFiClientSecure tls_client;
+  WiFiClient plain_client;
+  // For ESP8266, `setFingerprint()` or `setTrustAnchors()` is more secure if you have the server's fingerprint/CA.
+  // `setInsecure()` skips server certificate validation (less secure, MITM risk).
+  if (tls) {
+    tls_client.setInsecure();
+    configureTlsBuffers(tls_client, host, port);
+  }
+  WiFiClient& client = tls ? tls_client : plain_client;
+  if (!connectCached(client, host, port, tls)) {
+    if (tls && tls_mfln > 0) saveTlsCache(-1); // Maybe the server stopped honouring MFLN: probe again next time
+    return HTTP_ERR_CONNECT;
+  }
+  if (tls) tls_heap_connected = ESP.getFreeHeap();
+
+  client.setTimeout(HTTP_TIMEOUT_MS);
+  sendRequest(client, "POST", host, path, body, body_len, encoding);
+  int status = readResponseHead(client, http_head);
+
+  for (int hop = 0; hop < HTTP_MAX_REDIRECTS && status >= 300 && status < 400 && http_head.location[0]; hop++) {
+    int redirect_status = status;
+    bool resend_body = (status == 307 || status == 308);
+    char next_host[48];
+    uint16_t next_port;
+    bool next_tls;
+    if (!splitUrl(http_head.location, next_host, sizeof(next_host), next_port, next_tls, path)) break;
+    if (next_tls != tls) break; // One client per request; also refuses https -> http
+    http_redirects++;
+    // The open connection (and its TLS session and SNI) belongs to `host`
+    bool same_origin = strcmp(next_host, host) == 0 && next_port == port;
+    if (same_origin && !http_head.close && skipBody(client, http_head)) {
+      http_redirects_reused++;
+    } else {
+      client.stop();
+      if (!connectCached(client, next_host, next_port, tls)) { Serial.println("Redirect: connection failed."); return redirect_status; }
     }
-    dht_temp_samples[i]   = NAN;
-    dht_humidity_samples[i] = NAN;
+    strcpy(host, next_host);
+    port = next_port;
+    sendRequest(client, resend_body ? "POST" : "GET", host, path, resend_body ? body : nullptr, body_len, encoding);
+    status = readResponseHead(client, http_head);
+    if (status < 0) { Serial.printf("Redirect: %s.\n", httpErrorName(status)); client.stop(); return redirect_status; }
   }
-  Serial.println("Sample arrays cleared.");
+
+  if (status > 0) readBodyPreview(client, http_head, preview, preview_size);
+  client.stop();
+  return status;
 }
 
 /**
- * @brief Calculates the average of valid (non-NAN) float values in an array.
- * @param arr Pointer to the float array.
- * @param num_samples The number of samples to consider for averaging.
- * @return The average value, or NAN if no valid samples.
+ * @brief Stores the MFLN probe result (-1 forgets it) in RAM and RTC memory.
  */
-float calculateAverage(const float arr[], int num_samples) {
-  if (num_samples == 0) return NAN;
-  
-  float sum = 0.0f;
-  int valid_sample_count = 0;
-  for (int i = 0; i < num_samples; i++) {
-    if (!isnan(arr[i])) { // Only consider valid, non-NAN numbers
-      sum += arr[i];
-      valid_sample_count++;
+void saveTlsCache(int mfln) {
+  tls_mfln = mfln;
+  RtcTlsCache cache = {mfln >= 0 ? RTC_TLS_MAGIC : 0, (uint32_t)max(mfln, 0), 0};
+  cache.checksum = rtcChecksum(&cache, sizeof(cache));
+  ESP.rtcUserMemoryWrite(RTC_TLS_BLOCK, (uint32_t*)&cache, sizeof(cache));
+}
+
+/**
+ * @brief Sizes the TLS buffers before a connect. The first time (per power-up), probes
+ * which fragment lengths `host`:`port` accepts, smallest first, and keeps the result;
+ * hosts without MFLN get the full 16 KB receive buffer, but never more than 512 B to send.
+ */
+void configureTlsBuffers(WiFiClientSecure& client, const char* host, uint16_t port) {
+  if (tls_mfln < 0) {
+    RtcTlsCache cache;
+    if (ESP.rtcUserMemoryRead(RTC_TLS_BLOCK, (uint32_t*)&cache, sizeof(cache)) &&
+        cache.magic == RTC_TLS_MAGIC && cache.checksum == rtcChecksum(&cache, sizeof(cache))) {
+      tls_mfln = (int)cache.mfln;
     }
   }
-  
-  return (valid_sample_count > 0) ? (sum / valid_sample_count) : NAN;
+  if (tls_mfln < 0) {
+    int mfln = 0;
+    for (int i = 0; i < TLS_MFLN_COUNT && mfln == 0; i++) {
+      if (WiFiClientSecure::probeMaxFragmentLength(host, port, TLS_MFLN_SIZES[i])) mfln = TLS_MFLN_SIZES[i];
+    }
+    saveTlsCache(mfln);
+    if (mfln) {
+      Serial.printf("TLS: %s accepts %d-byte fragments.\n", host, mfln);
+    } else {
+      Serial.printf("TLS: %s does not negotiate MFLN; using a %d-byte receive buffer.\n", host, TLS_RX_FULL);
+    }
+  }
+  tls_rx_size = tls_mfln ? tls_mfln : TLS_RX_FULL;
+  tls_tx_size = TLS_TX_BUFFER;
+  client.setBufferSizes(tls_rx_size, tls_tx_size);
+}
+
+/**
+ * @return A short name for an HTTP_ERR_* code.
+ */
+const char* httpErrorName(int code) {
+  switch (code) {
+    case HTTP_ERR_URL:      return "bad URL";
+    case HTTP_ERR_CONNECT:  return "connection failed";
+    case HTTP_ERR_TIMEOUT:  return "no response";
+    case HTTP_ERR_PROTOCOL: return "malformed response";
+    default:                return "unknown";
+  }
 }
 
 // Ensure that cloud variables (sensor1, sensor2, etc.) are declared in "thingProperties.h"
@@ -3,6 +3,7 @@
 // --- Configuration ---
 const SPREADSHEET_ID = "10LiI4mE2pXZIAGsXhWJl5giGbgp0ytBHyS3JcWaoyTA";
 const SHEET_NAME = "Raw Data"; // The name of the sheet/tab to log data to
+const ALERT_SHEET_NAME = "Alerts"; // Immediate alerts from the device; created on first use
 
 // Define the order of sensor data keys as expected from the ESP8266 and for sheet columns
 const SENSOR_DATA_KEYS = [
@@ -51,33 +52,26 @@ function doPost(e) {
     const payload = JSON.parse(e.postData.contents);
     Logger.log("Parsed payload: " + JSON.stringify(payload));
 
-    // Timestamp for when the data is received and processed by the script.
-    // For more accuracy, the ESP8266 could send its own NTP-synced timestamp.
-    const timestamp = new Date();
-
-    // Prepare the row data for the spreadsheet
-    // The first column will be the timestamp.
-    const rowData = [timestamp];
-
-    // Process each expected sensor key
-    for (const key of SENSOR_DATA_KEYS) {
-      let value = payload[key];
-
-      // Handle cases where ESP8266 might send "nan" (string) for float NAN values,
-      // or if the value is otherwise not a valid number.
-      if (typeof value === 'string' && value.toLowerCase() === 'nan') {
-        rowData.push(null); // Store 'null' in the sheet for "nan" strings
-      } else if (typeof value === 'number' && !isNaN(value)) {
-        rowData.push(value); // Valid number, store as is (includes 0)
-      } else if (value === undefined || value === null) {
-        rowData.push(null); // Key was missing from payload or explicitly null
-      } else {
-        // If the value is something unexpected (e.g., a different string), log it and store null.
-        Logger.log("Warning: Unexpected value for key '" + key + "': " + value + " (Type: " + typeof value + "). Storing as null.");
-        rowData.push(null);
+    // Immediate alerts (Agro.cpp) carry a "rule" key and go to their own sheet
+    if (payload.rule) {
+      return logAlert(spreadsheet, payload);
+    }
+
+    // Reports the ESP8266 queued during an outage arrive together as an array,
+    // as do a gateway sink's forwarded batches (which may also carry alerts)
+    if (Array.isArray(payload)) {
+      const rows = payload.filter(report => report && !report.rule).map(buildRow);
+      if (rows.length > 0) {
+        sheet.getRange(sheet.getLastRow() + 1, 1, rows.length, rows[0].length).setValues(rows);
       }
+      payload.filter(report => report && report.rule).forEach(alert => logAlert(spreadsheet, alert));
+      Logger.log("Appended " + rows.length + " queued rows to sheet '" + SHEET_NAME + "'");
+      return ContentService.createTextOutput("Success: " + rows.length + " rows logged to " + SHEET_NAME)
+                           .setMimeType(ContentService.MimeType.TEXT);
     }
 
+    const rowData = buildRow(payload);
+
     // Append the processed row to the sheet
     sheet.appendRow(rowData);
     Logger.log("Successfully appended row to sheet '" + SHEET_NAME + "': " + JSON.stringify(rowData));
@@ -97,6 +91,69 @@ function doPost(e) {
   }
 }
 
+/**
+ * Builds a sheet row (timestamp, SENSOR_DATA_KEYS, device, resolution) from one report.
+ * Device and resolution come last so existing sheets keep their columns; they tell apart
+ * the nodes and RAW samples in a gateway sink's forwarded batches.
+ * @param {Object} payload The report from the ESP8266 or a gateway sink.
+ * @return {Array} The row values.
+ */
+function buildRow(payload) {
+  // Timestamp of the hour the report covers, as sent by the ESP8266 (NTP-synced).
+  // Falls back to the arrival time for older firmware that does not send "epoch",
+  // so a report delayed by an outage is still filed under the hour it describes.
+  const timestamp = (typeof payload.epoch === "number") ? new Date(payload.epoch * 1000) : new Date();
+
+  // Prepare the row data for the spreadsheet
+  // The first column will be the timestamp.
+  const rowData = [timestamp];
+
+  // Process each expected sensor key
+  for (const key of SENSOR_DATA_KEYS) {
+    let value = payload[key];
+
+    // Handle cases where ESP8266 might send "nan" (string) for float NAN values,
+    // or if the value is otherwise not a valid number.
+    if (typeof value === 'string' && value.toLowerCase() === 'nan') {
+      rowData.push(null); // Store 'null' in the sheet for "nan" strings
+    } else if (typeof value === 'number' && !isNaN(value)) {
+      rowData.push(value); // Valid number, store as is (includes 0)
+    } else if (value === undefined || value === null) {
+      rowData.push(null); // Key was missing from payload or explicitly null
+    } else {
+      // If the value is something unexpected (e.g., a different string), log it and store null.
+      Logger.log("Warning: Unexpected value for key '" + key + "': " + value + " (Type: " + typeof value + "). Storing as null.");
+      rowData.push(null);
+    }
+  }
+
+  // Reports posted straight from a node carry no "res" and are hourly; "device" may be
+  // absent for older firmware
+  rowData.push(payload.device || "");
+  rowData.push(payload.res || "hourly");
+  return rowData;
+}
+
+/**
+ * Appends a device alert to the alerts sheet.
+ * @param {Spreadsheet} spreadsheet The opened spreadsheet.
+ * @param {Object} payload {device, rule, channel, state, value, epoch} from the ESP8266.
+ * @return {ContentService.TextOutput} A text output indicating success.
+ */
+function logAlert(spreadsheet, payload) {
+  let sheet = spreadsheet.getSheetByName(ALERT_SHEET_NAME);
+  if (!sheet) {
+    sheet = spreadsheet.insertSheet(ALERT_SHEET_NAME);
+    sheet.appendRow(["Timestamp", "Device", "Rule", "Channel", "State", "Value"]);
+  }
+  const timestamp = (typeof payload.epoch === "number") ? new Date(payload.epoch * 1000) : new Date();
+  const value = (typeof payload.value === "number" && !isNaN(payload.value)) ? payload.value : null;
+  sheet.appendRow([timestamp, payload.device || "", payload.rule, payload.channel || "", payload.state || "firing", value]);
+  Logger.log("Logged alert: " + JSON.stringify(payload));
+  return ContentService.createTextOutput("Success: Alert logged")
+                       .setMimeType(ContentService.MimeType.TEXT);
+}
+
 // Optional: A simple function to test setup from the Apps Script editor
 function testSheetAccess() {
   try {
@@ -107,7 +164,7 @@ function testSheetAccess() {
       Logger.log("Test sheet '" + sheet.getName() + "' found and accessible.");
       // Example: Add a test header if sheet is empty
       // if (sheet.getLastRow() === 0) {
-      //   sheet.appendRow(["Timestamp", "Sensor1", "Sensor2", "Sensor3", "Sensor4", "DHT Temp", "DHT Humidity"]);
+      //   sheet.appendRow(["Timestamp", "Sensor1", "Sensor2", "Sensor3", "Sensor4", "DHT Temp", "DHT Humidity", "Device", "Resolution"]);
       //   Logger.log("Added header row to empty sheet.");
       // }
     } else {
@@ -0,0 +1,566 @@
+// Aman & Anna – AgroPRO Sink: local ingest service and partitioned record store
+// ────────────────────────────────────────────────────────────────
+// • Accepts the same JSON POST the firmware sends to the Google Apps Script
+// • Stores records in day/week partitions with per-resolution retention
+// • Serves range queries without scanning the whole history
+// • Compacts and re-compresses fragmented segments in the background
+// • Keeps the latest value of every device/channel for the live status view
+// • Pushes each ingested record to subscribed WebSocket dashboards
+// • Rolls RAW samples up into hourly rows on event time, correcting late windows
+// • Evaluates per-device alert rules on every record (thresholds, rates, silence)
+// • Accepts queued reports as one JSON array, optionally deflate/gzip-compressed
+// • Optional CoAP gateway: binary UDP uplink from the nodes
+// • Optional upstream: spools what the nodes send and forwards it in windowed
+//   bulk writes to another sink or the Apps Script, surviving outages
+// • Backpressure: batch-size hints under load, 503 + Retry-After when overloaded
+// ────────────────────────────────────────────────────────────────
+// Build:  g++ -std=c++17 -O2 -pthread AgroSink.cpp -o agro-sink -lz -lssl -lcrypto
+// Run:    ./agro-sink --port 8080 --data ./agro-data
+// Point GOOGLE_SCRIPT_URL in the firmware at http://<sink-host>:8080/ to use it.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "AlertEngine.h"
+#include "CoapGateway.h"
+#include "Compactor.h"
+#include "HttpServer.h"
+#include "LastValueCache.h"
+#include "LiveFanout.h"
+#include "PartitionStore.h"
+#include "SinkRecord.h"
+#include "Upstream.h"
+#include "WindowAggregator.h"
+
+// --- Configuration Defaults ---
+const int DEFAULT_PORT             = 8080;
+const int DEFAULT_MAINTENANCE_SEC  = 30;   // Seal / expire cadence
+const int HOURLY_REPORT_PERIOD_SEC = 3600;
+const int DEFAULT_STALE_SEC        = 2 * HOURLY_REPORT_PERIOD_SEC; // Two missed reports
+const int DEFAULT_MAX_INFLIGHT     = 64;  // Concurrent connections before POST / is refused
+const int DEFAULT_BATCH_MAX        = 64;  // Records per POST advertised while not loaded
+const int BUSY_RETRY_MAX_FACTOR    = 4;   // Retry-After grows with the overload, up to 4x
+
+/**
+ * @brief Everything the HTTP handlers need; owned by main().
+ */
+struct SinkContext {
+  PartitionStore&   store;
+  Compactor&        compactor;
+  LastValueCache&   last_values;
+  LiveFanout&       fanout;
+  WindowAggregator& windows;
+  AlertEngine&      alerts;
+  Upstream&         upstream; // Inactive unless --upstream is given
+  int64_t           stale_after_sec;
+  int               max_inflight;
+  int               busy_retry_sec;
+  int               batch_max;
+  CoapGateway*      gateway = nullptr; // Set once constructed; started only with --coap-port
+  HttpServer*       server  = nullptr; // Its connection count is the load signal
+};
+
+// --- Global Objects ---
+HttpServer*    g_server = nullptr;
+LastValueCache g_last_values; // ~1 MB, so it lives in static storage rather than on the stack
+
+// --- Ingest Counters (wire vs. inflated bytes show what compression saves) ---
+struct IngestStats {
+  std::atomic<uint64_t> batches{0};
+  std::atomic<uint64_t> batch_records{0};
+  std::atomic<uint64_t> compressed_bodies{0};
+  std::atomic<uint64_t> bytes_wire{0};
+  std::atomic<uint64_t> bytes_inflated{0};
+  std::atomic<uint64_t> throttled{0}; // POSTs refused with 503 + Retry-After
+};
+IngestStats g_ingest;
+
+/**
+ * @brief Stops the accept loop on SIGINT/SIGTERM; main() then flushes the store.
+ */
+void handleSignal(int) {
+  if (g_server) g_server->stop();
+}
+
+/**
+ * @brief Fills in device and epoch when the payload does not carry them.
+ * The firmware posts hourly averages at hh:00:05 for the hour that just ended,
+ * so an hourly record without an epoch is labelled with that hour's start.
+ */
+void completeRecord(AgroRecord& rec, const std::string& peer, int64_t now) {
+  if (rec.device.empty()) rec.device = peer;
+  if (rec.epoch == 0) {
+    rec.epoch = rec.res == Resolution::HOURLY
+                    ? (now / HOURLY_REPORT_PERIOD_SEC) * HOURLY_REPORT_PERIOD_SEC - HOURLY_REPORT_PERIOD_SEC
+                    : now;
+  }
+}
+
+/**
+ * @brief Upstream coalescing key: a later record for the same device, resolution and
+ * epoch in one window replaces the earlier one (the store keeps the last write too).
+ */
+std::string upstreamKey(const AgroRecord& rec) {
+  return rec.device + "/" + resolutionName(rec.res) + "/" + std::to_string(rec.epoch);
+}
+
+/**
+ * @brief Stores one parsed record and feeds the live stages; with --upstream, also
+ * spools it (as `upstream_json`, or the canonical record JSON when that is empty).
+ * @return false if the record is older than the retention window.
+ */
+bool ingestRecord(SinkContext& ctx, AgroRecord& rec, const std::string& peer, int64_t now,
+                  const std::string& upstream_json = "") {
+  completeRecord(rec, peer, now);
+  if (ctx.upstream.enabled()) {
+    // Forwarded even past local retention: upstream may keep history longer
+    if (upstream_json.empty()) {
+      std::string json;
+      appendRecordJson(json, rec);
+      ctx.upstream.add(upstreamKey(rec), json);
+    } else {
+      ctx.upstream.add(upstreamKey(rec), upstream_json);
+    }
+  }
+  if (!ctx.store.append(rec)) return false; // Past retention: no live status, no alerts
+  ctx.last_values.update(rec);
+  ctx.alerts.evaluate(rec, now);
+  if (rec.res == Resolution::RAW) {
+    ctx.windows.add(rec);
+  } else {
+    ctx.windows.markReported(rec); // The device's own hour beats the derived window
+  }
+  ctx.fanout.publish(rec);
+  return true;
+}
+
+/**
+ * @brief Backpressure for POST /. Every reply carries a batch-size hint: --batch-max
+ * while under half of --max-inflight connections, then shrinking linearly to 1 at the
+ * limit. Beyond it the request is refused before touching the store, with 503 and a
+ * Retry-After that grows with the overload (and is jittered by the server), so
+ * devices pause and come back in small batches instead of retrying together.
+ * @return false if the request was refused (`res` is the 503).
+ */
+bool admitIngest(SinkContext& ctx, HttpResponse& res) {
+  int active = ctx.server ? ctx.server->activeConnections() : 0;
+  int limit = ctx.max_inflight;
+  if (active > limit) {
+    int factor = std::min(active / limit + 1, BUSY_RETRY_MAX_FACTOR);
+    res = HttpServer::busyResponse(ctx.busy_retry_sec * factor, std::max(1, ctx.batch_max / 4));
+    g_ingest.throttled++;
+    return false;
+  }
+  int hint = ctx.batch_max;
+  if (active * 2 > limit) hint = std::max(1, (int)((int64_t)ctx.batch_max * 2 * (limit - active) / limit));
+  res.headers.push_back({HTTP_BATCH_MAX_HEADER, std::to_string(hint)});
+  return true;
+}
+
+/**
+ * @brief Hands an alert raised on a device to the alert engine (and upstream).
+ */
+void reportDeviceAlert(SinkContext& ctx, Alert& alert, const std::string& peer) {
+  if (alert.device.empty()) alert.device = peer;
+  if (alert.epoch == 0) alert.epoch = (int64_t)time(nullptr);
+  ctx.alerts.report(alert);
+  if (ctx.upstream.enabled()) ctx.upstream.add("", AlertEngine::alertJson(alert)); // Never coalesced
+}
+
+/**
+ * @brief POST / and POST /ingest – one AgroPRO JSON record, a JSON array of them (the
+ * firmware's drained upload queue, or a gateway's batch, which may carry alerts), or
+ * an alert raised on the device.
+ * Replies in the same text format as AgroPRO.js so the firmware needs no changes.
+ */
+void handleIngest(SinkContext& ctx, const HttpRequest& req, HttpResponse& res) {
+  if (!admitIngest(ctx, res)) return;
+  g_ingest.bytes_wire += req.wire_bytes;
+  g_ingest.bytes_inflated += req.body.size();
+  if (req.wire_bytes != req.body.size()) g_ingest.compressed_bodies++;
+
+  std::vector<AgroRecord> batch;
+  std::vector<std::string> others;
+  if (parseAgroJsonBatch(req.body, batch, &others)) {
+    size_t alerts = 0;
+    for (const std::string& element : others) {
+      Alert alert;
+      if (!parseDeviceAlert(element, alert)) continue;
+      reportDeviceAlert(ctx, alert, req.peer);
+      alerts++;
+    }
+    if (batch.empty() && alerts == 0) {
+      res = HttpServer::errorResponse(400, "Error: No data received in POST request.");
+      return;
+    }
+    // Records past retention are dropped rather than failing the batch: a retry can't help them
+    int64_t now = (int64_t)time(nullptr);
+    size_t logged = 0;
+    for (AgroRecord& rec : batch) logged += ingestRecord(ctx, rec, req.peer, now) ? 1 : 0;
+    g_ingest.batches++;
+    g_ingest.batch_records += batch.size();
+    res.body = "Success: " + std::to_string(logged) + " of " + std::to_string(batch.size()) + " records logged";
+    if (alerts) res.body += ", " + std::to_string(alerts) + " alerts";
+    return;
+  }
+
+  Alert alert;
+  if (parseDeviceAlert(req.body, alert)) {
+    reportDeviceAlert(ctx, alert, req.peer);
+    res.body = "Success: Alert logged";
+    return;
+  }
+
+  AgroRecord rec;
+  if (!parseAgroJson(req.body, rec)) {
+    res = HttpServer::errorResponse(400, "Error: No data received in POST request.");
+    return;
+  }
+  if (!ingestRecord(ctx, rec, req.peer, (int64_t)time(nullptr))) {
+    res = HttpServer::errorResponse(400, "Error: Record is older than the retention window.");
+    return;
+  }
+  res.body = std::string("Success: Data logged to ") + resolutionName(rec.res);
+}
+
+/**
+ * @brief GET /query?res=hourly&device=<id>&from=<epoch>&to=<epoch> – CSV rows.
+ * `device` may be omitted to return all devices; `to` defaults to now.
+ */
+void handleQuery(SinkContext& ctx, const HttpRequest& req, HttpResponse& res) {
+  Resolution resolution = Resolution::HOURLY;
+  if (!parseResolution(req.param("res", "hourly"), resolution)) {
+    res = HttpServer::errorResponse(400, "Error: res must be raw or hourly.");
+    return;
+  }
+  int64_t now  = (int64_t)time(nullptr);
+  int64_t from = strtoll(req.param("from", std::to_string(now - 86400)).c_str(), nullptr, 10);
+  int64_t to   = strtoll(req.param("to", std::to_string(now + 1)).c_str(), nullptr, 10);
+
+  res.content_type = "text/csv";
+  res.body = "epoch,device";
+  for (const char* key : CHANNEL_KEYS) res.body += std::string(",") + key;
+  res.body += "\n";
+  ctx.store.scan(resolution, req.param("device"), from, to, [&res](const std::string& device, const SegmentRow& row) {
+    char buf[32];
+    res.body += std::to_string(row.epoch) + "," + device;
+    for (float v : row.values) {
+      if (std::isnan(v)) {
+        res.body += ",";
+      } else {
+        snprintf(buf, sizeof(buf), ",%.2f", v);
+        res.body += buf;
+      }
+    }
+    res.body += "\n";
+  });
+}
+
+/**
+ * @brief GET /stats – store, compaction, live, windowing and alert counters as JSON.
+ */
+void handleStats(SinkContext& ctx, const HttpRequest&, HttpResponse& res) {
+  PartitionStore::Stats s = ctx.store.stats();
+  Compactor::Stats c = ctx.compactor.stats();
+  LiveFanout::Stats f = ctx.fanout.stats();
+  WindowAggregator::Stats w = ctx.windows.stats();
+  AlertEngine::Stats a = ctx.alerts.stats();
+  CoapGateway::Stats g = ctx.gateway ? ctx.gateway->stats() : CoapGateway::Stats();
+  Upstream::Stats u = ctx.upstream.stats();
+  char buf[3072];
+  snprintf(buf, sizeof(buf),
+           "{\"partitions_raw\":%zu,\"partitions_hourly\":%zu,\"segments\":%zu,\"segment_bytes\":%llu,"
+           "\"buffered_rows\":%zu,\"rows_appended\":%llu,\"rows_rejected\":%llu,"
+           "\"partitions_expired\":%llu,\"segments_compacted\":%llu,"
+           "\"compaction_runs\":%llu,\"compaction_bytes_in\":%llu,\"compaction_bytes_out\":%llu,"
+           "\"compaction_throttled_ms\":%llu,\"live_devices\":%zu,"
+           "\"live_subscribers\":%zu,\"live_messages\":%llu,\"live_frames_serialized\":%llu,"
+           "\"live_frames_queued\":%llu,\"live_frames_coalesced\":%llu,\"live_clients_dropped\":%llu,"
+           "\"windows_open\":%zu,\"windows_retained\":%zu,\"window_samples\":%llu,"
+           "\"windows_emitted\":%llu,\"window_corrections\":%llu,\"window_too_late\":%llu,\"windows_superseded\":%llu,"
+           "\"alert_rules\":%zu,\"alert_evaluations\":%llu,\"alerts_fired\":%llu,\"alerts_resolved\":%llu,"
+           "\"alerts_delivered\":%llu,\"alerts_failed\":%llu,\"alerts_dropped\":%llu,\"alerts_from_device\":%llu,"
+           "\"ingest_batches\":%llu,\"ingest_batch_records\":%llu,\"ingest_compressed\":%llu,"
+           "\"ingest_bytes_wire\":%llu,\"ingest_bytes_inflated\":%llu,\"ingest_throttled\":%llu,"
+           "\"coap_datagrams\":%llu,\"coap_records\":%llu,\"coap_duplicates\":%llu,\"coap_malformed\":%llu,"
+           "\"upstream_spooled\":%llu,\"upstream_dropped\":%llu,\"upstream_batches\":%llu,"
+           "\"upstream_forwarded\":%llu,\"upstream_coalesced\":%llu,\"upstream_failures\":%llu,"
+           "\"upstream_rejected\":%llu,\"upstream_spool_bytes\":%llu,\"upstream_last_status\":%d}",
+           s.partitions[0], s.partitions[1], s.segments, (unsigned long long)s.segment_bytes,
+           s.buffered_rows, (unsigned long long)s.rows_appended, (unsigned long long)s.rows_rejected,
+           (unsigned long long)s.partitions_expired, (unsigned long long)s.segments_compacted,
+           (unsigned long long)c.runs_compacted, (unsigned long long)c.bytes_in,
+           (unsigned long long)c.bytes_out, (unsigned long long)c.throttled_ms, ctx.last_values.size(),
+           f.subscribers, (unsigned long long)f.messages, (unsigned long long)f.frames_serialized,
+           (unsigned long long)f.frames_queued, (unsigned long long)f.frames_coalesced,
+           (unsigned long long)f.clients_dropped, w.open_windows, w.retained_windows,
+           (unsigned long long)w.samples, (unsigned long long)w.windows_emitted,
+           (unsigned long long)w.corrections, (unsigned long long)w.too_late,
+           (unsigned long long)w.superseded, a.rules,
+           (unsigned long long)a.evaluations, (unsigned long long)a.fired, (unsigned long long)a.resolved,
+           (unsigned long long)a.delivered, (unsigned long long)a.failed, (unsigned long long)a.dropped, (unsigned long long)a.from_device,
+           (unsigned long long)g_ingest.batches.load(), (unsigned long long)g_ingest.batch_records.load(),
+           (unsigned long long)g_ingest.compressed_bodies.load(), (unsigned long long)g_ingest.bytes_wire.load(),
+           (unsigned long long)g_ingest.bytes_inflated.load(), (unsigned long long)g_ingest.throttled.load(),
+           (unsigned long long)g.datagrams,
+           (unsigned long long)g.records, (unsigned long long)g.duplicates, (unsigned long long)g.malformed,
+           (unsigned long long)u.spooled, (unsigned long long)u.dropped, (unsigned long long)u.batches,
+           (unsigned long long)u.forwarded, (unsigned long long)u.coalesced, (unsigned long long)u.failures,
+           (unsigned long long)u.rejected, (unsigned long long)u.spool_bytes, u.last_status);
+  res.content_type = "application/json";
+  res.body = buf;
+}
+
+/**
+ * @brief Appends one device's live values as a compact JSON object:
+ * {"device":"…","t":<epoch>,"v":[…],"q":"ggsmmg"} with one entry per channel in
+ * CHANNEL_KEYS order; q letters are g(ood), s(uspect), m(issing), x (stale).
+ * All channels of a device arrive in the same record, so one event time suffices.
+ */
+void appendDeviceStatus(std::string& out, const std::string& device, const LastValue* values) {
+  static const char QUALITY_LETTERS[] = {'g', 's', 'm', 'x'};
+  int64_t epoch = 0;
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) epoch = std::max(epoch, values[ch].epoch);
+
+  out += "{\"device\":";
+  appendJsonString(out, device);
+  out += ",\"t\":";
+  appendInt(out, epoch);
+  out += ",\"v\":[";
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    if (ch) out.push_back(',');
+    appendFixed2(out, values[ch].value);
+  }
+  out += "],\"q\":\"";
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) out.push_back(QUALITY_LETTERS[values[ch].quality & 3]);
+  out += "\"}";
+}
+
+/**
+ * @brief GET /status[?device=<id>] – latest value, time and quality per channel,
+ * straight from the last-value cache (no store scan). X-Render-Us reports the
+ * server-side build time of the body.
+ */
+void handleStatus(SinkContext& ctx, const HttpRequest& req, HttpResponse& res) {
+  auto started = std::chrono::steady_clock::now();
+  int64_t now = (int64_t)time(nullptr);
+  std::string device = req.param("device");
+
+  res.content_type = "application/json";
+  res.body.reserve(device.empty() ? ctx.last_values.size() * 96 + 256 : 512);
+  res.body += "{\"now\":";
+  appendInt(res.body, now);
+  res.body += ",\"channels\":[";
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    if (ch) res.body.push_back(',');
+    res.body += std::string("\"") + CHANNEL_KEYS[ch] + "\"";
+  }
+  res.body += "],\"devices\":[";
+  bool first = true;
+  auto append = [&res, &first](const std::string& id, const LastValue* values) {
+    if (!first) res.body.push_back(',');
+    first = false;
+    appendDeviceStatus(res.body, id, values);
+  };
+  if (device.empty()) {
+    ctx.last_values.forEach(now, ctx.stale_after_sec, append);
+  } else {
+    LastValue values[NUM_CHANNELS];
+    bool found = false;
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      found |= ctx.last_values.get(device, ch, now, ctx.stale_after_sec, values[ch]);
+    }
+    if (found) append(device, values);
+  }
+  res.body += "]}";
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+  res.headers.push_back({"X-Render-Us", std::to_string(elapsed.count())});
+}
+
+/**
+ * @brief Window state is in memory only. Replays recent RAW rows so windows that
+ * were still open at shutdown are completed instead of restarting half-empty.
+ * Hourly rows already stored for that span are marked first, so a replayed window
+ * does not overwrite them.
+ */
+void restoreOpenWindows(PartitionStore& store, WindowAggregator& windows, int64_t now, int64_t allowed_lateness_sec) {
+  int64_t from = (now / WINDOW_SEC) * WINDOW_SEC - WINDOW_SEC - allowed_lateness_sec;
+  store.scan(Resolution::HOURLY, "", from - WINDOW_SEC, now + 1,
+             [&windows](const std::string& device, const SegmentRow& row) {
+               AgroRecord rec;
+               rec.device = device;
+               rec.epoch = row.epoch;
+               windows.markReported(rec);
+             });
+  store.scan(Resolution::RAW, "", from, now + 1, [&windows](const std::string& device, const SegmentRow& row) {
+    AgroRecord rec;
+    rec.device = device;
+    rec.epoch = row.epoch;
+    rec.res = Resolution::RAW;
+    std::copy(row.values, row.values + NUM_CHANNELS, rec.values);
+    windows.add(rec);
+  });
+}
+
+void printUsage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [--port N] [--data DIR] [--keep-raw-days N] [--keep-hourly-days N]\n"
+          "          [--maintenance-sec N] [--compact-kbps N] [--stale-sec N]\n"
+          "          [--allowed-lateness-sec N] [--correction-horizon-sec N]\n"
+          "          [--alert-rules FILE] [--alert-log FILE] [--alert-webhook http://HOST[:PORT]/PATH]\n"
+          "          [--coap-port N] [--upstream http[s]://HOST[:PORT]/PATH] [--upstream-window-sec N]\n"
+          "          [--spool-max-mb N] [--max-inflight N] [--busy-retry-sec N] [--batch-max N]\n",
+          argv0);
+}
+
+int main(int argc, char** argv) {
+  int port = DEFAULT_PORT;
+  int maintenance_sec = DEFAULT_MAINTENANCE_SEC;
+  uint64_t compact_bytes_per_sec = DEFAULT_COMPACT_BYTES_PER_SEC;
+  int64_t stale_after_sec = DEFAULT_STALE_SEC;
+  int64_t allowed_lateness_sec = DEFAULT_ALLOWED_LATENESS_SEC;
+  int64_t correction_horizon_sec = DEFAULT_CORRECTION_HORIZON_SEC;
+  std::string data_dir = "./agro-data";
+  std::string alert_rules, alert_log, alert_webhook;
+  int coap_port = 0; // 0: gateway off
+  std::string upstream_url; // Empty: nothing forwarded
+  int upstream_window_sec = UPSTREAM_DEFAULT_WINDOW_SEC;
+  uint64_t spool_max_bytes = UPSTREAM_DEFAULT_SPOOL_BYTES;
+  int max_inflight = DEFAULT_MAX_INFLIGHT;
+  int busy_retry_sec = HTTP_BUSY_RETRY_SEC;
+  int batch_max = DEFAULT_BATCH_MAX;
+  RetentionPolicy policies[NUM_RESOLUTIONS] = {DEFAULT_RETENTION[0], DEFAULT_RETENTION[1]};
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--port") {
+      port = atoi(value);
+    } else if (arg == "--data") {
+      data_dir = value;
+    } else if (arg == "--keep-raw-days") {
+      policies[(int)Resolution::RAW].retention_sec = atoll(value) * 86400LL;
+    } else if (arg == "--keep-hourly-days") {
+      policies[(int)Resolution::HOURLY].retention_sec = atoll(value) * 86400LL;
+    } else if (arg == "--maintenance-sec") {
+      maintenance_sec = atoi(value);
+    } else if (arg == "--compact-kbps") {
+      compact_bytes_per_sec = strtoull(value, nullptr, 10) * 1024ULL;
+    } else if (arg == "--stale-sec") {
+      stale_after_sec = atoll(value);
+    } else if (arg == "--allowed-lateness-sec") {
+      allowed_lateness_sec = atoll(value);
+    } else if (arg == "--correction-horizon-sec") {
+      correction_horizon_sec = atoll(value);
+    } else if (arg == "--alert-rules") {
+      alert_rules = value;
+    } else if (arg == "--alert-log") {
+      alert_log = value;
+    } else if (arg == "--alert-webhook") {
+      alert_webhook = value;
+    } else if (arg == "--coap-port") {
+      coap_port = atoi(value);
+    } else if (arg == "--upstream") {
+      upstream_url = value;
+    } else if (arg == "--upstream-window-sec") {
+      upstream_window_sec = atoi(value);
+    } else if (arg == "--spool-max-mb") {
+      spool_max_bytes = strtoull(value, nullptr, 10) * 1024ULL * 1024ULL;
+    } else if (arg == "--max-inflight") {
+      max_inflight = std::max(1, atoi(value));
+    } else if (arg == "--busy-retry-sec") {
+      busy_retry_sec = std::max(1, atoi(value));
+    } else if (arg == "--batch-max") {
+      batch_max = std::max(1, atoi(value));
+    } else {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  PartitionStore store(data_dir, policies);
+  if (!store.open()) {
+    fprintf(stderr, "Error: cannot open data directory %s\n", data_dir.c_str());
+    return 1;
+  }
+  store.expire((int64_t)time(nullptr)); // Drop anything that aged out while we were down
+  AlertEngine alerts; // Always running: devices may post their own alerts without any rules here
+  if (!alert_rules.empty() && !alerts.loadRules(alert_rules)) return 1;
+  if (alert_log.empty() && alert_webhook.empty()) alert_log = data_dir + "/alerts.log";
+  alerts.start(alert_log, alert_webhook);
+  store.startMaintenance(maintenance_sec);
+  Compactor compactor(store, compact_bytes_per_sec);
+  compactor.start();
+
+  LiveFanout fanout;
+  // Closed and corrected windows land in the hourly store, but only for hours the
+  // device did not report itself (see WindowAggregator::markReported).
+  WindowAggregator windows(allowed_lateness_sec, correction_horizon_sec,
+                           [&store, &fanout](const AgroRecord& hourly, uint32_t) {
+                             if (store.append(hourly)) fanout.publish(hourly);
+                           });
+  restoreOpenWindows(store, windows, (int64_t)time(nullptr), allowed_lateness_sec);
+  windows.start();
+
+  signal(SIGPIPE, SIG_IGN); // A TLS upstream closing mid-write must not kill the sink
+  Upstream upstream;
+  if (!upstream_url.empty() && !upstream.start(upstream_url, data_dir, upstream_window_sec, spool_max_bytes)) return 1;
+
+  SinkContext ctx{store, compactor, g_last_values, fanout, windows, alerts, upstream,
+                  stale_after_sec, max_inflight, busy_retry_sec, batch_max};
+  // Records from the CoAP uplink take the same path as POST /; the payload always
+  // carries device and epoch, so there is no peer to fall back on. Upstream gets
+  // the report's coverage and percentiles too.
+  CoapGateway gateway([&ctx](UplinkRecord& u) {
+    std::string json;
+    if (ctx.upstream.enabled()) appendUplinkJson(json, u);
+    ingestRecord(ctx, u.rec, "", (int64_t)time(nullptr), json);
+  });
+  ctx.gateway = &gateway;
+  if (coap_port > 0 && !gateway.start((uint16_t)coap_port)) return 1;
+  HttpServer server;
+  server.setBusyRetrySec(busy_retry_sec);
+  ctx.server = &server;
+  server.route("POST", "/", [&ctx](const HttpRequest& req, HttpResponse& res) { handleIngest(ctx, req, res); });
+  server.route("POST", "/ingest", [&ctx](const HttpRequest& req, HttpResponse& res) { handleIngest(ctx, req, res); });
+  server.route("GET", "/query", [&ctx](const HttpRequest& req, HttpResponse& res) { handleQuery(ctx, req, res); });
+  server.route("GET", "/stats", [&ctx](const HttpRequest& req, HttpResponse& res) { handleStats(ctx, req, res); });
+  server.route("GET", "/status", [&ctx](const HttpRequest& req, HttpResponse& res) { handleStatus(ctx, req, res); });
+  server.route("GET", "/live", [&fanout](const HttpRequest& req, HttpResponse& res) { fanout.accept(req, res); });
+  if (!server.listen((uint16_t)port)) return 1;
+
+  g_server = &server;
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+  printf("AgroPRO sink listening on port %d, data in %s\n", port, data_dir.c_str());
+  if (coap_port > 0) printf("CoAP gateway on UDP port %d\n", coap_port);
+  if (upstream.enabled()) {
+    printf("Forwarding to %s every %d s\n", upstream_url.c_str(), upstream_window_sec > 0 ? upstream_window_sec : 1);
+  }
+  fflush(stdout);
+
+  server.serve();
+
+  printf("Shutting down, flushing write buffers...\n");
+  gateway.stop();
+  upstream.stop(); // Unsent entries stay in the spool for the next start
+  fanout.closeAll();
+  windows.stop();
+  alerts.stop();
+  compactor.stop();
+  store.stopMaintenance();
+  store.flush(true);
+  return 0;
+}
@@ -0,0 +1,522 @@
+// AgroPRO Sink – per-device alert rules evaluated on the ingest path
+// ────────────────────────────────────────────────────────────────
+// • Threshold (above/below), rate of change (rise/fall per hour) and
+//   missing-report rules, loaded from a plain-text rules file
+// • Rules are compiled once into a read-only table per device (device rules
+//   plus "*" rules), indexed by channel: a record only touches its own rules
+// • Alerts fire and resolve on transitions, with optional hysteresis, so a
+//   hovering value does not flap
+// • Delivery (JSON lines to a file and/or a local HTTP webhook) runs on its own
+//   thread behind a bounded queue; ingest never waits on it
+// ────────────────────────────────────────────────────────────────
+//
+// Rules file, one rule per line ('#' starts a comment):
+//   <device|*>  <channel|*>  <above|below|rise|fall|missing>  <value>  [hysteresis]
+//   *           sensor1      above    70     2     # compost overheating, clears below 68
+//   *           dhthumidity  below    40
+//   agro-1a2b3c dhttemp      rise     5            # more than 5 °C per hour
+//   *           *            missing  7200         # no report for two hours
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "HttpServer.h"
+#include "SinkRecord.h"
+
+const int    ALERT_SHARDS              = 16;
+const size_t ALERT_QUEUE_MAX           = 1024; // Pending deliveries; further alerts are dropped and counted
+const int    ALERT_TICK_SEC            = 30;   // Missing-report check cadence
+const int    ALERT_WEBHOOK_TIMEOUT_SEC = 5;
+
+enum AlertKind : uint8_t {
+  ALERT_ABOVE   = 0,
+  ALERT_BELOW   = 1,
+  ALERT_RISE    = 2, // Units per hour, between consecutive records of one resolution
+  ALERT_FALL    = 3,
+  ALERT_MISSING = 4, // Seconds without any record from the device
+};
+
+const char* const ALERT_KIND_NAMES[] = {"above", "below", "rise", "fall", "missing"};
+
+struct Alert {
+  std::string device;
+  std::string rule;   // Source text, e.g. "sensor1 above 70"
+  int         channel = -1;
+  bool        firing  = true;
+  float       value   = NAN;
+  int64_t     epoch   = 0;
+};
+
+/**
+ * @brief Parses an alert raised on the device itself (Agro.cpp posts these between
+ * hourly reports, in the same shape as alertJson()). A payload without a "rule"
+ * key is not an alert.
+ */
+inline bool parseDeviceAlert(const std::string& body, Alert& out) {
+  using namespace agro_json;
+  const char* p = body.data();
+  const char* end = p + body.size();
+  skipSpace(p, end);
+  if (p >= end || *p != '{') return false;
+  p++;
+  for (;;) {
+    skipSpace(p, end);
+    if (p < end && *p == '}') break;
+    std::string key, text;
+    float number = NAN;
+    if (!parseString(p, end, key)) return false;
+    skipSpace(p, end);
+    if (p >= end || *p != ':') return false;
+    p++;
+    if (!parseScalar(p, end, number, &text)) return false;
+    if (key == "rule") {
+      out.rule = text;
+    } else if (key == "device") {
+      out.device = text;
+    } else if (key == "channel") {
+      out.channel = channelIndex(text.data(), text.size());
+    } else if (key == "state") {
+      out.firing = text != "resolved";
+    } else if (key == "value") {
+      out.value = number;
+    } else if (key == "epoch") {
+      out.epoch = strtoll(text.c_str(), nullptr, 10);
+    }
+    skipSpace(p, end);
+    if (p < end && *p == ',') { p++; continue; }
+    if (p < end && *p == '}') break;
+    return false;
+  }
+  return !out.rule.empty();
+}
+
+class AlertEngine {
+ public:
+  struct Stats {
+    size_t   rules       = 0;
+    uint64_t evaluations = 0; // Rule checks performed on ingest
+    uint64_t fired       = 0;
+    uint64_t resolved    = 0;
+    uint64_t delivered   = 0;
+    uint64_t failed      = 0;
+    uint64_t dropped     = 0;
+    uint64_t from_device = 0; // Alerts raised by the firmware and relayed here
+  };
+
+  AlertEngine() = default;
+  AlertEngine(const AlertEngine&) = delete;
+  AlertEngine& operator=(const AlertEngine&) = delete;
+
+  ~AlertEngine() { stop(); }
+
+  /**
+   * @brief Parses and compiles the rules file. Call before start(); the tables are
+   * read-only afterwards, so evaluate() needs no lock to find them.
+   * @return false (with a message naming the line) on a malformed rule.
+   */
+  bool loadRules(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+      perror(path.c_str());
+      return false;
+    }
+    std::vector<std::pair<std::string, Rule>> parsed;
+    char line[512];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+      line_no++;
+      char* hash = strchr(line, '#');
+      if (hash) *hash = '\0';
+      char device[128], channel[32], kind[16];
+      float value = 0, hysteresis = 0;
+      int fields = sscanf(line, "%127s %31s %15s %f %f", device, channel, kind, &value, &hysteresis);
+      if (fields <= 0) continue; // Blank or comment-only line
+      Rule rule;
+      ok = fields >= 4 && compileRule(channel, kind, value, fields == 5 ? hysteresis : 0, rule);
+      if (!ok) {
+        fprintf(stderr, "Error: %s:%d: expected <device|*> <channel|*> <kind> <value> [hysteresis]\n",
+                path.c_str(), line_no);
+        break;
+      }
+      parsed.push_back({device, rule});
+    }
+    fclose(f);
+    if (!ok) return false;
+
+    // "*" rules go into every table; a named device gets its own rules on top.
+    for (auto& p : parsed) {
+      if (p.first == "*") addToTable(wildcard_, p.second);
+    }
+    for (auto& p : parsed) {
+      if (p.first == "*") continue;
+      auto it = tables_.find(p.first);
+      if (it == tables_.end()) it = tables_.emplace(p.first, wildcard_).first;
+      addToTable(it->second, p.second);
+    }
+    rule_count_ = parsed.size();
+
+    // Named devices with a missing-report rule are watched from start-up, even if
+    // they never report at all.
+    int64_t now = (int64_t)time(nullptr);
+    for (auto& t : tables_) {
+      if (t.second.missing.empty()) continue;
+      Shard& shard = shardFor(t.first);
+      std::lock_guard<std::mutex> lock(shard.mu);
+      stateFor(shard, t.first, t.second).last_seen = now;
+    }
+    return true;
+  }
+
+  bool empty() const { return rule_count_ == 0; }
+
+  /**
+   * @param log_path    Append one JSON line per alert here (empty: off).
+   * @param webhook_url POST each alert as JSON here (empty: off).
+   */
+  void start(const std::string& log_path, const std::string& webhook_url) {
+    log_path_ = log_path;
+    webhook_url_ = webhook_url;
+    stopping_ = false;
+    delivery_thread_ = std::thread([this]() { deliveryLoop(); });
+    tick_thread_ = std::thread([this]() {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(queue_mu_);
+          queue_cv_.wait_for(lock, std::chrono::seconds(ALERT_TICK_SEC), [this]() { return stopping_.load(); });
+          if (stopping_) return;
+        }
+        checkMissing((int64_t)time(nullptr));
+      }
+    });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(queue_mu_);
+      stopping_ = true;
+    }
+    queue_cv_.notify_all();
+    if (tick_thread_.joinable()) tick_thread_.join();
+    if (delivery_thread_.joinable()) delivery_thread_.join();
+  }
+
+  /**
+   * @brief Evaluates the device's rules against one ingested record. Cost is the
+   * number of rules on the record's channels for that device, not the total.
+   */
+  void evaluate(const AgroRecord& rec, int64_t now) {
+    const RuleTable& table = tableFor(rec.device);
+    if (table.empty()) return;
+
+    // Reused per ingest thread: evaluate() runs on every record
+    static thread_local std::vector<Alert> out;
+    out.clear();
+    uint64_t checks = 0;
+    {
+      Shard& shard = shardFor(rec.device);
+      std::lock_guard<std::mutex> lock(shard.mu);
+      DeviceState& st = stateFor(shard, rec.device, table);
+      st.last_seen = now;
+      for (const Rule& rule : table.missing) {
+        if (st.firing[rule.slot]) transition(st, rule, rec.device, false, NAN, rec.epoch, out);
+      }
+
+      int r = (int)rec.res;
+      if (rec.epoch >= st.last_epoch[r]) { // Late records would raise alerts about the past
+        for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+          float v = rec.values[ch];
+          if (std::isnan(v) || v == 85.0f || v == -127.0f) continue; // Missing or DS18B20 sentinel
+          float prev = st.last_value[r][ch];
+          for (const Rule& rule : table.by_channel[ch]) {
+            checks++;
+            bool firing = st.firing[rule.slot];
+            float x = v;
+            if (rule.kind == ALERT_RISE || rule.kind == ALERT_FALL) {
+              if (std::isnan(prev)) continue; // last_value_epoch is only set along with prev
+              // The channel may have been missing in the device's previous record
+              int64_t dt = rec.epoch - st.last_value_epoch[r][ch];
+              if (dt <= 0) continue;
+              x = (v - prev) * 3600.0f / (float)dt;
+              if (rule.kind == ALERT_FALL) x = -x;
+            }
+            bool high = rule.kind != ALERT_BELOW;
+            bool now_firing = firing ? (high ? x > rule.clear_at : x < rule.clear_at)
+                                     : (high ? x > rule.value : x < rule.value);
+            if (now_firing != firing) transition(st, rule, rec.device, now_firing, v, rec.epoch, out);
+          }
+          st.last_value[r][ch] = v;
+          st.last_value_epoch[r][ch] = rec.epoch;
+        }
+        st.last_epoch[r] = rec.epoch;
+      }
+    }
+    evaluations_.fetch_add(checks, std::memory_order_relaxed);
+    if (!out.empty()) enqueue(out);
+  }
+
+  /**
+   * @brief Relays an alert the device raised itself through the same delivery queue.
+   */
+  void report(const Alert& alert) {
+    std::vector<Alert> out{alert};
+    {
+      std::lock_guard<std::mutex> lock(queue_mu_);
+      from_device_++;
+    }
+    enqueue(out);
+  }
+
+  /**
+   * @brief Fires/resolves missing-report rules. Run periodically by the tick thread.
+   */
+  void checkMissing(int64_t now) {
+    std::vector<Alert> out;
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mu);
+      for (auto& d : shard.devices) {
+        DeviceState& st = d.second;
+        for (const Rule& rule : st.table->missing) {
+          bool now_firing = now - st.last_seen > (int64_t)rule.value;
+          if (now_firing && !st.firing[rule.slot]) transition(st, rule, d.first, true, NAN, st.last_seen, out);
+        }
+      }
+    }
+    if (!out.empty()) enqueue(out);
+  }
+
+  Stats stats() {
+    Stats s;
+    s.rules       = rule_count_;
+    s.evaluations = evaluations_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(queue_mu_);
+    s.fired       = fired_;
+    s.resolved    = resolved_;
+    s.delivered   = delivered_;
+    s.failed      = failed_;
+    s.dropped     = dropped_;
+    s.from_device = from_device_;
+    return s;
+  }
+
+  /**
+   * @brief One alert as a JSON object (file line and webhook body).
+   */
+  static std::string alertJson(const Alert& a) {
+    std::string out = "{\"device\":";
+    appendJsonString(out, a.device);
+    out += ",\"rule\":";
+    appendJsonString(out, a.rule);
+    out += ",\"channel\":";
+    if (a.channel >= 0) {
+      appendJsonString(out, CHANNEL_KEYS[a.channel]);
+    } else {
+      out += "null";
+    }
+    out += std::string(",\"state\":\"") + (a.firing ? "firing" : "resolved") + "\",\"value\":";
+    appendJsonNumber(out, a.value);
+    out += ",\"epoch\":" + std::to_string(a.epoch) + "}";
+    return out;
+  }
+
+ private:
+  struct Rule {
+    uint8_t     kind     = ALERT_ABOVE;
+    int8_t      channel  = -1; // -1: every channel ("*"), expanded when added to a table
+    float       value    = 0;
+    float       clear_at = 0;  // Value at which a firing rule resolves (value ∓ hysteresis)
+    uint32_t    slot     = 0;  // Index into DeviceState::firing
+    std::string text;
+  };
+
+  struct RuleTable {
+    std::vector<Rule> by_channel[NUM_CHANNELS];
+    std::vector<Rule> missing;
+    uint32_t          slots = 0;
+
+    bool empty() const { return slots == 0; }
+  };
+
+  struct DeviceState {
+    const RuleTable*     table = nullptr;
+    std::vector<uint8_t> firing;
+    int64_t              last_seen = 0;
+    int64_t              last_epoch[NUM_RESOLUTIONS];
+    float                last_value[NUM_RESOLUTIONS][NUM_CHANNELS];
+    int64_t              last_value_epoch[NUM_RESOLUTIONS][NUM_CHANNELS]; // Epoch of last_value
+  };
+
+  struct Shard {
+    std::mutex                                   mu;
+    std::unordered_map<std::string, DeviceState> devices;
+  };
+
+  static bool compileRule(const char* channel, const char* kind, float value, float hysteresis, Rule& out) {
+    int k = -1;
+    for (int i = 0; i < 5; i++) {
+      if (strcmp(kind, ALERT_KIND_NAMES[i]) == 0) k = i;
+    }
+    if (k < 0 || hysteresis < 0) return false;
+    out.kind = (uint8_t)k;
+    if (strcmp(channel, "*") == 0) {
+      out.channel = -1;
+    } else {
+      int ch = channelIndex(channel, strlen(channel));
+      if (ch < 0) return false;
+      out.channel = (int8_t)ch;
+    }
+    if (k == ALERT_MISSING && (out.channel != -1 || value <= 0)) return false; // Device-level only
+    out.value = value;
+    out.clear_at = k == ALERT_BELOW ? value + hysteresis : value - hysteresis;
+    char text[96];
+    snprintf(text, sizeof(text), "%s %s %g", channel, kind, value);
+    out.text = text;
+    return true;
+  }
+
+  static void addToTable(RuleTable& table, Rule rule) {
+    if (rule.kind == ALERT_MISSING) {
+      rule.slot = table.slots++;
+      table.missing.push_back(rule);
+      return;
+    }
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      if (rule.channel != -1 && rule.channel != ch) continue;
+      Rule r = rule;
+      r.channel = (int8_t)ch;
+      r.slot = table.slots++;
+      table.by_channel[ch].push_back(r);
+    }
+  }
+
+  const RuleTable& tableFor(const std::string& device) const {
+    auto it = tables_.find(device);
+    return it == tables_.end() ? wildcard_ : it->second;
+  }
+
+  Shard& shardFor(const std::string& device) {
+    return shards_[std::hash<std::string>()(device) % ALERT_SHARDS];
+  }
+
+  static DeviceState& stateFor(Shard& shard, const std::string& device, const RuleTable& table) {
+    DeviceState& st = shard.devices[device];
+    if (!st.table) {
+      st.table = &table;
+      st.firing.assign(table.slots, 0);
+      for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+        st.last_epoch[r] = INT64_MIN;
+        for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+          st.last_value[r][ch] = NAN;
+          st.last_value_epoch[r][ch] = INT64_MIN;
+        }
+      }
+    }
+    return st;
+  }
+
+  static void transition(DeviceState& st, const Rule& rule, const std::string& device, bool firing, float value,
+                         int64_t epoch, std::vector<Alert>& out) {
+    st.firing[rule.slot] = firing ? 1 : 0;
+    Alert a;
+    a.device  = device;
+    a.rule    = rule.text;
+    a.channel = rule.kind == ALERT_MISSING ? -1 : rule.channel;
+    a.firing  = firing;
+    a.value   = value;
+    a.epoch   = epoch;
+    out.push_back(a);
+  }
+
+  void enqueue(std::vector<Alert>& alerts) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mu_);
+      for (Alert& a : alerts) {
+        if (a.firing) {
+          fired_++;
+        } else {
+          resolved_++;
+        }
+        if (queue_.size() >= ALERT_QUEUE_MAX) {
+          dropped_++;
+          continue;
+        }
+        queue_.push_back(std::move(a));
+      }
+    }
+    queue_cv_.notify_all();
+  }
+
+  void deliveryLoop() {
+    FILE* log = nullptr;
+    if (!log_path_.empty()) {
+      log = fopen(log_path_.c_str(), "a");
+      if (!log) perror(log_path_.c_str());
+    }
+    for (;;) {
+      Alert a;
+      {
+        std::unique_lock<std::mutex> lock(queue_mu_);
+        queue_cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) break; // Stopping, and everything queued was delivered
+        a = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      std::string json = alertJson(a);
+      printf("Alert: %s %s %s\n", a.device.c_str(), a.rule.c_str(), a.firing ? "firing" : "resolved");
+      bool ok = true;
+      if (!log_path_.empty()) {
+        ok &= log && fprintf(log, "%s\n", json.c_str()) > 0 && fflush(log) == 0;
+      }
+      if (!webhook_url_.empty()) {
+        int status = httpPost(webhook_url_, json, ALERT_WEBHOOK_TIMEOUT_SEC);
+        ok &= status >= 200 && status < 300;
+      }
+      std::lock_guard<std::mutex> lock(queue_mu_);
+      if (ok) {
+        delivered_++;
+      } else {
+        failed_++;
+      }
+    }
+    if (log) fclose(log);
+  }
+
+  // Compiled once by loadRules(), read-only afterwards
+  RuleTable                                  wildcard_;
+  std::unordered_map<std::string, RuleTable> tables_;
+  size_t                                     rule_count_ = 0;
+
+  Shard                 shards_[ALERT_SHARDS];
+  std::atomic<uint64_t> evaluations_{0};
+
+  std::string             log_path_;
+  std::string             webhook_url_;
+  std::mutex              queue_mu_;
+  std::condition_variable queue_cv_;
+  std::deque<Alert>       queue_;
+  uint64_t                fired_       = 0;
+  uint64_t                resolved_    = 0;
+  uint64_t                delivered_   = 0;
+  uint64_t                failed_      = 0;
+  uint64_t                dropped_     = 0;
+  uint64_t                from_device_ = 0;
+  std::atomic<bool>       stopping_{false};
+  std::thread             delivery_thread_;
+  std::thread             tick_thread_;
+};
@@ -0,0 +1,322 @@
+// AgroPRO Sink – CoAP gateway for the firmware's binary UDP uplink
+// ────────────────────────────────────────────────────────────────
+// • Nodes send each sample / hourly report as a confirmable CoAP POST to /a
+//   (RFC 7252) with a fixed binary payload; see COAP_UPLINK_* in AgroPRO.cpp
+// • Every request is ACKed at once (piggybacked 2.04). Retransmissions are
+//   recognised by (peer, message id) for EXCHANGE_LIFETIME, ACKed again and
+//   not ingested twice
+// • Decoded records go to the local ingest path, and with --upstream into the
+//   spool like any POSTed record (see Upstream.h)
+// ────────────────────────────────────────────────────────────────
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "SinkRecord.h"
+
+const uint16_t COAP_DEFAULT_PORT         = 5683;
+const int      COAP_EXCHANGE_LIFETIME_SEC = 247;   // RFC 7252 default: how long a message id stays taken
+const int      COAP_PRUNE_EVERY_SEC      = 60;
+
+// Binary payload: kind, chip id (4), epoch (4), 6 x int16 hundredths, all big-endian;
+// reports add 6 x coverage (0..200) and p5 / p50 / p95 as 3 x 6 x int16.
+const uint8_t UPLINK_SAMPLE       = 1;
+const uint8_t UPLINK_REPORT       = 2;
+const size_t  UPLINK_SAMPLE_BYTES = 21;
+const size_t  UPLINK_REPORT_BYTES = 63;
+const int     UPLINK_QUANTILES    = 3;
+const char* const UPLINK_QUANTILE_KEYS[UPLINK_QUANTILES] = {"p5", "p50", "p95"};
+
+// CoAP codes, as class << 5 | detail
+const uint8_t COAP_POST                = 0x02;
+const uint8_t COAP_CHANGED             = 0x44; // 2.04
+const uint8_t COAP_BAD_REQUEST         = 0x80; // 4.00
+const uint8_t COAP_NOT_FOUND           = 0x84; // 4.04
+const uint8_t COAP_METHOD_NOT_ALLOWED  = 0x85; // 4.05
+
+/**
+ * @brief One decoded uplink message. Reports also carry coverage and percentiles,
+ * which go upstream (the local store keeps the means only).
+ */
+struct UplinkRecord {
+  AgroRecord rec;
+  bool       has_summary = false;
+  float      coverage[NUM_CHANNELS];
+  float      quantiles[UPLINK_QUANTILES][NUM_CHANNELS];
+};
+
+inline float uplinkHundredths(const uint8_t* p) {
+  int16_t v = (int16_t)(((uint16_t)p[0] << 8) | p[1]);
+  return v == INT16_MIN ? NAN : v / 100.0f;
+}
+
+/**
+ * @brief Decodes a binary uplink payload.
+ * @return false if the kind or the length is wrong.
+ */
+inline bool decodeUplink(const uint8_t* p, size_t len, UplinkRecord& out) {
+  if (len < 1) return false;
+  uint8_t kind = p[0];
+  if (!(kind == UPLINK_SAMPLE && len == UPLINK_SAMPLE_BYTES) && !(kind == UPLINK_REPORT && len == UPLINK_REPORT_BYTES)) {
+    return false;
+  }
+  uint32_t chip = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | p[4];
+  uint32_t epoch = ((uint32_t)p[5] << 24) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 8) | p[8];
+  char device[16];
+  snprintf(device, sizeof(device), "agro-%06x", chip); // Same id the firmware puts in its JSON
+  out.rec.device = device;
+  out.rec.epoch = epoch;
+  out.rec.res = kind == UPLINK_SAMPLE ? Resolution::RAW : Resolution::HOURLY;
+  const uint8_t* v = p + 9;
+  for (int ch = 0; ch < NUM_CHANNELS; ch++, v += 2) out.rec.values[ch] = uplinkHundredths(v);
+  out.has_summary = kind == UPLINK_REPORT;
+  if (out.has_summary) {
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) out.coverage[ch] = *v++ / 200.0f;
+    for (int q = 0; q < UPLINK_QUANTILES; q++) {
+      for (int ch = 0; ch < NUM_CHANNELS; ch++, v += 2) out.quantiles[q][ch] = uplinkHundredths(v);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Appends `u` as one JSON object in the firmware's payload format.
+ */
+inline void appendUplinkJson(std::string& out, const UplinkRecord& u) {
+  appendRecordJson(out, u.rec);
+  if (u.has_summary) {
+    out.pop_back(); // Reopen the object
+    auto array = [&out](const char* key, const float* values) {
+      out += std::string(",\"") + key + "\":[";
+      for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+        if (ch) out.push_back(',');
+        appendJsonNumber(out, values[ch]);
+      }
+      out.push_back(']');
+    };
+    array("coverage", u.coverage);
+    for (int q = 0; q < UPLINK_QUANTILES; q++) array(UPLINK_QUANTILE_KEYS[q], u.quantiles[q]);
+    out.push_back('}');
+  }
+}
+
+class CoapGateway {
+ public:
+  using RecordHandler = std::function<void(UplinkRecord&)>;
+
+  struct Stats {
+    uint64_t datagrams  = 0;
+    uint64_t records    = 0;
+    uint64_t duplicates = 0; // Retransmissions ACKed again and dropped
+    uint64_t malformed  = 0;
+  };
+
+  /**
+   * @param on_record Called on the receive thread for every new record.
+   */
+  explicit CoapGateway(RecordHandler on_record) : on_record_(std::move(on_record)) {}
+  CoapGateway(const CoapGateway&) = delete;
+  CoapGateway& operator=(const CoapGateway&) = delete;
+
+  ~CoapGateway() { stop(); }
+
+  bool start(uint16_t port) {
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_ < 0) {
+      perror("socket");
+      return false;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd_, (sockaddr*)&addr, sizeof(addr)) != 0) {
+      perror("bind (CoAP)");
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    timeval tv{1, 0}; // Lets the receive loop notice stop()
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    stopping_ = false;
+    receive_thread_ = std::thread([this]() { receiveLoop(); });
+    return true;
+  }
+
+  void stop() {
+    stopping_ = true;
+    if (receive_thread_.joinable()) receive_thread_.join();
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+  }
+
+ private:
+  void receiveLoop() {
+    uint8_t msg[1500];
+    auto last_prune = std::chrono::steady_clock::now();
+    while (!stopping_) {
+      sockaddr_in peer{};
+      socklen_t peer_len = sizeof(peer);
+      ssize_t n = recvfrom(fd_, msg, sizeof(msg), 0, (sockaddr*)&peer, &peer_len);
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_prune >= std::chrono::seconds(COAP_PRUNE_EVERY_SEC)) {
+        pruneExchanges(now);
+        last_prune = now;
+      }
+      if (n <= 0) continue;
+
+      uint8_t reply[4 + 8];
+      size_t reply_len = handleMessage(msg, (size_t)n, peer, now, reply);
+      if (reply_len > 0) sendto(fd_, reply, reply_len, 0, (sockaddr*)&peer, peer_len);
+    }
+  }
+
+  /**
+   * @brief Processes one datagram and builds the reply (ACK, or RST for a ping).
+   * @return The reply length; 0 for no reply.
+   */
+  size_t handleMessage(const uint8_t* msg, size_t len, const sockaddr_in& peer,
+                       std::chrono::steady_clock::time_point now, uint8_t reply[]) {
+    countStat(&Stats::datagrams);
+    if (len < 4 || (msg[0] >> 6) != 1) {
+      countStat(&Stats::malformed);
+      return 0; // Not CoAP version 1: silently ignored, as the RFC asks
+    }
+    uint8_t type = (msg[0] >> 4) & 0x03; // 0 CON, 1 NON, 2 ACK, 3 RST
+    size_t tkl = msg[0] & 0x0F;
+    uint8_t code = msg[1];
+    if (type >= 2 || tkl > 8 || len < 4 + tkl) {
+      countStat(&Stats::malformed);
+      return 0;
+    }
+    bool confirmable = type == 0;
+    auto respond = [&](uint8_t response_code) -> size_t {
+      if (!confirmable) return 0;
+      reply[0] = (uint8_t)(0x60 | tkl); // Version 1, ACK, same token
+      reply[1] = response_code;
+      reply[2] = msg[2];
+      reply[3] = msg[3];
+      memcpy(reply + 4, msg + 4, tkl);
+      return 4 + tkl;
+    };
+    if (code == 0) { // Empty CON is a ping: answer with RST
+      if (!confirmable) return 0;
+      reply[0] = 0x70;
+      reply[1] = 0;
+      reply[2] = msg[2];
+      reply[3] = msg[3];
+      return 4;
+    }
+
+    // Same peer + message id within EXCHANGE_LIFETIME: our ACK was lost, resend it
+    uint64_t key = ((uint64_t)peer.sin_addr.s_addr << 32) | ((uint64_t)peer.sin_port << 16) |
+                   (((uint64_t)msg[2] << 8) | msg[3]);
+    auto seen = exchanges_.find(key);
+    if (seen != exchanges_.end() && seen->second.first > now) {
+      countStat(&Stats::duplicates);
+      return respond(seen->second.second);
+    }
+
+    uint8_t response = COAP_CHANGED;
+    std::string path;
+    size_t payload = 0;
+    if (!parseOptions(msg, len, 4 + tkl, path, payload)) {
+      response = COAP_BAD_REQUEST;
+    } else if (path != "a") {
+      response = COAP_NOT_FOUND;
+    } else if (code != COAP_POST) {
+      response = COAP_METHOD_NOT_ALLOWED;
+    } else {
+      UplinkRecord u;
+      if (decodeUplink(msg + payload, len - payload, u)) {
+        countStat(&Stats::records);
+        on_record_(u);
+      } else {
+        response = COAP_BAD_REQUEST;
+      }
+    }
+    if (response != COAP_CHANGED) countStat(&Stats::malformed);
+    exchanges_[key] = {now + std::chrono::seconds(COAP_EXCHANGE_LIFETIME_SEC), response};
+    return respond(response);
+  }
+
+  /**
+   * @brief Walks the options from `pos`, collecting Uri-Path segments.
+   * @param payload Receives the payload offset (`len` if there is none).
+   */
+  static bool parseOptions(const uint8_t* msg, size_t len, size_t pos, std::string& path, size_t& payload) {
+    int option = 0;
+    auto extended = [&](int& v) -> bool {
+      if (v == 13) {
+        if (pos >= len) return false;
+        v = 13 + msg[pos++];
+      } else if (v == 14) {
+        if (pos + 1 >= len) return false;
+        v = 269 + (((int)msg[pos] << 8) | msg[pos + 1]);
+        pos += 2;
+      } else if (v == 15) {
+        return false;
+      }
+      return true;
+    };
+    while (pos < len && msg[pos] != 0xFF) {
+      int delta = msg[pos] >> 4, olen = msg[pos] & 0x0F;
+      pos++;
+      if (!extended(delta) || !extended(olen) || pos + olen > len) return false;
+      option += delta;
+      if (option == 11) { // Uri-Path
+        if (!path.empty()) path.push_back('/');
+        path.append((const char*)msg + pos, olen);
+      }
+      pos += olen;
+    }
+    payload = pos < len ? pos + 1 : len;
+    return true;
+  }
+
+  void pruneExchanges(std::chrono::steady_clock::time_point now) {
+    for (auto it = exchanges_.begin(); it != exchanges_.end();) {
+      it = it->second.first <= now ? exchanges_.erase(it) : std::next(it);
+    }
+  }
+
+  void countStat(uint64_t Stats::*field) {
+    std::lock_guard<std::mutex> lock(mu_);
+    stats_.*field += 1;
+  }
+
+  RecordHandler on_record_;
+  int           fd_ = -1;
+
+  // Receive thread only
+  std::unordered_map<uint64_t, std::pair<std::chrono::steady_clock::time_point, uint8_t>> exchanges_;
+
+  mutable std::mutex mu_;
+  Stats              stats_;
+  std::atomic<bool>  stopping_{false};
+  std::thread        receive_thread_;
+};
@@ -0,0 +1,183 @@
+// AgroPRO Sink – background compaction and re-compression of segments
+// ────────────────────────────────────────────────────────────────
+// • Merges a device's small or overlapping segments (late/backfilled uploads)
+// • Re-encodes the result with the GORILLA column codec from Segment.h
+// • Rate-limited in bytes/s on a low-priority thread; never holds the store
+//   lock while reading or writing, so ingest latency is unaffected
+// • Swaps the merged segment in with PartitionStore::replaceRun(): scans see
+//   either all the old segments or the new one, never a mix
+// ────────────────────────────────────────────────────────────────
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "PartitionStore.h"
+#include "Segment.h"
+
+const int      COMPACT_INTERVAL_SEC          = 60;
+const uint64_t COMPACT_SMALL_SEGMENT_BYTES   = 4 * 1024; // Below this a segment counts as "small"
+const size_t   COMPACT_MIN_SMALL_SEGMENTS    = 8;        // Merge an open partition once this many pile up
+const uint64_t DEFAULT_COMPACT_BYTES_PER_SEC = 4ULL * 1024 * 1024;
+const int      COMPACT_THREAD_NICE           = 10;
+
+class Compactor {
+ public:
+  struct Stats {
+    uint64_t runs_compacted = 0;
+    uint64_t segments_in    = 0;
+    uint64_t bytes_in       = 0;
+    uint64_t bytes_out      = 0;
+    uint64_t throttled_ms   = 0;
+  };
+
+  /**
+   * @param bytes_per_sec Combined read+write budget; 0 disables throttling.
+   */
+  Compactor(PartitionStore& store, uint64_t bytes_per_sec) : store_(store), bytes_per_sec_(bytes_per_sec) {}
+
+  ~Compactor() { stop(); }
+
+  void start() {
+    stopping_ = false;
+    thread_ = std::thread([this]() {
+      setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), COMPACT_THREAD_NICE);
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(mu_);
+          cv_.wait_for(lock, std::chrono::seconds(COMPACT_INTERVAL_SEC), [this]() { return stopping_.load(); });
+          if (stopping_) return;
+        }
+        size_t runs = runOnce((int64_t)time(nullptr));
+        if (runs) printf("Compaction: %zu run(s) merged\n", runs);
+      }
+    });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  /**
+   * @brief Decides whether a device's segments in one partition are worth merging:
+   * overlapping time ranges, a pile of small segments, or any leftover segments in
+   * a closed partition (including a lone one still in the plain encoding).
+   */
+  static bool needsCompaction(const PartitionStore::SegmentRun& run) {
+    const std::vector<SegmentPtr>& segs = run.segments;
+    if (segs.size() == 1) return run.closed && segs[0]->meta.encoding == SEGMENT_ENC_PLAIN;
+    if (run.closed) return true;
+
+    size_t small = 0;
+    for (const SegmentPtr& seg : segs) {
+      if (seg->meta.bytes < COMPACT_SMALL_SEGMENT_BYTES) small++;
+    }
+    if (small >= COMPACT_MIN_SMALL_SEGMENTS) return true;
+
+    std::vector<std::pair<int64_t, int64_t>> ranges;
+    for (const SegmentPtr& seg : segs) ranges.push_back({seg->meta.min_epoch, seg->meta.max_epoch});
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); i++) {
+      if (ranges[i].first <= ranges[i - 1].second) return true; // Backfill landed inside older data
+    }
+    return false;
+  }
+
+  /**
+   * @brief One compaction pass over every partition.
+   * @return Number of runs merged and swapped in.
+   */
+  size_t runOnce(int64_t now) {
+    window_start_ = std::chrono::steady_clock::now();
+    window_bytes_ = 0;
+    size_t merged = 0;
+    for (const PartitionStore::SegmentRun& run : store_.segmentRuns(now)) {
+      if (stopping_) break;
+      if (needsCompaction(run) && compactRun(run)) merged++;
+    }
+    return merged;
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(stats_mu_);
+    return stats_;
+  }
+
+ private:
+  bool compactRun(const PartitionStore::SegmentRun& run) {
+    std::vector<SegmentRow> rows;
+    uint64_t bytes_in = 0;
+    for (const SegmentPtr& seg : run.segments) {
+      std::string device;
+      if (!readSegment(seg->meta.path, device, rows)) return false; // Expired meanwhile
+      bytes_in += seg->meta.bytes;
+      throttle(seg->meta.bytes);
+    }
+    dedupeRows(rows);
+
+    // Keep the newest input's seq with a higher generation: the merge still loses
+    // to segments sealed after the snapshot, also after a restart.
+    SegmentPtr merged = std::make_shared<SegmentHandle>();
+    merged->seq = run.segments.back()->seq;
+    merged->gen = run.segments.back()->gen + 1;
+    if (!writeSegment(store_.segmentPathFor(run, merged->seq, merged->gen), run.device, rows,
+                      merged->meta, SEGMENT_ENC_GORILLA)) {
+      return false;
+    }
+    throttle(merged->meta.bytes);
+    if (!store_.replaceRun(run, merged)) return false;
+
+    std::lock_guard<std::mutex> lock(stats_mu_);
+    stats_.runs_compacted++;
+    stats_.segments_in += run.segments.size();
+    stats_.bytes_in    += bytes_in;
+    stats_.bytes_out   += merged->meta.bytes;
+    return true;
+  }
+
+  /**
+   * @brief Sleeps as needed to keep this pass at or below bytes_per_sec_.
+   */
+  void throttle(uint64_t bytes) {
+    if (bytes_per_sec_ == 0) return;
+    window_bytes_ += bytes;
+    auto due = window_start_ + std::chrono::microseconds(window_bytes_ * 1000000ULL / bytes_per_sec_);
+    auto now = std::chrono::steady_clock::now();
+    if (due <= now) return;
+
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait_until(lock, due, [this]() { return stopping_.load(); });
+    std::lock_guard<std::mutex> stats_lock(stats_mu_);
+    stats_.throttled_ms += (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count();
+  }
+
+  PartitionStore& store_;
+  uint64_t        bytes_per_sec_;
+
+  std::chrono::steady_clock::time_point window_start_;
+  uint64_t                              window_bytes_ = 0;
+
+  std::thread             thread_;
+  std::mutex              mu_;
+  std::condition_variable cv_;
+  std::atomic<bool>       stopping_{false};
+
+  std::mutex stats_mu_;
+  Stats      stats_;
+};
@@ -0,0 +1,452 @@
+// AgroPRO Sink – minimal HTTP/1.1 server for the ingest and query endpoints
+// One request per connection (Connection: close), one thread per connection.
+// This is all ESP8266HTTPClient needs, and keeps the sink free of dependencies beyond
+// zlib, which inflates request bodies sent with Content-Encoding: deflate or gzip.
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+const size_t HTTP_MAX_HEADER_BYTES = 8 * 1024;
+const size_t HTTP_MAX_BODY_BYTES   = 1024 * 1024;
+const int    HTTP_IO_TIMEOUT_SEC   = 10;  // Matches the firmware's http_client.setTimeout(10000)
+const int    HTTP_MAX_CONNECTIONS  = 256;
+const int    HTTP_BUSY_RETRY_SEC   = 60;  // Retry-After when refusing a connection over the limit
+const char* const HTTP_BATCH_MAX_HEADER = "X-Agro-Batch-Max"; // Records per POST the sink asks for
+
+struct HttpRequest {
+  std::string method;
+  std::string path;
+  std::string query;
+  std::string body;
+  std::string peer;                          // Client IPv4 address
+  size_t wire_bytes = 0;                     // Body size as received, before inflating
+  std::map<std::string, std::string> headers; // Keys lower-cased
+  int fd = -1;
+
+  std::string header(const std::string& name) const {
+    auto it = headers.find(name);
+    return it == headers.end() ? std::string() : it->second;
+  }
+
+  /**
+   * @brief Returns the URL-decoded query parameter `name`, or `fallback` if absent.
+   */
+  std::string param(const std::string& name, const std::string& fallback = "") const {
+    size_t pos = 0;
+    while (pos <= query.size()) {
+      size_t amp = query.find('&', pos);
+      if (amp == std::string::npos) amp = query.size();
+      size_t eq = query.find('=', pos);
+      if (eq != std::string::npos && eq < amp && query.compare(pos, eq - pos, name) == 0 && eq - pos == name.size()) {
+        return urlDecode(query.substr(eq + 1, amp - eq - 1));
+      }
+      pos = amp + 1;
+    }
+    return fallback;
+  }
+
+  static std::string urlDecode(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+      if (s[i] == '+') {
+        out.push_back(' ');
+      } else if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2])) {
+        out.push_back((char)strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+        i += 2;
+      } else {
+        out.push_back(s[i]);
+      }
+    }
+    return out;
+  }
+};
+
+struct HttpResponse {
+  int         status = 200;
+  std::string content_type = "text/plain";
+  std::string body;
+  std::vector<std::pair<std::string, std::string>> headers;
+  bool        detached = false; // Handler took over the socket (e.g. protocol upgrade)
+};
+
+inline const char* httpStatusText(int status) {
+  switch (status) {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default:  return "Unknown";
+  }
+}
+
+/**
+ * @brief Writes all of `data` to `fd`, retrying on short writes.
+ */
+inline bool sendAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+/**
+ * @brief Parts of an http:// or https:// URL.
+ */
+struct HttpUrl {
+  bool        tls = false;
+  std::string host;
+  std::string port;
+  std::string path = "/";
+  std::string hostHeader() const {
+    return (port == (tls ? "443" : "80")) ? host : host + ":" + port;
+  }
+};
+
+/**
+ * @brief Splits "http[s]://host[:port][/path]".
+ * @return false for another scheme or an empty host.
+ */
+inline bool parseHttpUrl(const std::string& url, HttpUrl& out) {
+  size_t start;
+  if (url.compare(0, 8, "https://") == 0) {
+    out.tls = true;
+    start = 8;
+  } else if (url.compare(0, 7, "http://") == 0) {
+    out.tls = false;
+    start = 7;
+  } else {
+    return false;
+  }
+  size_t slash = url.find('/', start);
+  std::string host_port = url.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+  out.path = slash == std::string::npos ? "/" : url.substr(slash);
+  out.host = host_port;
+  out.port = out.tls ? "443" : "80";
+  size_t colon = host_port.rfind(':');
+  if (colon != std::string::npos) {
+    out.host = host_port.substr(0, colon);
+    out.port = host_port.substr(colon + 1);
+  }
+  return !out.host.empty();
+}
+
+/**
+ * @brief Opens a TCP connection to `host`:`port` with send/receive timeouts set.
+ * @return The socket, or -1.
+ */
+inline int httpConnect(const std::string& host, const std::string& port, int timeout_sec) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addrs = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* a = addrs; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) continue;
+    timeval tv{timeout_sec, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+/**
+ * @brief POSTs `body` to a plain http:// URL and returns the status code (0 on failure).
+ * Meant for webhooks and relays on the local network; no TLS, no redirects.
+ */
+inline int httpPost(const std::string& url, const std::string& body, int timeout_sec) {
+  HttpUrl target;
+  if (!parseHttpUrl(url, target) || target.tls) return 0;
+  int fd = httpConnect(target.host, target.port, timeout_sec);
+  if (fd < 0) return 0;
+
+  std::string request = "POST " + target.path + " HTTP/1.1\r\nHost: " + target.hostHeader() +
+                        "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                        "\r\nConnection: close\r\n\r\n" + body;
+  int status = 0;
+  char buf[64];
+  if (sendAll(fd, request.data(), request.size())) {
+    ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (n > 12) {
+      buf[n] = '\0';
+      status = atoi(buf + 9); // "HTTP/1.1 200 ..."
+    }
+  }
+  close(fd);
+  return status;
+}
+
+class HttpServer {
+ public:
+  using Handler = std::function<void(const HttpRequest&, HttpResponse&)>;
+
+  ~HttpServer() {
+    if (listen_fd_ >= 0) close(listen_fd_);
+  }
+
+  void route(const std::string& method, const std::string& path, Handler handler) {
+    routes_[method + " " + path] = handler;
+  }
+
+  bool listen(uint16_t port) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+      perror("socket");
+      return false;
+    }
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd_, 64) != 0) {
+      perror("bind/listen");
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Accepts connections until stop() is called. Blocks the calling thread.
+   */
+  void serve() {
+    while (!stopping_) {
+      sockaddr_in peer{};
+      socklen_t peer_len = sizeof(peer);
+      int fd = accept(listen_fd_, (sockaddr*)&peer, &peer_len);
+      if (fd < 0) {
+        if (stopping_) break;
+        if (errno == EINTR) continue;
+        perror("accept");
+        continue;
+      }
+      if (active_connections_.fetch_add(1) >= HTTP_MAX_CONNECTIONS) {
+        active_connections_--;
+        writeResponse(fd, busyResponse(busy_retry_sec_, 0));
+        close(fd);
+        continue;
+      }
+
+      char ip[INET_ADDRSTRLEN] = "";
+      inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+      std::string peer_ip = ip;
+      std::thread([this, fd, peer_ip]() {
+        handleConnection(fd, peer_ip);
+        active_connections_--;
+      }).detach();
+    }
+  }
+
+  /**
+   * @brief Stops the accept loop. Safe to call from a signal handler.
+   */
+  void stop() {
+    stopping_ = true;
+    if (listen_fd_ >= 0) shutdown(listen_fd_, SHUT_RDWR);
+  }
+
+  static HttpResponse errorResponse(int status, const std::string& message) {
+    HttpResponse res;
+    res.status = status;
+    res.body = message;
+    return res;
+  }
+
+  /**
+   * @brief 503 with Retry-After (and a batch-size hint when `batch_max` > 0). The delay
+   * gets up to 50 % random extra, so clients refused together come back spread out.
+   */
+  static HttpResponse busyResponse(int retry_after_sec, int batch_max) {
+    static thread_local std::minstd_rand rng(std::random_device{}());
+    int retry = retry_after_sec + (int)(rng() % (uint32_t)(retry_after_sec / 2 + 1));
+    HttpResponse res = errorResponse(503, "Error: Sink busy, retry in " + std::to_string(retry) + " s.");
+    res.headers.push_back({"Retry-After", std::to_string(retry)});
+    if (batch_max > 0) res.headers.push_back({HTTP_BATCH_MAX_HEADER, std::to_string(batch_max)});
+    return res;
+  }
+
+  /**
+   * @brief Connections being read or handled right now (the sink's load signal).
+   */
+  int activeConnections() const { return active_connections_.load(); }
+
+  void setBusyRetrySec(int sec) { busy_retry_sec_ = sec > 0 ? sec : 1; }
+
+  static void writeResponse(int fd, const HttpResponse& res) {
+    std::string head = "HTTP/1.1 " + std::to_string(res.status) + " " + httpStatusText(res.status) + "\r\n";
+    head += "Content-Type: " + res.content_type + "\r\n";
+    head += "Content-Length: " + std::to_string(res.body.size()) + "\r\n";
+    for (const auto& h : res.headers) head += h.first + ": " + h.second + "\r\n";
+    head += "Connection: close\r\n\r\n";
+    if (sendAll(fd, head.data(), head.size())) sendAll(fd, res.body.data(), res.body.size());
+  }
+
+ private:
+  void handleConnection(int fd, const std::string& peer) {
+    timeval tv{HTTP_IO_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    HttpRequest req;
+    req.fd = fd;
+    req.peer = peer;
+    HttpResponse res;
+    int status = readRequest(fd, req);
+    if (status != 200) {
+      res = errorResponse(status, status == 415 ? "Error: Unsupported Content-Encoding." : "Error: Malformed request.");
+    } else {
+      auto it = routes_.find(req.method + " " + req.path);
+      if (it == routes_.end()) {
+        res = errorResponse(404, "Error: No such endpoint.");
+      } else {
+        it->second(req, res);
+      }
+    }
+    if (!res.detached) {
+      writeResponse(fd, res);
+      close(fd);
+    }
+  }
+
+  /**
+   * @brief Reads the request line, headers and Content-Length body.
+   * @return 200 on success, otherwise the HTTP status to answer with.
+   */
+  static int readRequest(int fd, HttpRequest& req) {
+    std::string data;
+    size_t header_end = std::string::npos;
+    char buf[2048];
+    while (header_end == std::string::npos) {
+      if (data.size() > HTTP_MAX_HEADER_BYTES) return 413;
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0) return 400;
+      data.append(buf, (size_t)n);
+      header_end = data.find("\r\n\r\n");
+    }
+
+    size_t line_end = data.find("\r\n");
+    std::string line = data.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) return 400;
+    req.method = line.substr(0, sp1);
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t qmark = target.find('?');
+    req.path = target.substr(0, qmark);
+    if (qmark != std::string::npos) req.query = target.substr(qmark + 1);
+
+    size_t pos = line_end + 2;
+    while (pos < header_end) {
+      size_t eol = data.find("\r\n", pos);
+      std::string h = data.substr(pos, eol - pos);
+      size_t colon = h.find(':');
+      if (colon != std::string::npos) {
+        std::string key = h.substr(0, colon);
+        for (char& c : key) c = (char)tolower((unsigned char)c);
+        size_t v = h.find_first_not_of(' ', colon + 1);
+        req.headers[key] = v == std::string::npos ? std::string() : h.substr(v);
+      }
+      pos = eol + 2;
+    }
+
+    size_t content_length = (size_t)strtoul(req.header("content-length").c_str(), nullptr, 10);
+    if (content_length > HTTP_MAX_BODY_BYTES) return 413;
+    req.body = data.substr(header_end + 4);
+    while (req.body.size() < content_length) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0) return 400;
+      req.body.append(buf, (size_t)n);
+    }
+    req.body.resize(content_length);
+    req.wire_bytes = content_length;
+    return decodeBody(req);
+  }
+
+  /**
+   * @brief Undoes Content-Encoding: deflate (zlib or, as some clients send it, raw) and gzip.
+   * @return 200, 413 if the inflated body exceeds HTTP_MAX_BODY_BYTES, 400 if it is corrupt,
+   * or 415 for other encodings.
+   */
+  static int decodeBody(HttpRequest& req) {
+    std::string encoding = req.header("content-encoding");
+    for (char& c : encoding) c = (char)tolower((unsigned char)c);
+    if (encoding.empty() || encoding == "identity") return 200;
+    if (encoding != "deflate" && encoding != "gzip") return 415;
+
+    // 15 + 32: zlib or gzip header, detected; -15: raw deflate stream
+    for (int window_bits : {15 + 32, -15}) {
+      z_stream zs{};
+      if (inflateInit2(&zs, window_bits) != Z_OK) return 500;
+      zs.next_in = (Bytef*)req.body.data();
+      zs.avail_in = (uInt)req.body.size();
+      std::string out;
+      char buf[16384];
+      int rc = Z_OK;
+      while (rc == Z_OK) {
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - zs.avail_out);
+        if (out.size() > HTTP_MAX_BODY_BYTES) {
+          inflateEnd(&zs);
+          return 413;
+        }
+        if (rc == Z_BUF_ERROR && zs.avail_in == 0) break; // Truncated
+      }
+      inflateEnd(&zs);
+      if (rc == Z_STREAM_END) {
+        req.body.swap(out);
+        return 200;
+      }
+      if (encoding == "gzip") break;
+    }
+    return 400;
+  }
+
+  int                            listen_fd_ = -1;
+  std::atomic<bool>              stopping_{false};
+  std::atomic<int>               active_connections_{0};
+  int                            busy_retry_sec_ = HTTP_BUSY_RETRY_SEC;
+  std::map<std::string, Handler> routes_;
+};
@@ -0,0 +1,242 @@
+// AgroPRO Sink – last-value cache for live fleet status
+// ────────────────────────────────────────────────────────────────
+// • device/channel → latest value, event time and quality, served in O(1)
+// • Sharded open-addressing table; one 64-byte cache line per device so
+//   concurrent ingests for different devices never share a line
+// • Each channel is a single 64-bit word updated with a CAS loop: no mutex
+//   on the ingest path, and a late (older) record never regresses the view
+// ────────────────────────────────────────────────────────────────
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+#include "SinkRecord.h"
+
+const int      LVC_SHARDS          = 16;
+const int      LVC_SLOTS_PER_SHARD = 1024;            // 16384 devices in total
+const int64_t  LVC_EPOCH_BASE      = 1577836800LL;    // 2020-01-01; 30-bit offsets reach 2054
+const uint64_t LVC_EPOCH_MASK      = (1ULL << 30) - 1;
+
+// Quality codes stored with every value. STALE is never stored: it is derived at
+// read time from the age of a GOOD/SUSPECT value.
+enum LvcQuality : uint8_t {
+  LVC_GOOD    = 0,
+  LVC_SUSPECT = 1, // DS18B20 power-on (85 °C) or disconnected (-127 °C) sentinel
+  LVC_MISSING = 2, // Device reported the channel as NAN
+  LVC_STALE   = 3,
+};
+
+inline const char* lvcQualityName(uint8_t q) {
+  switch (q) {
+    case LVC_GOOD:    return "good";
+    case LVC_SUSPECT: return "suspect";
+    case LVC_MISSING: return "missing";
+    default:          return "stale";
+  }
+}
+
+struct LastValue {
+  float   value   = NAN;
+  int64_t epoch   = 0;
+  uint8_t quality = LVC_MISSING;
+};
+
+class LastValueCache {
+ public:
+  LastValueCache() = default;
+  LastValueCache(const LastValueCache&) = delete;
+  LastValueCache& operator=(const LastValueCache&) = delete;
+
+  ~LastValueCache() {
+    for (Shard& shard : shards_) {
+      for (Entry& e : shard.slots) delete e.key.load(std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief Publishes every channel of `rec`. Called on the ingest path.
+   * @return false only when the table is full or the epoch is outside the packable range.
+   */
+  bool update(const AgroRecord& rec) {
+    if (rec.epoch < LVC_EPOCH_BASE || (uint64_t)(rec.epoch - LVC_EPOCH_BASE) > LVC_EPOCH_MASK) return false;
+    Entry* e = findOrInsert(rec.device);
+    if (!e) return false;
+
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      uint64_t word = pack(rec.values[ch], rec.epoch);
+      uint64_t cur = e->cells[ch].load(std::memory_order_relaxed);
+      // Newest event time wins; equal times replace (corrections of the same window)
+      while ((cur == 0 || epochOf(cur) <= epochOf(word)) &&
+             !e->cells[ch].compare_exchange_weak(cur, word, std::memory_order_release, std::memory_order_relaxed)) {
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief O(1) lookup of one device/channel. Values older than `stale_after_sec`
+   * (relative to `now`) are reported with LVC_STALE quality.
+   */
+  bool get(const std::string& device, int channel, int64_t now, int64_t stale_after_sec, LastValue& out) const {
+    const Entry* e = find(device);
+    if (!e || channel < 0 || channel >= NUM_CHANNELS) return false;
+    uint64_t word = e->cells[channel].load(std::memory_order_acquire);
+    if (word == 0) return false;
+    out = unpack(word, now, stale_after_sec);
+    return true;
+  }
+
+  /**
+   * @brief Visits every device with its channel values (for the fleet status page).
+   * Each channel is read with one atomic load; no lock is taken.
+   */
+  void forEach(int64_t now, int64_t stale_after_sec,
+               const std::function<void(const std::string& device, const LastValue* values)>& fn) const {
+    LastValue values[NUM_CHANNELS];
+    for (const Shard& shard : shards_) {
+      for (const Entry& e : shard.slots) {
+        const std::string* key = e.key.load(std::memory_order_acquire);
+        if (!key) continue;
+        for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+          uint64_t word = e.cells[ch].load(std::memory_order_acquire);
+          values[ch] = word ? unpack(word, now, stale_after_sec) : LastValue();
+        }
+        fn(*key, values);
+      }
+    }
+  }
+
+  size_t size() const { return count_.load(std::memory_order_relaxed); }
+
+ private:
+  struct alignas(64) Entry {
+    std::atomic<const std::string*> key{nullptr}; // Set once by CAS, never cleared
+    std::atomic<uint64_t>           cells[NUM_CHANNELS];
+
+    Entry() {
+      for (auto& c : cells) c.store(0, std::memory_order_relaxed);
+    }
+  };
+  static_assert(sizeof(Entry) == 64, "one device per cache line");
+
+  struct Shard {
+    Entry slots[LVC_SLOTS_PER_SHARD];
+  };
+
+  // Word layout: float bits (32) | epoch offset from LVC_EPOCH_BASE (30) | quality (2).
+  // 0 is reserved for "never written" (an offset of 0 is 2020-01-01 00:00:00).
+  static uint64_t pack(float value, int64_t epoch) {
+    uint8_t quality = LVC_GOOD;
+    if (std::isnan(value)) {
+      quality = LVC_MISSING;
+    } else if (value == 85.0f || value == -127.0f) {
+      quality = LVC_SUSPECT;
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    return ((uint64_t)bits << 32) | (((uint64_t)(epoch - LVC_EPOCH_BASE) & LVC_EPOCH_MASK) << 2) | quality;
+  }
+
+  static int64_t epochOf(uint64_t word) {
+    return LVC_EPOCH_BASE + (int64_t)((word >> 2) & LVC_EPOCH_MASK);
+  }
+
+  static LastValue unpack(uint64_t word, int64_t now, int64_t stale_after_sec) {
+    LastValue v;
+    uint32_t bits = (uint32_t)(word >> 32);
+    memcpy(&v.value, &bits, 4);
+    v.epoch = epochOf(word);
+    v.quality = (uint8_t)(word & 3);
+    if (v.quality != LVC_MISSING && now - v.epoch > stale_after_sec) v.quality = LVC_STALE;
+    return v;
+  }
+
+  const Entry* find(const std::string& device) const {
+    size_t h = std::hash<std::string>()(device);
+    const Shard& shard = shards_[h % LVC_SHARDS];
+    size_t slot = (h / LVC_SHARDS) % LVC_SLOTS_PER_SHARD;
+    for (int probe = 0; probe < LVC_SLOTS_PER_SHARD; probe++) {
+      const Entry& e = shard.slots[(slot + probe) % LVC_SLOTS_PER_SHARD];
+      const std::string* key = e.key.load(std::memory_order_acquire);
+      if (!key) return nullptr;
+      if (*key == device) return &e;
+    }
+    return nullptr;
+  }
+
+  Entry* findOrInsert(const std::string& device) {
+    size_t h = std::hash<std::string>()(device);
+    Shard& shard = shards_[h % LVC_SHARDS];
+    size_t slot = (h / LVC_SHARDS) % LVC_SLOTS_PER_SHARD;
+    std::string* mine = nullptr;
+    for (int probe = 0; probe < LVC_SLOTS_PER_SHARD; probe++) {
+      Entry& e = shard.slots[(slot + probe) % LVC_SLOTS_PER_SHARD];
+      const std::string* key = e.key.load(std::memory_order_acquire);
+      if (!key) {
+        if (!mine) mine = new std::string(device);
+        const std::string* expected = nullptr;
+        if (e.key.compare_exchange_strong(expected, mine, std::memory_order_acq_rel)) {
+          count_.fetch_add(1, std::memory_order_relaxed);
+          return &e;
+        }
+        key = expected; // Lost the race: someone else claimed this slot
+      }
+      if (*key == device) {
+        delete mine;
+        return &e;
+      }
+    }
+    delete mine;
+    return nullptr;
+  }
+
+  Shard               shards_[LVC_SHARDS];
+  std::atomic<size_t> count_{0};
+};
+
+/**
+ * @brief Appends `v` with two decimals, without snprintf (the status page formats
+ * tens of thousands of values per request).
+ */
+inline void appendFixed2(std::string& out, float v) {
+  if (std::isnan(v) || std::isinf(v)) {
+    out.append("null", 4);
+    return;
+  }
+  long long centi = llroundf(v * 100.0f);
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  bool negative = centi < 0;
+  unsigned long long u = negative ? (unsigned long long)(-centi) : (unsigned long long)centi;
+  *--p = (char)('0' + u % 10);
+  *--p = (char)('0' + (u / 10) % 10);
+  *--p = '.';
+  u /= 100;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u > 0);
+  if (negative) *--p = '-';
+  out.append(p, (size_t)(buf + sizeof(buf) - p));
+}
+
+/**
+ * @brief Appends a decimal integer without allocating.
+ */
+inline void appendInt(std::string& out, int64_t v) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? (uint64_t)(-(v + 1)) + 1 : (uint64_t)v;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u > 0);
+  if (v < 0) *--p = '-';
+  out.append(p, (size_t)(buf + sizeof(buf) - p));
+}
@@ -0,0 +1,400 @@
+// AgroPRO Sink – WebSocket live fan-out of ingested records
+// ────────────────────────────────────────────────────────────────
+// • GET /live?device=<id>&channels=sensor1,dhttemp upgrades to a WebSocket
+// • Each record is framed once per distinct channel selection and shared
+//   by every matching client through a reference-counted buffer
+// • Ingest only appends a pointer to each client's queue; a per-client writer
+//   thread does the socket I/O. A client that falls behind has queued updates
+//   for the same device coalesced (latest wins) and is dropped if it still
+//   cannot keep up, so a slow browser never blocks the ingest path
+// ────────────────────────────────────────────────────────────────
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "HttpServer.h"
+#include "SinkRecord.h"
+
+const size_t FANOUT_COALESCE_DEPTH    = 16;  // Start coalescing per device beyond this backlog
+const size_t FANOUT_MAX_QUEUE         = 64;  // Drop the client if coalescing cannot keep it below this
+const int    FANOUT_SEND_TIMEOUT_SEC  = 5;   // A send stuck this long means the client is gone
+const int    FANOUT_MAX_SUBSCRIBERS   = 512;
+const uint8_t FANOUT_ALL_CHANNELS     = (1 << NUM_CHANNELS) - 1;
+
+// =======================================================================================
+//                              WEBSOCKET HANDSHAKE HELPERS
+// =======================================================================================
+
+/**
+ * @brief SHA-1 digest (RFC 3174), only used for Sec-WebSocket-Accept.
+ */
+inline void sha1(const std::string& msg, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  std::string data = msg;
+  uint64_t bit_len = (uint64_t)msg.size() * 8;
+  data.push_back((char)0x80);
+  while (data.size() % 64 != 56) data.push_back(0);
+  for (int i = 7; i >= 0; i--) data.push_back((char)(bit_len >> (i * 8)));
+
+  auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+  for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t* p = (const uint8_t*)data.data() + chunk + i * 4;
+      w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20)      { f = (b & c) | (~b & d);           k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+      else             { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+      uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d; d = c; c = rol(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4]     = (uint8_t)(h[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)h[i];
+  }
+}
+
+inline std::string base64Encode(const uint8_t* data, size_t len) {
+  static const char TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len) v |= data[i + 2];
+    out.push_back(TABLE[(v >> 18) & 63]);
+    out.push_back(TABLE[(v >> 12) & 63]);
+    out.push_back(i + 1 < len ? TABLE[(v >> 6) & 63] : '=');
+    out.push_back(i + 2 < len ? TABLE[v & 63] : '=');
+  }
+  return out;
+}
+
+/**
+ * @brief Builds an unmasked server-to-client frame (RFC 6455 §5.2).
+ */
+inline std::string websocketFrame(uint8_t opcode, const std::string& payload) {
+  std::string frame;
+  frame.push_back((char)(0x80 | opcode));
+  size_t len = payload.size();
+  if (len < 126) {
+    frame.push_back((char)len);
+  } else if (len <= 0xFFFF) {
+    frame.push_back((char)126);
+    frame.push_back((char)(len >> 8));
+    frame.push_back((char)len);
+  } else {
+    frame.push_back((char)127);
+    for (int i = 7; i >= 0; i--) frame.push_back((char)((uint64_t)len >> (i * 8)));
+  }
+  frame += payload;
+  return frame;
+}
+
+// =======================================================================================
+//                                       FAN-OUT
+// =======================================================================================
+
+class LiveFanout {
+ public:
+  using FramePtr = std::shared_ptr<const std::string>;
+
+  struct Stats {
+    size_t   subscribers       = 0;
+    uint64_t messages          = 0;
+    uint64_t frames_serialized = 0;
+    uint64_t frames_queued     = 0;
+    uint64_t frames_coalesced  = 0;
+    uint64_t clients_dropped   = 0;
+  };
+
+  LiveFanout() : subscribers_(std::make_shared<const SubscriberList>()) {}
+
+  ~LiveFanout() { closeAll(); }
+
+  /**
+   * @brief Handles GET /live: validates the upgrade, answers 101 and hands the socket
+   * to a new subscriber. Query: device=<id> (optional), channels=<key,key> (optional).
+   */
+  void accept(const HttpRequest& req, HttpResponse& res) {
+    std::string key = req.header("sec-websocket-key");
+    if (key.empty() || req.header("upgrade").find("ebsocket") == std::string::npos) {
+      res = HttpServer::errorResponse(400, "Error: WebSocket upgrade required.");
+      return;
+    }
+    uint8_t mask = FANOUT_ALL_CHANNELS;
+    std::string channels = req.param("channels");
+    if (!channels.empty()) {
+      mask = 0;
+      size_t pos = 0;
+      while (pos <= channels.size()) {
+        size_t comma = channels.find(',', pos);
+        if (comma == std::string::npos) comma = channels.size();
+        int ch = channelIndex(channels.data() + pos, comma - pos);
+        if (ch >= 0) mask |= (uint8_t)(1 << ch);
+        pos = comma + 1;
+      }
+      if (mask == 0) {
+        res = HttpServer::errorResponse(400, "Error: Unknown channel filter.");
+        return;
+      }
+    }
+    if (stats_subscribers_.load() >= FANOUT_MAX_SUBSCRIBERS) {
+      res = HttpServer::errorResponse(503, "Error: Too many live subscribers.");
+      return;
+    }
+
+    uint8_t digest[20];
+    sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", digest);
+    std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: " + base64Encode(digest, 20) + "\r\n\r\n";
+    if (!sendAll(req.fd, reply.data(), reply.size())) {
+      res = HttpServer::errorResponse(400, "Error: Handshake failed.");
+      return;
+    }
+
+    res.detached = true;
+    timeval no_timeout{0, 0};
+    timeval send_timeout{FANOUT_SEND_TIMEOUT_SEC, 0};
+    setsockopt(req.fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    setsockopt(req.fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    auto sub = std::make_shared<Subscriber>();
+    sub->fd = req.fd;
+    sub->device = req.param("device");
+    sub->channel_mask = mask;
+    addSubscriber(sub);
+    std::thread([this, sub]() { writerLoop(sub); }).detach();
+    std::thread([this, sub]() { readerLoop(sub); }).detach();
+  }
+
+  /**
+   * @brief Called on the ingest path. Serializes `rec` at most once per distinct
+   * channel selection among the matching subscribers and queues shared pointers.
+   */
+  void publish(const AgroRecord& rec) {
+    std::shared_ptr<const SubscriberList> subs = std::atomic_load(&subscribers_);
+    if (subs->empty()) return;
+
+    FramePtr frames[1 << NUM_CHANNELS];
+    for (const SubscriberPtr& sub : *subs) {
+      if (!sub->device.empty() && sub->device != rec.device) continue;
+      FramePtr& frame = frames[sub->channel_mask];
+      if (!frame) {
+        frame = std::make_shared<const std::string>(websocketFrame(0x1, recordJson(rec, sub->channel_mask)));
+        frames_serialized_++;
+      }
+      enqueue(*sub, rec.device, frame);
+    }
+    messages_++;
+  }
+
+  void closeAll() {
+    std::shared_ptr<const SubscriberList> subs = std::atomic_load(&subscribers_);
+    for (const SubscriberPtr& sub : *subs) markClosed(*sub);
+  }
+
+  Stats stats() const {
+    Stats s;
+    s.subscribers       = stats_subscribers_.load();
+    s.messages          = messages_.load();
+    s.frames_serialized = frames_serialized_.load();
+    s.frames_queued     = frames_queued_.load();
+    s.frames_coalesced  = frames_coalesced_.load();
+    s.clients_dropped   = clients_dropped_.load();
+    return s;
+  }
+
+ private:
+  struct Pending {
+    std::string device;
+    FramePtr    frame;
+  };
+
+  struct Subscriber {
+    int                     fd = -1;
+    std::string             device;       // Empty: all devices
+    uint8_t                 channel_mask = FANOUT_ALL_CHANNELS;
+    std::mutex              mu;
+    std::condition_variable cv;
+    std::deque<Pending>     queue;
+    bool                    closed = false;
+    std::atomic<int>        threads_alive{2}; // writerLoop + readerLoop
+  };
+  using SubscriberPtr  = std::shared_ptr<Subscriber>;
+  using SubscriberList = std::vector<SubscriberPtr>;
+
+  static std::string recordJson(const AgroRecord& rec, uint8_t mask) {
+    std::string out = "{\"device\":";
+    appendJsonString(out, rec.device);
+    out += ",\"epoch\":" + std::to_string(rec.epoch);
+    out += std::string(",\"res\":\"") + resolutionName(rec.res) + "\"";
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      if (!(mask & (1 << ch))) continue;
+      out += std::string(",\"") + CHANNEL_KEYS[ch] + "\":";
+      appendJsonNumber(out, rec.values[ch]);
+    }
+    out += "}";
+    return out;
+  }
+
+  /**
+   * @brief Queues `frame` for one client without ever waiting on its socket.
+   */
+  void enqueue(Subscriber& sub, const std::string& device, const FramePtr& frame) {
+    bool drop = false;
+    {
+      std::lock_guard<std::mutex> lock(sub.mu);
+      if (sub.closed) return;
+      if (sub.queue.size() >= FANOUT_COALESCE_DEPTH) {
+        // Behind: replace this device's oldest queued update instead of growing
+        for (Pending& p : sub.queue) {
+          if (p.device == device) {
+            p.frame = frame;
+            frames_coalesced_++;
+            return;
+          }
+        }
+      }
+      if (sub.queue.size() >= FANOUT_MAX_QUEUE) {
+        sub.closed = true;
+        drop = true;
+      } else {
+        sub.queue.push_back({device, frame});
+        frames_queued_++;
+      }
+    }
+    if (drop) clients_dropped_++;
+    sub.cv.notify_one();
+  }
+
+  void writerLoop(SubscriberPtr sub) {
+    for (;;) {
+      Pending next;
+      {
+        std::unique_lock<std::mutex> lock(sub->mu);
+        sub->cv.wait(lock, [&sub]() { return sub->closed || !sub->queue.empty(); });
+        if (sub->closed) break;
+        next = std::move(sub->queue.front());
+        sub->queue.pop_front();
+      }
+      if (!sendAll(sub->fd, next.frame->data(), next.frame->size())) break;
+    }
+    markClosed(*sub);
+    removeSubscriber(sub);
+    std::string close_frame = websocketFrame(0x8, "");
+    send(sub->fd, close_frame.data(), close_frame.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(sub->fd, SHUT_RDWR); // Unblocks readerLoop
+    releaseSocket(*sub);
+  }
+
+  /**
+   * @brief Consumes client frames: answers pings, stops on close or disconnect.
+   * Client payloads are otherwise ignored (subscriptions are fixed at upgrade).
+   */
+  void readerLoop(SubscriberPtr sub) {
+    for (;;) {
+      uint8_t head[2];
+      if (!recvExact(sub->fd, head, 2)) break;
+      uint8_t opcode = head[0] & 0x0F;
+      uint64_t len = head[1] & 0x7F;
+      if (len == 126 || len == 127) {
+        uint8_t ext[8];
+        int n = len == 126 ? 2 : 8;
+        if (!recvExact(sub->fd, ext, n)) break;
+        len = 0;
+        for (int i = 0; i < n; i++) len = (len << 8) | ext[i];
+      }
+      if (len > 4096) break; // Clients have nothing large to tell us
+      uint8_t mask_key[4] = {0, 0, 0, 0};
+      if ((head[1] & 0x80) && !recvExact(sub->fd, mask_key, 4)) break;
+      std::string payload(len, '\0');
+      if (len && !recvExact(sub->fd, (uint8_t*)&payload[0], len)) break;
+      for (size_t i = 0; i < payload.size(); i++) payload[i] ^= (char)mask_key[i % 4];
+
+      if (opcode == 0x8) break;
+      if (opcode == 0x9) enqueue(*sub, std::string(), std::make_shared<const std::string>(websocketFrame(0xA, payload)));
+    }
+    markClosed(*sub); // Wakes writerLoop
+    releaseSocket(*sub);
+  }
+
+  /**
+   * @brief Closes the socket once both the reader and the writer are done with it,
+   * so neither thread can touch a descriptor number that was reused.
+   */
+  static void releaseSocket(Subscriber& sub) {
+    if (sub.threads_alive.fetch_sub(1) == 1) close(sub.fd);
+  }
+
+  static bool recvExact(int fd, uint8_t* buf, size_t len) {
+    while (len > 0) {
+      ssize_t n = recv(fd, buf, len, 0);
+      if (n <= 0) return false;
+      buf += n;
+      len -= (size_t)n;
+    }
+    return true;
+  }
+
+  void markClosed(Subscriber& sub) {
+    {
+      std::lock_guard<std::mutex> lock(sub.mu);
+      sub.closed = true;
+      sub.queue.clear();
+    }
+    sub.cv.notify_all();
+  }
+
+  // Copy-on-write list: publish() reads a snapshot without taking list_mu_.
+  void addSubscriber(const SubscriberPtr& sub) {
+    std::lock_guard<std::mutex> lock(list_mu_);
+    auto next = std::make_shared<SubscriberList>(*std::atomic_load(&subscribers_));
+    next->push_back(sub);
+    std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(next));
+    stats_subscribers_ = next->size();
+  }
+
+  void removeSubscriber(const SubscriberPtr& sub) {
+    std::lock_guard<std::mutex> lock(list_mu_);
+    auto next = std::make_shared<SubscriberList>();
+    for (const SubscriberPtr& s : *std::atomic_load(&subscribers_)) {
+      if (s != sub) next->push_back(s);
+    }
+    std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(next));
+    stats_subscribers_ = next->size();
+  }
+
+  std::mutex                            list_mu_;
+  std::shared_ptr<const SubscriberList> subscribers_;
+
+  std::atomic<size_t>   stats_subscribers_{0};
+  std::atomic<uint64_t> messages_{0};
+  std::atomic<uint64_t> frames_serialized_{0};
+  std::atomic<uint64_t> frames_queued_{0};
+  std::atomic<uint64_t> frames_coalesced_{0};
+  std::atomic<uint64_t> clients_dropped_{0};
+};
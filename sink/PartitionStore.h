@@ -0,0 +1,581 @@
+// AgroPRO Sink – time-partitioned record store with per-resolution retention
+// ────────────────────────────────────────────────────────────────
+// • Records land in partitions (one directory per day or week) per resolution
+// • Expiry drops whole partitions: one rename + one index erase, never row by row
+// • A background thread seals write buffers, expires and purges; Compactor.h merges
+// ────────────────────────────────────────────────────────────────
+// Layout:  <root>/<raw|hourly>/<partition start epoch>/<device>.<seq>.<gen>.seg
+//          <root>/.trash/…   (expired partitions waiting to be unlinked)
+// (device, epoch) is the primary key: on read and on compaction the row from the
+// newest segment wins, so re-posted or corrected records replace older ones.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>
+#include <ftw.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Segment.h"
+#include "SinkRecord.h"
+
+struct RetentionPolicy {
+  int64_t partition_span_sec; // Width of one partition directory
+  int64_t retention_sec;      // Partitions that end before (now - retention) are dropped
+};
+
+// Raw 10-minute samples: daily partitions kept 90 days.
+// Hourly rollups: weekly partitions kept ~5 years.
+const RetentionPolicy DEFAULT_RETENTION[NUM_RESOLUTIONS] = {
+  { 86400LL,     90LL * 86400LL },
+  { 7LL * 86400LL, 5LL * 365LL * 86400LL },
+};
+
+const int64_t PARTITION_ALIGN_SEC      = 4LL * 86400LL; // 1970-01-05 was a Monday: weeks start Monday 00:00 UTC
+const size_t  SEGMENT_FLUSH_ROWS       = 512;           // Seal a write buffer once it holds this many rows
+const int64_t SEGMENT_FLUSH_AGE_SEC    = 60;            // ...or once its oldest row has waited this long
+const int64_t PARTITION_SEAL_GRACE_SEC = 3600;          // Closed partitions are compacted after this grace
+
+/**
+ * @brief Start of the partition containing `epoch` (floor division, safe for negatives).
+ */
+inline int64_t partitionStart(int64_t epoch, int64_t span) {
+  int64_t shifted = epoch - PARTITION_ALIGN_SEC;
+  int64_t q = shifted / span;
+  if (shifted % span < 0) q--;
+  return q * span + PARTITION_ALIGN_SEC;
+}
+
+/**
+ * @brief Monotonic clock in seconds, used for buffer ages (wall time can jump).
+ */
+inline int64_t monotonicSeconds() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Maps a device id to a safe file-name fragment (the real id lives in the header).
+ */
+inline std::string sanitizeDeviceName(const std::string& device) {
+  std::string out;
+  for (char c : device) {
+    bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    out.push_back(ok ? c : '_');
+  }
+  return out.empty() ? std::string("_") : out.substr(0, 64);
+}
+
+/**
+ * @brief Sorts rows by epoch and keeps only the last row written for each epoch.
+ * Input order must be oldest write first; std::stable_sort preserves it among equals.
+ */
+inline void dedupeRows(std::vector<SegmentRow>& rows) {
+  std::stable_sort(rows.begin(), rows.end(),
+                   [](const SegmentRow& a, const SegmentRow& b) { return a.epoch < b.epoch; });
+  size_t out = 0;
+  for (size_t i = 0; i < rows.size(); i++) {
+    if (out > 0 && rows[out - 1].epoch == rows[i].epoch) {
+      rows[out - 1] = rows[i];
+    } else {
+      rows[out++] = rows[i];
+    }
+  }
+  rows.resize(out);
+}
+
+/**
+ * @brief A sealed segment on disk. Readers hold a shared_ptr while they read it;
+ * once compaction replaces it, the file is unlinked when the last reader lets go.
+ */
+struct SegmentHandle {
+  SegmentMeta       meta;
+  uint32_t          seq = 0; // Write order inside the partition
+  uint32_t          gen = 0; // Compaction generation; a merge keeps its newest input's seq
+  std::atomic<bool> obsolete{false};
+
+  ~SegmentHandle() {
+    if (obsolete) unlink(meta.path.c_str());
+  }
+};
+using SegmentPtr = std::shared_ptr<SegmentHandle>;
+
+class PartitionStore {
+ public:
+  using RowCallback = std::function<void(const std::string& device, const SegmentRow& row)>;
+
+  struct DeviceState {
+    std::vector<SegmentPtr> segments;      // Sealed, ordered by (seq, gen) – oldest write first
+    std::vector<SegmentRow> sealing;       // Rows being written by flush()
+    std::vector<SegmentRow> buffer;        // Rows not yet sealed
+    int64_t                 buffer_since = 0;
+  };
+
+  struct Partition {
+    int64_t                            start = 0;
+    std::string                        dir;
+    std::map<std::string, DeviceState> devices;
+    uint32_t                           next_seq = 0;
+    bool                               dropped = false;
+  };
+  using PartitionPtr = std::shared_ptr<Partition>;
+
+  struct SegmentRun {
+    PartitionPtr            part;
+    Resolution              res;
+    bool                    closed;
+    std::string             device;
+    std::vector<SegmentPtr> segments;
+  };
+
+  struct Stats {
+    size_t   partitions[NUM_RESOLUTIONS] = {0, 0};
+    size_t   segments           = 0;
+    uint64_t segment_bytes      = 0;
+    size_t   buffered_rows      = 0;
+    uint64_t rows_appended      = 0;
+    uint64_t rows_rejected      = 0;
+    uint64_t partitions_expired = 0;
+    uint64_t segments_compacted = 0;
+  };
+
+  PartitionStore(const std::string& root, const RetentionPolicy policies[NUM_RESOLUTIONS]) : root_(root) {
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) policies_[r] = policies[r];
+  }
+
+  ~PartitionStore() {
+    stopMaintenance();
+    flush(true);
+  }
+
+  /**
+   * @brief Creates the directory layout and rebuilds the partition index from disk.
+   */
+  bool open() {
+    if (!makeDir(root_) || !makeDir(trashDir())) return false;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+      std::string res_dir = root_ + "/" + resolutionName((Resolution)r);
+      if (!makeDir(res_dir)) return false;
+
+      for (const std::string& name : listDir(res_dir)) {
+        char* end = nullptr;
+        long long start = strtoll(name.c_str(), &end, 10);
+        if (name.empty() || *end != '\0') continue;
+
+        PartitionPtr part = std::make_shared<Partition>();
+        part->start = start;
+        part->dir = res_dir + "/" + name;
+        for (const std::string& file : listDir(part->dir)) {
+          std::string path = part->dir + "/" + file;
+          if (endsWith(file, ".tmp")) { unlink(path.c_str()); continue; } // Interrupted write
+          if (!endsWith(file, ".seg")) continue;
+
+          SegmentPtr seg = std::make_shared<SegmentHandle>();
+          std::string device;
+          if (!readSegmentHeader(path, device, seg->meta)) {
+            fprintf(stderr, "Warning: skipping unreadable segment %s\n", path.c_str());
+            continue;
+          }
+          parseSegmentName(file, seg->seq, seg->gen);
+          part->next_seq = std::max(part->next_seq, seg->seq + 1);
+          part->devices[device].segments.push_back(seg);
+        }
+        for (auto& entry : part->devices) sortBySeq(entry.second.segments);
+        partitions_[r][start] = part;
+      }
+    }
+    return true;
+  }
+
+  void startMaintenance(int interval_sec) {
+    stopping_ = false;
+    maintenance_thread_ = std::thread([this, interval_sec]() { maintenanceLoop(interval_sec); });
+  }
+
+  void stopMaintenance() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mu_);
+      stopping_ = true;
+    }
+    wake_cv_.notify_all();
+    if (maintenance_thread_.joinable()) maintenance_thread_.join();
+  }
+
+  /**
+   * @brief Buffers one record in its partition. Never touches the disk on the hot path
+   * except to create a new partition directory.
+   * @return false if the record is already past its resolution's retention window.
+   */
+  bool append(const AgroRecord& rec) {
+    int r = (int)rec.res;
+    int64_t span = policies_[r].partition_span_sec;
+    int64_t start = partitionStart(rec.epoch, span);
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (start + span <= (int64_t)time(nullptr) - policies_[r].retention_sec) {
+        rows_rejected_++;
+        return false;
+      }
+      PartitionPtr part = partitionFor(r, start);
+      if (!part) {
+        rows_rejected_++;
+        return false;
+      }
+      DeviceState& dev = part->devices[rec.device];
+      if (dev.buffer.empty()) dev.buffer_since = monotonicSeconds();
+
+      SegmentRow row;
+      row.epoch = rec.epoch;
+      memcpy(row.values, rec.values, sizeof(row.values));
+      dev.buffer.push_back(row);
+      rows_appended_++;
+      wake = dev.buffer.size() >= SEGMENT_FLUSH_ROWS;
+    }
+    if (wake) {
+      std::lock_guard<std::mutex> lock(wake_mu_);
+      flush_requested_ = true;
+    }
+    if (wake) wake_cv_.notify_all();
+    return true;
+  }
+
+  /**
+   * @brief Seals write buffers into segments. Rows stay visible to scans while the
+   * segment is written; only the index update happens under the store lock.
+   * @param force Seal every non-empty buffer regardless of size and age.
+   */
+  void flush(bool force) {
+    std::lock_guard<std::mutex> flush_lock(flush_mu_);
+    struct Job {
+      PartitionPtr part;
+      std::string  device;
+      uint32_t     seq;
+    };
+    std::vector<Job> jobs;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      int64_t now = monotonicSeconds();
+      for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+        for (auto& p : partitions_[r]) {
+          for (auto& d : p.second->devices) {
+            DeviceState& dev = d.second;
+            if (dev.buffer.empty()) continue;
+            if (!force && dev.buffer.size() < SEGMENT_FLUSH_ROWS && now - dev.buffer_since < SEGMENT_FLUSH_AGE_SEC) continue;
+            dev.sealing.swap(dev.buffer);
+            dev.buffer.clear();
+            jobs.push_back({p.second, d.first, p.second->next_seq++});
+          }
+        }
+      }
+    }
+
+    for (Job& job : jobs) {
+      std::vector<SegmentRow> rows;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        rows = job.part->devices[job.device].sealing;
+      }
+      dedupeRows(rows);
+
+      SegmentPtr seg = std::make_shared<SegmentHandle>();
+      seg->seq = job.seq;
+      bool ok = writeSegment(segmentPath(*job.part, job.device, seg->seq, seg->gen), job.device, rows, seg->meta);
+
+      std::lock_guard<std::mutex> lock(mu_);
+      DeviceState& dev = job.part->devices[job.device];
+      if (ok && !job.part->dropped) {
+        dev.segments.push_back(seg);
+        dev.sealing.clear();
+      } else if (!ok) {
+        // Keep the rows: put them back in front of anything buffered since
+        dev.buffer.insert(dev.buffer.begin(), dev.sealing.begin(), dev.sealing.end());
+        dev.sealing.clear();
+      }
+    }
+  }
+
+  /**
+   * @brief Drops every partition that ended before its retention window.
+   * Each drop is a directory rename into .trash plus an index erase, independent of
+   * how many rows the partition holds; the files are unlinked later by purgeTrash().
+   * @return Number of partitions dropped.
+   */
+  size_t expire(int64_t now) {
+    size_t dropped = 0;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+      auto& index = partitions_[r];
+      int64_t cutoff = now - policies_[r].retention_sec;
+      while (!index.empty() && index.begin()->first + policies_[r].partition_span_sec <= cutoff) {
+        PartitionPtr part = index.begin()->second;
+        std::string trash = trashDir() + "/" + resolutionName((Resolution)r) + "-" +
+                            std::to_string(part->start) + "-" + std::to_string(trash_seq_++);
+        if (rename(part->dir.c_str(), trash.c_str()) != 0) {
+          perror(("rename " + part->dir).c_str());
+          break; // Retry on the next maintenance pass
+        }
+        part->dropped = true;
+        index.erase(index.begin());
+        partitions_expired_++;
+        dropped++;
+      }
+    }
+    return dropped;
+  }
+
+  /**
+   * @brief Snapshot of every device's sealed segments, for the compactor.
+   * A partition is closed once its span plus PARTITION_SEAL_GRACE_SEC has passed.
+   */
+  std::vector<SegmentRun> segmentRuns(int64_t now) {
+    std::vector<SegmentRun> runs;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+      for (auto& p : partitions_[r]) {
+        bool closed = p.first + policies_[r].partition_span_sec + PARTITION_SEAL_GRACE_SEC <= now;
+        for (auto& d : p.second->devices) {
+          if (d.second.segments.empty()) continue;
+          runs.push_back({p.second, (Resolution)r, closed, d.first, d.second.segments});
+        }
+      }
+    }
+    return runs;
+  }
+
+  /**
+   * @brief Path for a compacted replacement of `run`.
+   */
+  std::string segmentPathFor(const SegmentRun& run, uint32_t seq, uint32_t gen) const {
+    return segmentPath(*run.part, run.device, seq, gen);
+  }
+
+  /**
+   * @brief Atomically replaces `run.segments` with `merged` in the index.
+   * Scans that took their snapshot earlier keep reading the old files, which are
+   * unlinked once the last of them finishes; later scans only see `merged`.
+   * @return false if the run changed meanwhile (the caller's output is discarded).
+   */
+  bool replaceRun(const SegmentRun& run, const SegmentPtr& merged) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!swapSegments(*run.part, run.device, run.segments, merged)) return false;
+    segments_compacted_ += run.segments.size();
+    return true;
+  }
+
+  /**
+   * @brief Unlinks the files of expired partitions. Runs on the maintenance thread only.
+   */
+  void purgeTrash() {
+    for (const std::string& name : listDir(trashDir())) {
+      std::string path = trashDir() + "/" + name;
+      nftw(path.c_str(), [](const char* fpath, const struct stat*, int, struct FTW*) { return remove(fpath); },
+           16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+
+  /**
+   * @brief Streams rows of `res` in [from, to) for one device (or all when empty),
+   * ordered by partition and device, then by epoch.
+   */
+  void scan(Resolution res, const std::string& device, int64_t from, int64_t to, const RowCallback& fn) {
+    struct Snapshot {
+      std::string             device;
+      std::vector<SegmentPtr> segments;
+      std::vector<SegmentRow> pending; // Sealing then buffered rows, newest last
+    };
+    std::vector<Snapshot> snapshots;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      int r = (int)res;
+      auto& index = partitions_[r];
+      auto it = index.upper_bound(partitionStart(from, policies_[r].partition_span_sec) - 1);
+      for (; it != index.end() && it->first < to; ++it) {
+        for (auto& d : it->second->devices) {
+          if (!device.empty() && d.first != device) continue;
+          Snapshot snap;
+          snap.device = d.first;
+          for (const SegmentPtr& seg : d.second.segments) {
+            if (seg->meta.max_epoch >= from && seg->meta.min_epoch < to) snap.segments.push_back(seg);
+          }
+          snap.pending = d.second.sealing;
+          snap.pending.insert(snap.pending.end(), d.second.buffer.begin(), d.second.buffer.end());
+          snapshots.push_back(std::move(snap));
+        }
+      }
+    }
+
+    for (Snapshot& snap : snapshots) {
+      std::vector<SegmentRow> rows;
+      for (const SegmentPtr& seg : snap.segments) {
+        std::string ignored;
+        readSegment(seg->meta.path, ignored, rows);
+      }
+      rows.insert(rows.end(), snap.pending.begin(), snap.pending.end());
+      dedupeRows(rows);
+      for (const SegmentRow& row : rows) {
+        if (row.epoch >= from && row.epoch < to) fn(snap.device, row);
+      }
+    }
+  }
+
+  Stats stats() {
+    Stats s;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+      s.partitions[r] = partitions_[r].size();
+      for (auto& p : partitions_[r]) {
+        for (auto& d : p.second->devices) {
+          s.segments += d.second.segments.size();
+          for (const SegmentPtr& seg : d.second.segments) s.segment_bytes += seg->meta.bytes;
+          s.buffered_rows += d.second.buffer.size() + d.second.sealing.size();
+        }
+      }
+    }
+    s.rows_appended      = rows_appended_;
+    s.rows_rejected      = rows_rejected_;
+    s.partitions_expired = partitions_expired_;
+    s.segments_compacted = segments_compacted_;
+    return s;
+  }
+
+  const RetentionPolicy& policy(Resolution res) const { return policies_[(int)res]; }
+
+ private:
+  std::string trashDir() const { return root_ + "/.trash"; }
+
+  std::string segmentPath(const Partition& part, const std::string& device, uint32_t seq, uint32_t gen) const {
+    return part.dir + "/" + sanitizeDeviceName(device) + "." + std::to_string(seq) + "." + std::to_string(gen) + ".seg";
+  }
+
+  /**
+   * @brief Looks up or creates the partition starting at `start`. Caller holds mu_.
+   */
+  PartitionPtr partitionFor(int r, int64_t start) {
+    auto it = partitions_[r].find(start);
+    if (it != partitions_[r].end()) return it->second;
+
+    PartitionPtr part = std::make_shared<Partition>();
+    part->start = start;
+    part->dir = root_ + "/" + resolutionName((Resolution)r) + "/" + std::to_string(start);
+    if (!makeDir(part->dir)) return nullptr;
+    partitions_[r][start] = part;
+    return part;
+  }
+
+  /**
+   * @brief Replaces `inputs` (a prefix of the device's segment list at snapshot time)
+   * with `merged`. Caller holds mu_. Segments sealed meanwhile stay after the merged one.
+   */
+  bool swapSegments(Partition& part, const std::string& device,
+                    const std::vector<SegmentPtr>& inputs, const SegmentPtr& merged) {
+    std::vector<SegmentPtr>& segs = part.devices[device].segments;
+    bool prefix = !part.dropped && segs.size() >= inputs.size() &&
+                  std::equal(inputs.begin(), inputs.end(), segs.begin());
+    if (!prefix) {
+      merged->obsolete = true; // Lost a race with expiry; discard our output
+      return false;
+    }
+    segs.erase(segs.begin(), segs.begin() + inputs.size());
+    segs.insert(segs.begin(), merged);
+    for (const SegmentPtr& seg : inputs) seg->obsolete = true;
+    return true;
+  }
+
+  void maintenanceLoop(int interval_sec) {
+    int64_t next_full_pass = monotonicSeconds() + interval_sec;
+    for (;;) {
+      bool flush_only;
+      {
+        std::unique_lock<std::mutex> lock(wake_mu_);
+        wake_cv_.wait_for(lock, std::chrono::seconds(interval_sec),
+                          [this]() { return stopping_ || flush_requested_; });
+        if (stopping_) return;
+        flush_only = flush_requested_ && monotonicSeconds() < next_full_pass;
+        flush_requested_ = false;
+      }
+      flush(false);
+      if (flush_only) continue; // Woken early by a full write buffer
+
+      next_full_pass = monotonicSeconds() + interval_sec;
+      int64_t now = (int64_t)time(nullptr);
+      size_t dropped = expire(now);
+      purgeTrash();
+      if (dropped) printf("Maintenance: %zu partition(s) expired\n", dropped);
+    }
+  }
+
+  static bool makeDir(const std::string& path) {
+    if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST) return true;
+    perror(("mkdir " + path).c_str());
+    return false;
+  }
+
+  static std::vector<std::string> listDir(const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return names;
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] == '.') continue;
+      names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    return names;
+  }
+
+  static bool endsWith(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+  }
+
+  // "<device>.<seq>.<gen>.seg" → seq, gen
+  static void parseSegmentName(const std::string& file, uint32_t& seq, uint32_t& gen) {
+    size_t gen_dot = file.rfind('.', file.size() - 5);
+    size_t seq_dot = gen_dot == std::string::npos || gen_dot == 0 ? std::string::npos : file.rfind('.', gen_dot - 1);
+    seq = gen = 0;
+    if (seq_dot == std::string::npos) return;
+    seq = (uint32_t)strtoul(file.c_str() + seq_dot + 1, nullptr, 10);
+    gen = (uint32_t)strtoul(file.c_str() + gen_dot + 1, nullptr, 10);
+  }
+
+  static void sortBySeq(std::vector<SegmentPtr>& segs) {
+    std::sort(segs.begin(), segs.end(), [](const SegmentPtr& a, const SegmentPtr& b) {
+      return a->seq != b->seq ? a->seq < b->seq : a->gen < b->gen;
+    });
+  }
+
+  std::string     root_;
+  RetentionPolicy policies_[NUM_RESOLUTIONS];
+
+  std::mutex                           mu_;       // Guards the index and write buffers
+  std::mutex                           flush_mu_; // Serializes flush() so `sealing` has one owner
+  std::map<int64_t, PartitionPtr>      partitions_[NUM_RESOLUTIONS];
+  uint64_t                             trash_seq_ = 0;
+
+  uint64_t rows_appended_      = 0;
+  uint64_t rows_rejected_      = 0;
+  uint64_t partitions_expired_ = 0;
+  uint64_t segments_compacted_ = 0;
+
+  std::thread             maintenance_thread_;
+  std::mutex              wake_mu_;
+  std::condition_variable wake_cv_;
+  std::atomic<bool>       stopping_{false};
+  bool                    flush_requested_ = false;
+};
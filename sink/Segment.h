@@ -0,0 +1,320 @@
+// AgroPRO Sink – immutable segment files
+// A segment holds the rows of one device inside one partition, sorted by event time.
+// Segments are written once (tmp file + rename) and never modified in place.
+// Flushes write the plain encoding (cheap on the ingest path); the compactor
+// re-encodes merged segments column-wise with delta-of-delta timestamps (one bit
+// per row at a steady cadence) and XOR-compressed floats.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "SinkRecord.h"
+
+// --- On-disk layout (host byte order; the sink targets little-endian Linux) ---
+//   magic "AGS1" | encoding u8 | channels u8 | device_len u16 | rows u32
+//   | min_epoch i64 | max_epoch i64 | device bytes | row payload
+// GORILLA payload: payload_len u32 | bitstream (epoch column, then one column per channel)
+const char     SEGMENT_MAGIC[4]     = {'A', 'G', 'S', '1'};
+const uint8_t  SEGMENT_ENC_PLAIN    = 0; // rows as {i64 epoch, f32 values[NUM_CHANNELS]}
+const uint8_t  SEGMENT_ENC_GORILLA  = 1; // delta-of-delta epochs + XOR floats, column-wise
+const size_t   SEGMENT_HEADER_BYTES = 4 + 1 + 1 + 2 + 4 + 8 + 8;
+
+struct SegmentRow {
+  int64_t epoch;
+  float   values[NUM_CHANNELS];
+};
+
+struct SegmentMeta {
+  std::string path;
+  int64_t     min_epoch = 0;
+  int64_t     max_epoch = 0;
+  uint32_t    rows      = 0;
+  uint64_t    bytes     = 0;
+  uint8_t     encoding  = SEGMENT_ENC_PLAIN;
+};
+
+// =======================================================================================
+//                                 GORILLA COLUMN CODEC
+// =======================================================================================
+
+class BitWriter {
+ public:
+  void write(uint64_t value, int bits) {
+    for (int i = bits - 1; i >= 0; i--) {
+      if (used_ == 0) bytes_.push_back(0);
+      if ((value >> i) & 1) bytes_.back() |= (uint8_t)(0x80 >> used_);
+      used_ = (used_ + 1) & 7;
+    }
+  }
+  const std::vector<uint8_t>& bytes() const { return bytes_; }
+
+ private:
+  std::vector<uint8_t> bytes_;
+  int                  used_ = 0; // Bits used in the last byte
+};
+
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, size_t len) : data_(data), len_(len) {}
+
+  uint64_t read(int bits) {
+    uint64_t value = 0;
+    for (int i = 0; i < bits; i++) {
+      size_t byte = pos_ >> 3;
+      int bit = 0;
+      if (byte < len_) {
+        bit = (data_[byte] >> (7 - (pos_ & 7))) & 1;
+      } else {
+        overrun_ = true;
+      }
+      value = (value << 1) | (uint64_t)bit;
+      pos_++;
+    }
+    return value;
+  }
+  bool overrun() const { return overrun_; }
+
+ private:
+  const uint8_t* data_;
+  size_t         len_;
+  size_t         pos_ = 0;
+  bool           overrun_ = false;
+};
+
+inline uint64_t zigzagEncode(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+inline int64_t  zigzagDecode(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+/**
+ * @brief Encodes rows column-wise: epochs as delta-of-delta (1 bit per row for a
+ * steady cadence), then each channel as XOR against the previous value of that channel.
+ */
+inline std::vector<uint8_t> encodeGorilla(const std::vector<SegmentRow>& rows) {
+  BitWriter w;
+  int64_t prev_epoch = rows.front().epoch;
+  int64_t prev_delta = 0;
+  w.write((uint64_t)prev_epoch, 64);
+  for (size_t i = 1; i < rows.size(); i++) {
+    int64_t delta = rows[i].epoch - prev_epoch;
+    uint64_t z = zigzagEncode(delta - prev_delta);
+    if (z == 0) {
+      w.write(0, 1);
+    } else if (z < (1ULL << 7)) {
+      w.write(0x2, 2);  w.write(z, 7);
+    } else if (z < (1ULL << 12)) {
+      w.write(0x6, 3);  w.write(z, 12);
+    } else if (z < (1ULL << 20)) {
+      w.write(0xE, 4);  w.write(z, 20);
+    } else {
+      w.write(0xF, 4);  w.write(z, 64);
+    }
+    prev_delta = delta;
+    prev_epoch = rows[i].epoch;
+  }
+
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    uint32_t prev;
+    memcpy(&prev, &rows.front().values[ch], 4);
+    w.write(prev, 32);
+    int window_lead = -1, window_trail = 0;
+    for (size_t i = 1; i < rows.size(); i++) {
+      uint32_t cur;
+      memcpy(&cur, &rows[i].values[ch], 4);
+      uint32_t x = cur ^ prev;
+      prev = cur;
+      if (x == 0) {
+        w.write(0, 1);
+        continue;
+      }
+      int lead = __builtin_clz(x);
+      int trail = __builtin_ctz(x);
+      if (window_lead >= 0 && lead >= window_lead && trail >= window_trail) {
+        w.write(0x2, 2); // Fits the previous meaningful-bit window
+        w.write(x >> window_trail, 32 - window_lead - window_trail);
+      } else {
+        int sig = 32 - lead - trail;
+        w.write(0x3, 2);
+        w.write((uint64_t)lead, 5);
+        w.write((uint64_t)(sig - 1), 5);
+        w.write(x >> trail, sig);
+        window_lead = lead;
+        window_trail = trail;
+      }
+    }
+  }
+  return w.bytes();
+}
+
+inline bool decodeGorilla(const uint8_t* data, size_t len, uint32_t count, SegmentRow* rows) {
+  if (count == 0) return true;
+  BitReader r(data, len);
+  int64_t epoch = (int64_t)r.read(64);
+  int64_t delta = 0;
+  rows[0].epoch = epoch;
+  for (uint32_t i = 1; i < count; i++) {
+    uint64_t z = 0;
+    if (r.read(1) == 0) {
+      z = 0;
+    } else if (r.read(1) == 0) {
+      z = r.read(7);
+    } else if (r.read(1) == 0) {
+      z = r.read(12);
+    } else if (r.read(1) == 0) {
+      z = r.read(20);
+    } else {
+      z = r.read(64);
+    }
+    delta += zigzagDecode(z);
+    epoch += delta;
+    rows[i].epoch = epoch;
+  }
+
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    uint32_t prev = (uint32_t)r.read(32);
+    memcpy(&rows[0].values[ch], &prev, 4);
+    int window_lead = 0, window_trail = 0;
+    for (uint32_t i = 1; i < count; i++) {
+      if (r.read(1) != 0) {
+        uint32_t x;
+        if (r.read(1) == 0) {
+          x = (uint32_t)r.read(32 - window_lead - window_trail) << window_trail;
+        } else {
+          window_lead = (int)r.read(5);
+          int sig = (int)r.read(5) + 1;
+          window_trail = 32 - window_lead - sig;
+          if (window_trail < 0) return false;
+          x = (uint32_t)r.read(sig) << window_trail;
+        }
+        prev ^= x;
+      }
+      memcpy(&rows[i].values[ch], &prev, 4);
+    }
+  }
+  return !r.overrun();
+}
+
+/**
+ * @brief Writes `rows` (already sorted by epoch) for `device` to `path` atomically.
+ * The data goes to `path`.tmp, is fsync'd, then renamed over `path`.
+ * @return true on success; `meta` describes the new segment.
+ */
+inline bool writeSegment(const std::string& path, const std::string& device,
+                         const std::vector<SegmentRow>& rows, SegmentMeta& meta,
+                         uint8_t encoding = SEGMENT_ENC_PLAIN) {
+  if (rows.empty() || device.size() > 0xFFFF) return false;
+
+  std::string tmp_path = path + ".tmp";
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (!f) {
+    perror(("fopen " + tmp_path).c_str());
+    return false;
+  }
+
+  uint8_t  channels   = NUM_CHANNELS;
+  uint16_t device_len = (uint16_t)device.size();
+  uint32_t count      = (uint32_t)rows.size();
+  int64_t  min_epoch  = rows.front().epoch;
+  int64_t  max_epoch  = rows.back().epoch;
+
+  bool ok = fwrite(SEGMENT_MAGIC, 1, 4, f) == 4 &&
+            fwrite(&encoding, 1, 1, f) == 1 &&
+            fwrite(&channels, 1, 1, f) == 1 &&
+            fwrite(&device_len, 2, 1, f) == 1 &&
+            fwrite(&count, 4, 1, f) == 1 &&
+            fwrite(&min_epoch, 8, 1, f) == 1 &&
+            fwrite(&max_epoch, 8, 1, f) == 1 &&
+            fwrite(device.data(), 1, device.size(), f) == device.size();
+  if (encoding == SEGMENT_ENC_GORILLA) {
+    std::vector<uint8_t> payload = encodeGorilla(rows);
+    uint32_t payload_len = (uint32_t)payload.size();
+    ok = ok && fwrite(&payload_len, 4, 1, f) == 1 &&
+         fwrite(payload.data(), 1, payload.size(), f) == payload.size();
+  } else {
+    for (size_t i = 0; ok && i < rows.size(); i++) {
+      ok = fwrite(&rows[i].epoch, 8, 1, f) == 1 &&
+           fwrite(rows[i].values, sizeof(float), NUM_CHANNELS, f) == (size_t)NUM_CHANNELS;
+    }
+  }
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  long size = ok ? ftell(f) : -1;
+  fclose(f);
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Error: failed to write segment %s\n", path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  meta.path      = path;
+  meta.min_epoch = min_epoch;
+  meta.max_epoch = max_epoch;
+  meta.rows      = count;
+  meta.bytes     = (uint64_t)size;
+  meta.encoding  = encoding;
+  return true;
+}
+
+/**
+ * @brief Reads only the header of a segment (used to rebuild the index at startup).
+ */
+inline bool readSegmentHeader(const std::string& path, std::string& device, SegmentMeta& meta) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+
+  char     magic[4];
+  uint8_t  channels   = 0;
+  uint16_t device_len = 0;
+  bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, SEGMENT_MAGIC, 4) == 0 &&
+            fread(&meta.encoding, 1, 1, f) == 1 &&
+            fread(&channels, 1, 1, f) == 1 && channels == NUM_CHANNELS &&
+            fread(&device_len, 2, 1, f) == 1 &&
+            fread(&meta.rows, 4, 1, f) == 1 &&
+            fread(&meta.min_epoch, 8, 1, f) == 1 &&
+            fread(&meta.max_epoch, 8, 1, f) == 1;
+  if (ok) {
+    device.resize(device_len);
+    ok = fread(&device[0], 1, device_len, f) == device_len;
+  }
+  if (ok && fseek(f, 0, SEEK_END) == 0) meta.bytes = (uint64_t)ftell(f);
+  fclose(f);
+
+  meta.path = path;
+  return ok;
+}
+
+/**
+ * @brief Reads a whole segment. Rows are appended to `rows` in stored (epoch) order.
+ */
+inline bool readSegment(const std::string& path, std::string& device, std::vector<SegmentRow>& rows) {
+  SegmentMeta meta;
+  if (!readSegmentHeader(path, device, meta)) return false;
+
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  bool ok = fseek(f, (long)(SEGMENT_HEADER_BYTES + device.size()), SEEK_SET) == 0;
+  size_t first = rows.size();
+  rows.resize(first + meta.rows);
+  if (meta.encoding == SEGMENT_ENC_GORILLA) {
+    uint32_t payload_len = 0;
+    ok = ok && fread(&payload_len, 4, 1, f) == 1 && payload_len <= meta.bytes;
+    std::vector<uint8_t> payload(ok ? payload_len : 0);
+    ok = ok && fread(payload.data(), 1, payload_len, f) == payload_len &&
+         decodeGorilla(payload.data(), payload.size(), meta.rows, rows.data() + first);
+  } else if (meta.encoding == SEGMENT_ENC_PLAIN) {
+    for (uint32_t i = 0; ok && i < meta.rows; i++) {
+      SegmentRow& row = rows[first + i];
+      ok = fread(&row.epoch, 8, 1, f) == 1 &&
+           fread(row.values, sizeof(float), NUM_CHANNELS, f) == (size_t)NUM_CHANNELS;
+    }
+  } else {
+    ok = false;
+  }
+  fclose(f);
+  if (!ok) rows.resize(first);
+  return ok;
+}
@@ -0,0 +1,285 @@
+// AgroPRO Sink – record model and JSON payload parsing
+// Shared by the ingest path, the partitioned store and every downstream stage.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// --- Channels ---
+// Order matches SENSOR_DATA_KEYS in AgroPRO.js and the firmware JSON payload.
+const int NUM_CHANNELS = 6;
+const char* const CHANNEL_KEYS[NUM_CHANNELS] = {
+  "sensor1", "sensor2", "sensor3", "sensor4", "dhttemp", "dhthumidity"
+};
+
+// --- Resolutions ---
+// RAW holds the 10-minute aligned samples, HOURLY the hourly averages the
+// firmware posts at hh:00:05. Each resolution has its own retention policy.
+enum class Resolution : uint8_t { RAW = 0, HOURLY = 1 };
+const int NUM_RESOLUTIONS = 2;
+
+inline const char* resolutionName(Resolution res) {
+  return res == Resolution::RAW ? "raw" : "hourly";
+}
+
+inline bool parseResolution(const std::string& name, Resolution& out) {
+  if (name == "raw")    { out = Resolution::RAW;    return true; }
+  if (name == "hourly") { out = Resolution::HOURLY; return true; }
+  return false;
+}
+
+/**
+ * @brief One AgroPRO record: a device's channel values at an event time.
+ * Missing or invalid readings are stored as NAN, exactly like the firmware does.
+ */
+struct AgroRecord {
+  std::string device;                  // Node id; the peer address when the payload has none
+  int64_t     epoch = 0;               // Event time (UTC seconds); arrival time when absent
+  Resolution  res   = Resolution::HOURLY;
+  float       values[NUM_CHANNELS];
+
+  AgroRecord() {
+    for (float& v : values) v = NAN;
+  }
+};
+
+/**
+ * @brief Returns the channel index for a JSON key, or -1 if it is not a sensor key.
+ */
+inline int channelIndex(const char* key, size_t len) {
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    if (strlen(CHANNEL_KEYS[i]) == len && memcmp(CHANNEL_KEYS[i], key, len) == 0) return i;
+  }
+  return -1;
+}
+
+// =======================================================================================
+//                                 JSON PAYLOAD PARSING
+// =======================================================================================
+// The firmware builds its payload with snprintf("%.2f"), so a failed sensor shows up
+// as a bare `nan` token rather than valid JSON. The parser below accepts that, the
+// quoted "nan" string AgroPRO.js already tolerates, and null. Unknown keys are skipped.
+
+namespace agro_json {
+
+inline void skipSpace(const char*& p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+}
+
+inline bool parseString(const char*& p, const char* end, std::string& out) {
+  if (p >= end || *p != '"') return false;
+  p++;
+  out.clear();
+  while (p < end && *p != '"') {
+    if (*p == '\\' && p + 1 < end) p++; // Keep the escaped character verbatim
+    out.push_back(*p++);
+  }
+  if (p >= end) return false;
+  p++;
+  return true;
+}
+
+/**
+ * @brief Parses a scalar value as float: numbers, nan/inf tokens, "nan" strings and null.
+ * Strings that are not numeric become NAN; `text` receives the raw string when quoted.
+ */
+inline bool parseScalar(const char*& p, const char* end, float& out, std::string* text) {
+  skipSpace(p, end);
+  if (p >= end) return false;
+  if (*p == '"') {
+    std::string s;
+    if (!parseString(p, end, s)) return false;
+    if (text) *text = s;
+    char* num_end = nullptr;
+    double d = strtod(s.c_str(), &num_end);
+    out = (!s.empty() && num_end && *num_end == '\0') ? (float)d : NAN;
+    return true;
+  }
+  if (end - p >= 4 && memcmp(p, "null", 4) == 0) { p += 4; out = NAN; return true; }
+  if (end - p >= 4 && memcmp(p, "true", 4) == 0) { p += 4; out = 1.0f; return true; }
+  if (end - p >= 5 && memcmp(p, "false", 5) == 0) { p += 5; out = 0.0f; return true; }
+
+  // strtod handles numbers plus nan/inf in any case; bound it to the token length
+  const char* tok = p;
+  while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\r' && *p != '\n') p++;
+  std::string token(tok, p - tok);
+  char* num_end = nullptr;
+  double d = strtod(token.c_str(), &num_end);
+  if (token.empty() || !num_end || *num_end != '\0') return false;
+  out = (float)d;
+  if (text) *text = token;
+  return true;
+}
+
+/**
+ * @brief Skips one JSON value of any type (used for keys the sink does not know).
+ */
+inline bool skipValue(const char*& p, const char* end) {
+  skipSpace(p, end);
+  if (p >= end) return false;
+  if (*p == '"') {
+    std::string ignored;
+    return parseString(p, end, ignored);
+  }
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    while (p < end) {
+      if (*p == '"') {
+        std::string ignored;
+        if (!parseString(p, end, ignored)) return false;
+        continue;
+      }
+      if (*p == '{' || *p == '[') depth++;
+      if (*p == '}' || *p == ']') {
+        depth--;
+        if (depth == 0) { p++; return true; }
+      }
+      p++;
+    }
+    return false;
+  }
+  float ignored;
+  return parseScalar(p, end, ignored, nullptr);
+}
+
+/**
+ * @brief Parses one flat AgroPRO JSON object starting at `p` into `out`.
+ * Fields already set in `out` (device, epoch, res) are kept when the object omits them.
+ */
+inline bool parseObject(const char*& p, const char* end, AgroRecord& out) {
+  skipSpace(p, end);
+  if (p >= end || *p != '{') return false;
+  p++;
+  bool any_channel = false;
+  for (;;) {
+    skipSpace(p, end);
+    if (p < end && *p == '}') { p++; break; }
+
+    std::string key;
+    if (!parseString(p, end, key)) return false;
+    skipSpace(p, end);
+    if (p >= end || *p != ':') return false;
+    p++;
+
+    int ch = channelIndex(key.data(), key.size());
+    if (ch >= 0) {
+      if (!parseScalar(p, end, out.values[ch], nullptr)) return false;
+      any_channel = true;
+    } else if (key == "device") {
+      float ignored;
+      std::string text;
+      if (!parseScalar(p, end, ignored, &text)) return false;
+      if (!text.empty()) out.device = text;
+    } else if (key == "epoch") {
+      float ignored;
+      std::string text;
+      if (!parseScalar(p, end, ignored, &text)) return false;
+      long long v = strtoll(text.c_str(), nullptr, 10); // float would lose seconds
+      if (v > 0) out.epoch = v;
+    } else if (key == "res") {
+      float ignored;
+      std::string text;
+      if (!parseScalar(p, end, ignored, &text)) return false;
+      parseResolution(text, out.res);
+    } else {
+      if (!skipValue(p, end)) return false;
+    }
+
+    skipSpace(p, end);
+    if (p < end && *p == ',') { p++; continue; }
+    if (p < end && *p == '}') { p++; break; }
+    return false;
+  }
+  return any_channel;
+}
+
+} // namespace agro_json
+
+/**
+ * @brief Parses a single AgroPRO JSON payload (as posted by the firmware) into `out`.
+ * @return false if the body is not an object or carries no sensor channel.
+ */
+inline bool parseAgroJson(const std::string& body, AgroRecord& out) {
+  const char* p = body.data();
+  const char* end = p + body.size();
+  return agro_json::parseObject(p, end, out);
+}
+
+/**
+ * @brief Parses a batch – a JSON array of AgroPRO objects, as the firmware sends when it
+ * drains its upload queue – into `out`. Elements without a sensor channel are skipped,
+ * or collected as raw JSON in `others` (e.g. alerts in a gateway's batch) when given.
+ * @return false if the body is not an array.
+ */
+inline bool parseAgroJsonBatch(const std::string& body, std::vector<AgroRecord>& out,
+                               std::vector<std::string>* others = nullptr) {
+  const char* p = body.data();
+  const char* end = p + body.size();
+  agro_json::skipSpace(p, end);
+  if (p >= end || *p != '[') return false;
+  p++;
+  for (;;) {
+    agro_json::skipSpace(p, end);
+    if (p < end && *p == ']') return true;
+    const char* element = p;
+    AgroRecord rec;
+    if (agro_json::parseObject(p, end, rec)) {
+      out.push_back(rec);
+    } else {
+      p = element;
+      if (!agro_json::skipValue(p, end)) return false;
+      if (others) others->emplace_back(element, p);
+    }
+    agro_json::skipSpace(p, end);
+    if (p < end && *p == ',') { p++; continue; }
+    return p < end && *p == ']';
+  }
+}
+
+/**
+ * @brief Appends a float to `out` as JSON, writing null for NAN/inf.
+ */
+inline void appendJsonNumber(std::string& out, float v) {
+  if (std::isnan(v) || std::isinf(v)) {
+    out += "null";
+    return;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", v);
+  out += buf;
+}
+
+/**
+ * @brief Appends a string to `out` as a quoted JSON string with minimal escaping.
+ */
+inline void appendJsonString(std::string& out, const std::string& s) {
+  out.push_back('"');
+  for (char c : s) {
+    if (c == '"' || c == '\\') out.push_back('\\');
+    if ((unsigned char)c < 0x20) continue;
+    out.push_back(c);
+  }
+  out.push_back('"');
+}
+
+/**
+ * @brief Appends `rec` as one JSON object in the firmware's payload format: device,
+ * epoch, res and the channel values.
+ */
+inline void appendRecordJson(std::string& out, const AgroRecord& rec) {
+  out += "{\"device\":";
+  appendJsonString(out, rec.device);
+  out += ",\"epoch\":" + std::to_string(rec.epoch);
+  out += std::string(",\"res\":\"") + resolutionName(rec.res) + "\"";
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    out += std::string(",\"") + CHANNEL_KEYS[ch] + "\":";
+    appendJsonNumber(out, rec.values[ch]);
+  }
+  out.push_back('}');
+}
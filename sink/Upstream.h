@@ -0,0 +1,586 @@
+// AgroPRO Sink – upstream forwarding with a persistent spool (gateway mode)
+// ────────────────────────────────────────────────────────────────
+// • Every record (and device alert) the sink accepts is appended to a spool
+//   file at once; nodes get their reply without waiting on the upstream link
+// • Once per window the spool is read from the last committed offset,
+//   coalesced (latest record per device / resolution / epoch) and sent as one
+//   JSON array: a single bulk write instead of one request per node report
+// • The offset moves only after upstream accepts the batch, so an outage or a
+//   restart just leaves the records spooled; retries back off to 10 min, or
+//   wait as long as upstream's Retry-After, and batches follow its size hint
+// • Upstream is another AgroSink or the Apps Script web app itself: https with
+//   certificate checks (OpenSSL), and Apps Script's 302 after the POST
+// ────────────────────────────────────────────────────────────────
+//
+// Spool: <data>/upstream.spool holds "<key>\t<json>\n" lines (append-only, emptied
+// once fully sent); <data>/upstream.offset is the committed read offset.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <string>
+#include <strings.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "HttpServer.h"
+
+const int      UPSTREAM_DEFAULT_WINDOW_SEC  = 60;
+const uint64_t UPSTREAM_DEFAULT_SPOOL_BYTES = 256ULL * 1024 * 1024; // ~1M records; newer ones are dropped beyond it
+const size_t   UPSTREAM_BATCH_MAX_BYTES     = 512 * 1024;  // Spool bytes per request, under HTTP_MAX_BODY_BYTES
+const size_t   UPSTREAM_LINE_MAX_BYTES      = 16 * 1024;   // Longer entries are not spooled
+const uint64_t UPSTREAM_COMPACT_BYTES       = 4 * 1024 * 1024; // Sent bytes after which the unsent tail is rewritten
+const int      UPSTREAM_TIMEOUT_SEC         = 30;          // Apps Script takes a while over a large batch
+const int      UPSTREAM_MAX_BACKOFF_SEC     = 600;
+const int      UPSTREAM_MAX_RETRY_AFTER_SEC = 6 * 3600;    // Longer Retry-After values are clamped
+const int      UPSTREAM_MAX_REDIRECTS       = 3;
+const size_t   UPSTREAM_HEAD_MAX_BYTES      = 8 * 1024;
+const size_t   UPSTREAM_BODY_PREVIEW        = 128;         // Response bytes kept for the log and the "Error" check
+
+/**
+ * @brief One request/response exchange over plain TCP or TLS (Connection: close).
+ */
+class UpstreamConnection {
+ public:
+  ~UpstreamConnection() { close(); }
+
+  /**
+   * @param ctx TLS context; required for https URLs.
+   */
+  bool open(SSL_CTX* ctx, const HttpUrl& url, int timeout_sec) {
+    fd_ = httpConnect(url.host, url.port, timeout_sec);
+    if (fd_ < 0) return false;
+    if (!url.tls) return true;
+    ssl_ = SSL_new(ctx);
+    if (!ssl_) return false;
+    SSL_set_fd(ssl_, fd_);
+    SSL_set_tlsext_host_name(ssl_, url.host.c_str());
+    SSL_set1_host(ssl_, url.host.c_str());
+    if (SSL_connect(ssl_) != 1) {
+      long verify = SSL_get_verify_result(ssl_);
+      fprintf(stderr, "Upstream: TLS handshake with %s failed (%s)\n", url.host.c_str(),
+              verify != X509_V_OK ? X509_verify_cert_error_string(verify) : "no certificate error");
+      ERR_clear_error();
+      return false;
+    }
+    return true;
+  }
+
+  bool write(const std::string& data) {
+    if (!ssl_) return sendAll(fd_, data.data(), data.size());
+    size_t sent = 0;
+    while (sent < data.size()) {
+      int n = SSL_write(ssl_, data.data() + sent, (int)std::min<size_t>(data.size() - sent, INT32_MAX));
+      if (n <= 0) return false;
+      sent += (size_t)n;
+    }
+    return true;
+  }
+
+  ssize_t read(char* buf, size_t size) {
+    if (!ssl_) return recv(fd_, buf, size, 0);
+    int n = SSL_read(ssl_, buf, (int)size);
+    if (n <= 0) ERR_clear_error(); // EOF without close_notify is common and harmless here
+    return n;
+  }
+
+  void close() {
+    if (ssl_) {
+      SSL_free(ssl_);
+      ssl_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int  fd_  = -1;
+  SSL* ssl_ = nullptr;
+};
+
+/**
+ * @brief Status line, Location and the start of the body of one response.
+ */
+struct UpstreamResponse {
+  int         status      = 0;  // 0: no response
+  int         retry_after = -1; // Seconds; -1 if not sent
+  int         batch_max   = 0;  // HTTP_BATCH_MAX_HEADER; 0 if not sent
+  std::string location;
+  std::string preview;
+};
+
+/**
+ * @brief Sends one request to `url` and reads the head plus UPSTREAM_BODY_PREVIEW
+ * bytes of the body (the first chunk, for chunked responses).
+ */
+inline UpstreamResponse upstreamRequest(SSL_CTX* ctx, const HttpUrl& url, const char* method, const std::string& body,
+                                        bool send_body) {
+  UpstreamResponse out;
+  UpstreamConnection conn;
+  if (!conn.open(ctx, url, UPSTREAM_TIMEOUT_SEC)) return out;
+
+  std::string request = std::string(method) + " " + url.path + " HTTP/1.1\r\nHost: " + url.hostHeader() +
+                        "\r\nUser-Agent: AgroSink\r\nConnection: close\r\n";
+  if (send_body) {
+    request += "Content-Type: application/json; charset=utf-8\r\nContent-Length: " + std::to_string(body.size()) +
+               "\r\n\r\n";
+    if (!conn.write(request) || !conn.write(body)) return out;
+  } else {
+    request += "\r\n";
+    if (!conn.write(request)) return out;
+  }
+
+  std::string data;
+  char buf[4096];
+  size_t head_end = std::string::npos;
+  while (data.size() < UPSTREAM_HEAD_MAX_BYTES + UPSTREAM_BODY_PREVIEW) {
+    ssize_t n = conn.read(buf, sizeof(buf));
+    if (n <= 0) break;
+    data.append(buf, (size_t)n);
+    if (head_end == std::string::npos) head_end = data.find("\r\n\r\n");
+    if (head_end != std::string::npos && data.size() >= head_end + 4 + UPSTREAM_BODY_PREVIEW) break;
+  }
+  if (head_end == std::string::npos || data.compare(0, 5, "HTTP/") != 0) return out;
+
+  size_t space = data.find(' ');
+  out.status = space < head_end ? atoi(data.c_str() + space + 1) : 0;
+  bool chunked = false;
+  size_t line = data.find("\r\n") + 2;
+  while (line < head_end) {
+    size_t eol = data.find("\r\n", line);
+    std::string header = data.substr(line, eol - line);
+    size_t colon = header.find(':');
+    if (colon != std::string::npos) {
+      std::string name = header.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)tolower(c); });
+      size_t value = header.find_first_not_of(' ', colon + 1);
+      std::string text = value == std::string::npos ? "" : header.substr(value);
+      if (name == "location") out.location = text;
+      if (name == "retry-after" && isdigit((unsigned char)text[0])) out.retry_after = atoi(text.c_str());
+      if (strcasecmp(name.c_str(), HTTP_BATCH_MAX_HEADER) == 0) out.batch_max = atoi(text.c_str());
+      if (name == "transfer-encoding" && text.find("chunked") != std::string::npos) chunked = true;
+    }
+    line = eol + 2;
+  }
+  size_t body_start = head_end + 4;
+  size_t body_len = UPSTREAM_BODY_PREVIEW;
+  if (chunked) {
+    size_t eol = data.find("\r\n", body_start);
+    if (eol != std::string::npos) body_len = std::min<size_t>(body_len, strtoul(data.c_str() + body_start, nullptr, 16));
+    body_start = eol == std::string::npos ? data.size() : eol + 2;
+  }
+  if (body_start < data.size()) out.preview = data.substr(body_start, body_len);
+  return out;
+}
+
+class Upstream {
+ public:
+  struct Stats {
+    uint64_t spooled     = 0; // Entries written to the spool
+    uint64_t dropped     = 0; // Not spooled: spool full or entry too long
+    uint64_t batches     = 0; // Bulk writes upstream accepted
+    uint64_t forwarded   = 0; // Entries in those batches, after coalescing
+    uint64_t coalesced   = 0; // Entries replaced by a later one in the same batch
+    uint64_t failures    = 0; // Attempts that will be retried
+    uint64_t rejected    = 0; // Entries upstream refused with a 4xx (not retried)
+    uint64_t spool_bytes = 0; // Not yet accepted upstream
+    int      last_status = 0;
+  };
+
+  Upstream() = default;
+  Upstream(const Upstream&) = delete;
+  Upstream& operator=(const Upstream&) = delete;
+
+  ~Upstream() {
+    stop();
+    if (ctx_) SSL_CTX_free(ctx_);
+  }
+
+  /**
+   * @param url             http:// or https:// endpoint taking a JSON array per POST.
+   * @param spool_dir       Where upstream.spool / upstream.offset live (the data directory).
+   * @param window_sec      Batch cadence; earlier when UPSTREAM_BATCH_MAX_BYTES are spooled.
+   * @param spool_max_bytes Entries beyond this are dropped while upstream is unreachable.
+   */
+  bool start(const std::string& url, const std::string& spool_dir, int window_sec, uint64_t spool_max_bytes) {
+    if (!parseHttpUrl(url, url_)) {
+      fprintf(stderr, "Error: upstream must be an http:// or https:// URL\n");
+      return false;
+    }
+    if (url_.tls) {
+      ctx_ = SSL_CTX_new(TLS_client_method());
+      if (!ctx_) return false;
+      SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+      SSL_CTX_set_default_verify_paths(ctx_); // System CAs; SSL_CERT_FILE / SSL_CERT_DIR override
+      SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+    }
+    url_text_ = url;
+    spool_path_ = spool_dir + "/upstream.spool";
+    offset_path_ = spool_dir + "/upstream.offset";
+    window_sec_ = window_sec > 0 ? window_sec : 1;
+    spool_max_bytes_ = spool_max_bytes;
+
+    fd_ = ::open(spool_path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      perror(spool_path_.c_str());
+      return false;
+    }
+    size_ = dropTornTail();
+    offset_ = 0;
+    if (FILE* f = fopen(offset_path_.c_str(), "r")) {
+      unsigned long long value = 0;
+      if (fscanf(f, "%llu", &value) == 1) offset_ = value;
+      fclose(f);
+    }
+    if (offset_ > size_) offset_ = 0; // Spool emptied after the offset was written
+    if (size_ > offset_) {
+      printf("Upstream: %llu bytes spooled from the last run\n", (unsigned long long)(size_ - offset_));
+    }
+
+    stopping_ = false;
+    forward_thread_ = std::thread([this]() { forwardLoop(); });
+    return true;
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    if (forward_thread_.joinable()) forward_thread_.join();
+    if (fd_ >= 0) {
+      fdatasync(fd_);
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  bool enabled() const { return fd_ >= 0; }
+
+  const std::string& url() const { return url_text_; }
+
+  /**
+   * @brief Spools one JSON object. Entries with the same non-empty `key` in one batch
+   * are coalesced to the latest; alerts pass an empty key and are all sent.
+   */
+  void add(const std::string& key, const std::string& json) {
+    if (fd_ < 0) return;
+    std::string line;
+    line.reserve(key.size() + json.size() + 2);
+    for (char c : key) line.push_back(c == '\t' || c == '\n' ? '_' : c);
+    line.push_back('\t');
+    line += json;
+    line.push_back('\n');
+    bool flush;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (line.size() > UPSTREAM_LINE_MAX_BYTES || size_ - offset_ + line.size() > spool_max_bytes_ ||
+          json.find('\n') != std::string::npos) {
+        stats_.dropped++;
+        return;
+      }
+      ssize_t n = ::write(fd_, line.data(), line.size());
+      if (n != (ssize_t)line.size()) {
+        if (n > 0) ftruncate(fd_, (off_t)size_); // Keep the spool line-aligned
+        stats_.dropped++;
+        return;
+      }
+      size_ += line.size();
+      stats_.spooled++;
+      flush = size_ - offset_ >= UPSTREAM_BATCH_MAX_BYTES;
+    }
+    if (flush) cv_.notify_all();
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    Stats s = stats_;
+    s.spool_bytes = size_ - offset_;
+    return s;
+  }
+
+ private:
+  enum class Outcome { DELIVERED, REJECTED, RETRY };
+
+  /**
+   * @brief Cuts a partial last line (a crash mid-append) off the spool.
+   * @return The new size.
+   */
+  uint64_t dropTornTail() {
+    struct stat st;
+    if (fstat(fd_, &st) != 0) return 0;
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t end = size;
+    char buf[4096];
+    while (end > 0) {
+      size_t n = (size_t)std::min<uint64_t>(end, sizeof(buf));
+      if (pread(fd_, buf, n, (off_t)(end - n)) != (ssize_t)n) return size;
+      const char* nl = (const char*)memrchr(buf, '\n', n);
+      if (nl) {
+        end = end - n + (size_t)(nl - buf) + 1;
+        break;
+      }
+      end -= n;
+    }
+    if (end != size && ftruncate(fd_, (off_t)end) == 0) {
+      fprintf(stderr, "Upstream: dropped %llu bytes of a partial spool entry\n", (unsigned long long)(size - end));
+      return end;
+    }
+    return size;
+  }
+
+  void writeOffset(uint64_t offset) {
+    std::string tmp = offset_path_ + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    bool ok = f && fprintf(f, "%llu\n", (unsigned long long)offset) > 0 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f) fclose(f);
+    if (!ok || rename(tmp.c_str(), offset_path_.c_str()) != 0) perror(offset_path_.c_str());
+  }
+
+  /**
+   * @brief Marks spool bytes up to `offset` as sent; empties the spool once all are.
+   */
+  void commit(uint64_t offset) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      // Both under the lock, so no entry lands before the offset is reset. A crash in
+      // between leaves an offset past the end, which start() reads as 0.
+      if (offset == size_ && ftruncate(fd_, 0) == 0) {
+        size_ = offset_ = 0;
+        writeOffset(0);
+        return;
+      }
+      offset_ = offset;
+      if (offset_ >= UPSTREAM_COMPACT_BYTES && size_ - offset_ < offset_ && rewriteTail()) return;
+    }
+    writeOffset(offset); // Only this thread writes it; the spool does not shrink meanwhile
+  }
+
+  /**
+   * @brief Replaces the spool with its unsent tail, for when entries keep arriving
+   * during every drain and the file never empties. Called with `mu_` held; the tail
+   * is shorter than the old offset, so a stale offset file again reads as 0.
+   */
+  bool rewriteTail() {
+    std::string tail(size_ - offset_, '\0');
+    if (pread(fd_, &tail[0], tail.size(), (off_t)offset_) != (ssize_t)tail.size()) return false;
+    std::string tmp = spool_path_ + ".tmp";
+    int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    if (::write(fd, tail.data(), tail.size()) != (ssize_t)tail.size() || fsync(fd) != 0 ||
+        rename(tmp.c_str(), spool_path_.c_str()) != 0) {
+      ::close(fd);
+      unlink(tmp.c_str());
+      return false;
+    }
+    ::close(fd_);
+    fd_ = fd;
+    size_ = tail.size();
+    offset_ = 0;
+    writeOffset(0);
+    return true;
+  }
+
+  /**
+   * @brief POSTs `body`, following redirects (301/302/303 as a GET, 307/308 re-POST).
+   * For Apps Script the POST has already run doPost() when the 302 comes back, so a
+   * failure to fetch the redirect still counts as delivered.
+   */
+  Outcome post(const std::string& body) {
+    HttpUrl target = url_;
+    UpstreamResponse res = upstreamRequest(ctx_, target, "POST", body, true);
+    for (int hop = 0; hop < UPSTREAM_MAX_REDIRECTS && res.status >= 300 && res.status < 400 && !res.location.empty();
+         hop++) {
+      bool resend_body = res.status == 307 || res.status == 308;
+      HttpUrl next;
+      if (res.location[0] == '/') {
+        next = target;
+        next.path = res.location;
+      } else if (!parseHttpUrl(res.location, next)) {
+        break;
+      }
+      if (next.tls && !ctx_) break; // Plain upstream redirecting to https: not configured for TLS
+      int redirect_status = res.status;
+      target = next;
+      res = upstreamRequest(ctx_, target, resend_body ? "POST" : "GET", body, resend_body);
+      if (res.status == 0 && !resend_body) {
+        setLastStatus(redirect_status);
+        return Outcome::DELIVERED;
+      }
+    }
+    setLastStatus(res.status);
+    // Upstream's backpressure: a size hint holds until the next one; Retry-After is per answer
+    if (res.batch_max > 0) batch_max_entries_ = (size_t)res.batch_max;
+    retry_after_sec_ = res.retry_after;
+    if (res.status >= 200 && res.status < 300) {
+      // AgroPRO.js answers 200 with an "Error: ..." body
+      if (res.preview.compare(0, 5, "Error") != 0) return Outcome::DELIVERED;
+      fprintf(stderr, "Upstream: %s\n", res.preview.c_str());
+      return Outcome::RETRY;
+    }
+    if (res.status >= 400 && res.status < 500 && res.status != 408 && res.status != 429) {
+      fprintf(stderr, "Upstream: batch rejected with %d %s\n", res.status, res.preview.c_str());
+      return Outcome::REJECTED;
+    }
+    return Outcome::RETRY;
+  }
+
+  void setLastStatus(int status) {
+    std::lock_guard<std::mutex> lock(mu_);
+    stats_.last_status = status;
+  }
+
+  /**
+   * @brief Reads spool bytes [from, to), cut back to the last full line, and builds the
+   * coalesced JSON array.
+   * @return The offset just past the last line used.
+   */
+  uint64_t readBatch(uint64_t from, uint64_t to, std::string& json, size_t& entries, size_t& coalesced) {
+    // Reads whole lines up to `to`, and no more than batch_max_entries_ of them
+    std::string data(to - from, '\0');
+    ssize_t n = pread(fd_, &data[0], data.size(), (off_t)from);
+    if (n <= 0) return from;
+    data.resize((size_t)n);
+    size_t last_nl = data.rfind('\n');
+    if (last_nl == std::string::npos) return from;
+    data.resize(last_nl + 1);
+
+    std::vector<std::pair<const char*, size_t>> items;
+    std::unordered_map<std::string, size_t> latest; // key -> index in items
+    coalesced = 0;
+    size_t pos = 0;
+    size_t lines = 0;
+    while (pos < data.size() && (batch_max_entries_ == 0 || lines < batch_max_entries_)) {
+      size_t eol = data.find('\n', pos);
+      lines++;
+      size_t tab = data.find('\t', pos);
+      if (tab < eol && tab + 1 < eol && data[tab + 1] == '{' && data[eol - 1] == '}') {
+        std::pair<const char*, size_t> item(data.data() + tab + 1, eol - tab - 1);
+        if (tab == pos) {
+          items.push_back(item);
+        } else {
+          auto found = latest.emplace(data.substr(pos, tab - pos), items.size());
+          if (found.second) {
+            items.push_back(item);
+          } else {
+            items[found.first->second] = item;
+            coalesced++;
+          }
+        }
+      }
+      pos = eol + 1;
+    }
+
+    json.clear();
+    json.reserve(data.size());
+    json.push_back('[');
+    for (const auto& item : items) {
+      if (json.size() > 1) json.push_back(',');
+      json.append(item.first, item.second);
+    }
+    json.push_back(']');
+    entries = items.size();
+    return from + pos;
+  }
+
+  void forwardLoop() {
+    int backoff_sec = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait_for(lock, std::chrono::seconds(backoff_sec ? backoff_sec : window_sec_), [this, backoff_sec]() {
+          return stopping_ || (backoff_sec == 0 && size_ - offset_ >= UPSTREAM_BATCH_MAX_BYTES);
+        });
+        if (stopping_) return; // Whatever is left stays spooled for the next start
+      }
+      uint64_t window_end;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        fdatasync(fd_); // The window's entries are on disk before any of them goes out
+        window_end = size_;
+      }
+
+      // Drain the window in batches of at most UPSTREAM_BATCH_MAX_BYTES of spool;
+      // entries that arrive meanwhile wait for the next window
+      for (;;) {
+        uint64_t from, to;
+        {
+          std::lock_guard<std::mutex> lock(mu_);
+          if (stopping_) return;
+          if (window_end > size_) window_end = size_; // The spool was emptied or rewritten
+          from = offset_;
+          to = std::min<uint64_t>(window_end, from + UPSTREAM_BATCH_MAX_BYTES);
+        }
+        if (from == to) {
+          backoff_sec = 0;
+          break;
+        }
+        std::string json;
+        size_t entries = 0, coalesced = 0;
+        uint64_t end = readBatch(from, to, json, entries, coalesced);
+        if (end == from) {
+          backoff_sec = window_sec_;
+          break;
+        }
+
+        Outcome outcome = entries ? post(json) : Outcome::DELIVERED;
+        if (outcome == Outcome::RETRY) {
+          std::lock_guard<std::mutex> lock(mu_);
+          stats_.failures++;
+          backoff_sec = backoff_sec ? std::min(backoff_sec * 2, UPSTREAM_MAX_BACKOFF_SEC) : window_sec_;
+          if (retry_after_sec_ > 0) backoff_sec = std::min(retry_after_sec_, UPSTREAM_MAX_RETRY_AFTER_SEC);
+          break;
+        }
+        {
+          std::lock_guard<std::mutex> lock(mu_);
+          if (outcome == Outcome::DELIVERED) {
+            stats_.batches += entries ? 1 : 0;
+            stats_.forwarded += entries;
+            stats_.coalesced += coalesced;
+          } else {
+            stats_.rejected += entries;
+          }
+        }
+        commit(end);
+      }
+    }
+  }
+
+  HttpUrl     url_;
+  std::string url_text_;
+  std::string spool_path_;
+  std::string offset_path_;
+  int         window_sec_      = UPSTREAM_DEFAULT_WINDOW_SEC;
+  uint64_t    spool_max_bytes_ = UPSTREAM_DEFAULT_SPOOL_BYTES;
+  SSL_CTX*    ctx_             = nullptr;
+  int         fd_              = -1;
+
+  // Forward thread only
+  size_t batch_max_entries_ = 0;  // Upstream's batch-size hint; 0: as many as fit
+  int    retry_after_sec_   = -1; // From upstream's last answer
+
+  mutable std::mutex      mu_;
+  std::condition_variable cv_;
+  uint64_t                size_   = 0; // Spool file size (appends go through add() only)
+  uint64_t                offset_ = 0; // Committed: everything before it was accepted upstream
+  Stats                   stats_;
+  std::atomic<bool>       stopping_{false};
+  std::thread             forward_thread_;
+};
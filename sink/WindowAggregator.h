@@ -0,0 +1,261 @@
+// AgroPRO Sink – event-time hourly windows with watermarks and late corrections
+// ────────────────────────────────────────────────────────────────
+// • RAW samples are rolled up into hourly windows keyed on their own event time
+//   (the device's epoch), never on arrival time
+// • Each device has its own watermark: newest event time seen minus the allowed
+//   lateness. A window is emitted once the watermark passes its end
+// • Window state is kept for a correction horizon after emission; a late sample
+//   updates only its own window and re-emits it with a higher revision. The store
+//   keeps the last write per (device, epoch), so the correction replaces the row
+// • A window shares its (device, epoch) key with the device's own hourly report,
+//   which is time-weighted and carries coverage. Once that report is seen the
+//   window is superseded: it is never emitted or corrected over the device's row
+// • Devices that go quiet have their windows closed on processing time instead
+// ────────────────────────────────────────────────────────────────
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "SinkRecord.h"
+
+const int64_t WINDOW_SEC                     = 3600;
+const int64_t DEFAULT_ALLOWED_LATENESS_SEC   = 10 * 60;  // One 10-minute sample may arrive out of order
+const int64_t DEFAULT_CORRECTION_HORIZON_SEC = 24 * 3600;
+const int64_t WINDOW_IDLE_CLOSE_SEC          = 2 * WINDOW_SEC; // Close windows of silent devices
+const int     WINDOW_TICK_SEC                = 30;
+
+class WindowAggregator {
+ public:
+  // Called outside the aggregator lock with the hourly record and its revision
+  // (0 for the first emission, 1.. for corrections).
+  using EmitCallback = std::function<void(const AgroRecord& hourly, uint32_t revision)>;
+
+  struct Stats {
+    size_t   open_windows     = 0;
+    size_t   retained_windows = 0;
+    uint64_t samples          = 0;
+    uint64_t windows_emitted  = 0;
+    uint64_t corrections      = 0;
+    uint64_t too_late         = 0; // Beyond the correction horizon; kept in RAW only
+    uint64_t superseded       = 0; // Windows the device reported an hourly row for
+  };
+
+  WindowAggregator(int64_t allowed_lateness_sec, int64_t correction_horizon_sec, EmitCallback emit)
+      : allowed_lateness_(allowed_lateness_sec), horizon_(correction_horizon_sec), emit_(emit) {}
+
+  ~WindowAggregator() { stop(); }
+
+  void start() {
+    stopping_ = false;
+    thread_ = std::thread([this]() {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(wake_mu_);
+          wake_cv_.wait_for(lock, std::chrono::seconds(WINDOW_TICK_SEC), [this]() { return stopping_.load(); });
+          if (stopping_) return;
+        }
+        tick((int64_t)time(nullptr));
+      }
+    });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mu_);
+      stopping_ = true;
+    }
+    wake_cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  /**
+   * @brief Adds one RAW sample. O(log w) in the device's retained windows (a
+   * handful), independent of how much history exists.
+   */
+  void add(const AgroRecord& rec) {
+    std::vector<Emission> out;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      samples_++;
+      DeviceState& dev = devices_[rec.device];
+      dev.last_arrival = (int64_t)time(nullptr);
+      if (rec.epoch > dev.max_epoch) dev.max_epoch = rec.epoch;
+      int64_t watermark = dev.max_epoch - allowed_lateness_;
+
+      int64_t start = windowStart(rec.epoch);
+      if (start + WINDOW_SEC + horizon_ <= watermark) {
+        too_late_++;
+      } else {
+        Window& w = dev.windows[start];
+        w.add(rec.values);
+        if (w.emitted && !w.reported) {
+          w.revision++; // Already published: correct it right away
+          out.push_back(makeEmission(rec.device, start, w));
+          corrections_++;
+        }
+      }
+      advance(rec.device, dev, watermark, out);
+    }
+    for (const Emission& e : out) emit_(e.record, e.revision);
+  }
+
+  /**
+   * @brief Records that the device reported its own hourly row for this hour, so
+   * the derived window never overwrites it. The report also closes the hour, which
+   * bounds the window state of devices that send hourly rows only.
+   */
+  void markReported(const AgroRecord& hourly) {
+    std::vector<Emission> out;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      DeviceState& dev = devices_[hourly.device];
+      int64_t start = windowStart(hourly.epoch);
+      int64_t watermark = dev.max_epoch - allowed_lateness_;
+      if (start + WINDOW_SEC + horizon_ <= watermark) return;
+      Window& w = dev.windows[start];
+      if (!w.reported) superseded_++;
+      w.reported = true;
+      if (watermark < start + WINDOW_SEC) watermark = start + WINDOW_SEC;
+      advance(hourly.device, dev, watermark, out);
+    }
+    for (const Emission& e : out) emit_(e.record, e.revision);
+  }
+
+  /**
+   * @brief Closes windows of devices that stopped reporting (processing-time
+   * fallback: their watermark would otherwise never move).
+   */
+  void tick(int64_t now) {
+    std::vector<Emission> out;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      for (auto& d : devices_) {
+        DeviceState& dev = d.second;
+        if (now - dev.last_arrival < WINDOW_IDLE_CLOSE_SEC) continue;
+        // Pretend the watermark reached the end of the newest window
+        advance(d.first, dev, windowStart(dev.max_epoch) + WINDOW_SEC, out);
+      }
+    }
+    for (const Emission& e : out) emit_(e.record, e.revision);
+  }
+
+  Stats stats() {
+    Stats s;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto& d : devices_) {
+      for (auto& w : d.second.windows) {
+        if (w.second.emitted) {
+          s.retained_windows++;
+        } else {
+          s.open_windows++;
+        }
+      }
+    }
+    s.samples         = samples_;
+    s.windows_emitted = emitted_;
+    s.corrections     = corrections_;
+    s.too_late        = too_late_;
+    s.superseded      = superseded_;
+    return s;
+  }
+
+ private:
+  struct Window {
+    double   sum[NUM_CHANNELS]   = {0};
+    uint32_t count[NUM_CHANNELS] = {0};
+    bool     emitted  = false;
+    bool     reported = false; // The device sent its own hourly row for this hour
+    uint32_t revision = 0;
+
+    void add(const float* values) {
+      for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+        if (std::isnan(values[ch])) continue; // Same rule as calculateAverage() on the device
+        sum[ch] += values[ch];
+        count[ch]++;
+      }
+    }
+  };
+
+  struct DeviceState {
+    int64_t                   max_epoch    = 0;
+    int64_t                   last_arrival = 0;
+    std::map<int64_t, Window> windows; // Keyed on window start
+  };
+
+  struct Emission {
+    AgroRecord record;
+    uint32_t   revision;
+  };
+
+  static int64_t windowStart(int64_t epoch) {
+    int64_t q = epoch / WINDOW_SEC;
+    if (epoch % WINDOW_SEC < 0) q--;
+    return q * WINDOW_SEC;
+  }
+
+  Emission makeEmission(const std::string& device, int64_t start, const Window& w) {
+    Emission e;
+    e.record.device = device;
+    e.record.epoch = start;
+    e.record.res = Resolution::HOURLY;
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+      e.record.values[ch] = w.count[ch] ? (float)(w.sum[ch] / w.count[ch]) : NAN;
+    }
+    e.revision = w.revision;
+    return e;
+  }
+
+  /**
+   * @brief Emits windows whose end the watermark has passed and evicts windows
+   * that fell out of the correction horizon. Caller holds mu_.
+   */
+  void advance(const std::string& device, DeviceState& dev, int64_t watermark, std::vector<Emission>& out) {
+    for (auto it = dev.windows.begin(); it != dev.windows.end();) {
+      int64_t end = it->first + WINDOW_SEC;
+      if (end > watermark) break; // Windows are ordered; the rest are still open
+      Window& w = it->second;
+      if (!w.emitted) {
+        w.emitted = true;
+        if (!w.reported) {
+          out.push_back(makeEmission(device, it->first, w));
+          emitted_++;
+        }
+      }
+      if (end + horizon_ <= watermark) {
+        it = dev.windows.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  int64_t      allowed_lateness_;
+  int64_t      horizon_;
+  EmitCallback emit_;
+
+  std::mutex                                   mu_;
+  std::unordered_map<std::string, DeviceState> devices_;
+  uint64_t samples_     = 0;
+  uint64_t emitted_     = 0;
+  uint64_t corrections_ = 0;
+  uint64_t too_late_    = 0;
+  uint64_t superseded_  = 0;
+
+  std::thread             thread_;
+  std::mutex              wake_mu_;
+  std::condition_variable wake_cv_;
+  std::atomic<bool>       stopping_{false};
+};